@@ -0,0 +1,423 @@
+/*
+ * host_port.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * ESP-IDF functions and the HAL (see ../main/midi_hal.c) on a PC.
+ * The timers run on a virtual clock, which jumps to the next due timer
+ * instead of waiting. So songs play in a fraction of their duration,
+ * the MIDI bytes go to a sink with the time they would have on the wire.
+ */
+
+#include "local.h"
+
+#define HOST_TIMERS 16
+#define HOST_NVS_ENTRIES 16
+
+struct hal_timer {
+	t_hal_timer_cb callback;
+	void *arg;
+	const char *name;
+	int armed;
+	int64_t due;
+	int64_t period; // 0 for one shot timers
+};
+
+struct hal_queue {
+	int len;
+	int size;
+	int first;
+	int n;
+	char items[];
+};
+
+static const char *TAG = "host_port";
+
+int host_verbose = 0;
+long host_bytes = 0; // written to MIDI out
+const char *host_base_path = ".";
+
+static struct hal_timer timers[HOST_TIMERS];
+static int ntimers = 0;
+static int64_t host_now = 0;
+static int real_clock = false; // the clock runs while the code runs
+static int64_t real_base = 0; // stopwatch at host_now
+static int64_t wall_base = 0; // wall clock at wall_set
+static int64_t wall_set = 0;
+static long wall_drift_ppm = 0;
+
+struct nvs_entry {
+	char ns[16];
+	char key[16];
+	void *data;
+	size_t len;
+};
+
+static struct nvs_entry nvs[HOST_NVS_ENTRIES];
+static char nvs_namespaces[HOST_NVS_ENTRIES][16];
+static int nvs_nnamespaces = 0;
+
+static t_host_midi_sink midi_sink = NULL;
+static void *midi_sink_ctx = NULL;
+
+void host_log(int always, const char *tag, const char *fmt, ...) {
+	if ( !always && !host_verbose) {
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "%10lld %s: ", (long long) host_now, tag);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+
+uint32_t esp_random(void) {
+	return (uint32_t) rand();
+}
+
+void vTaskDelete(void *task) {
+}
+
+int64_t hal_time_us() {
+	if ( real_clock) {
+		return host_now + hal_stopwatch_us() - real_base;
+	}
+	return host_now;
+}
+
+/**
+ * real time for measurements
+ */
+int64_t hal_stopwatch_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * wall clock on the virtual clock, running 'drift_ppm' faster.
+ * Set to 'wall_us' now, like SNTP does
+ */
+void host_set_wall(int64_t wall_us, long drift_ppm) {
+	wall_base = wall_us;
+	wall_set = hal_time_us();
+	wall_drift_ppm = drift_ppm;
+}
+
+int64_t hal_wall_us() {
+	int64_t t = hal_time_us() - wall_set;
+	return wall_base + t + t * wall_drift_ppm / 1000000;
+}
+
+int hal_core_id() {
+	return 0;
+}
+
+/**
+ * one task, no interrupts
+ */
+void hal_critical_enter() {
+}
+
+void hal_critical_exit() {
+}
+
+t_hal_timer hal_timer_create(t_hal_timer_cb callback, void *arg, const char *name) {
+	// aborts like on the device
+	if ( ntimers >= HOST_TIMERS) {
+		ESP_LOGE(TAG, "%s: more than %d timers", name, HOST_TIMERS);
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	t_hal_timer t = &timers[ntimers++];
+	memset(t, 0, sizeof(struct hal_timer));
+	t->callback = callback;
+	t->arg = arg;
+	t->name = name;
+	return t;
+}
+
+/**
+ * one clock for all timers
+ */
+t_hal_timer hal_timer_create_play(t_hal_timer_cb callback, void *arg, const char *name) {
+	return hal_timer_create(callback, arg, name);
+}
+
+static void timer_start(t_hal_timer timer, int64_t timeout_us, int64_t period_us) {
+	if ( timer->armed) {
+		ESP_LOGE(TAG, "timer %s already running", timer->name);
+		abort();
+	}
+	timer->armed = true;
+	timer->due = hal_time_us() + timeout_us;
+	timer->period = period_us;
+}
+
+void hal_timer_once(t_hal_timer timer, int64_t timeout_us) {
+	timer_start(timer, timeout_us, 0);
+}
+
+/**
+ * one task only, it just rearms
+ */
+void hal_timer_wake(t_hal_timer timer, int64_t timeout_us) {
+	timer->armed = false;
+	timer_start(timer, timeout_us, 0);
+}
+
+void hal_timer_periodic(t_hal_timer timer, int64_t period_us) {
+	timer_start(timer, period_us, period_us);
+}
+
+esp_err_t hal_timer_start_periodic(t_hal_timer timer, int64_t period_us) {
+	if ( timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer_start(timer, period_us, period_us);
+	return ESP_OK;
+}
+
+void hal_timer_stop(t_hal_timer timer) {
+	timer->armed = false;
+}
+
+void hal_midi_init() {
+}
+
+/**
+ * MIDI in is fed by midihost with midi_in_input
+ */
+int hal_midi_read(unsigned char *buf, int len, int timeout_ms) {
+	return 0;
+}
+
+/**
+ * no tasks on the virtual clock, midihost calls the services itself
+ */
+int hal_task_start(void (*task)(void *arg), const char *name, int stack, int priority, int core, void *arg) {
+	return 0;
+}
+
+/**
+ * no buttons, midihost injects presses with gpio_inject
+ */
+void hal_gpio_input(const int *pins, int npins, void (*isr)(void *arg)) {
+}
+
+/**
+ * released, pulled up
+ */
+int hal_gpio_level(int pin) {
+	return 1;
+}
+
+t_hal_queue hal_queue_create(int len, int size) {
+	t_hal_queue queue = calloc(1, sizeof(struct hal_queue) + len * size);
+	if ( !queue) {
+		ESP_LOGE(TAG, "no memory for a queue of %d items", len);
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	queue->len = len;
+	queue->size = size;
+	return queue;
+}
+
+int hal_queue_send(t_hal_queue queue, const void *item) {
+	if ( queue->n >= queue->len) {
+		return -1;
+	}
+	memcpy(&queue->items[(queue->first + queue->n++) % queue->len * queue->size], item, queue->size);
+	return 0;
+}
+
+/**
+ * nothing sends while waiting on the virtual clock, so never waits
+ */
+int hal_queue_receive(t_hal_queue queue, void *item, int timeout_ms) {
+	if ( queue->n == 0) {
+		return false;
+	}
+	memcpy(item, &queue->items[queue->first * queue->size], queue->size);
+	queue->first = (queue->first + 1) % queue->len;
+	queue->n--;
+	return true;
+}
+
+int hal_queue_pending(t_hal_queue queue) {
+	return queue->n;
+}
+
+void hal_midi_write(const char *data, int len) {
+	host_bytes += len;
+	if ( midi_sink) {
+		midi_sink(hal_time_us(), (const unsigned char *) data, len, midi_sink_ctx);
+	}
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle) {
+	for ( int i = 0; i < nvs_nnamespaces; i++) {
+		if ( !strcmp(nvs_namespaces[i], name)) {
+			*handle = i;
+			return ESP_OK;
+		}
+	}
+	if ( mode == NVS_READONLY) {
+		return ESP_ERR_NVS_NOT_FOUND;
+	}
+	if ( nvs_nnamespaces >= HOST_NVS_ENTRIES) {
+		return ESP_ERR_NO_MEM;
+	}
+	snprintf(nvs_namespaces[nvs_nnamespaces], sizeof(nvs_namespaces[0]), "%s", name);
+	*handle = nvs_nnamespaces++;
+	return ESP_OK;
+}
+
+static struct nvs_entry *nvs_find(nvs_handle handle, const char *key) {
+	for ( int i = 0; i < HOST_NVS_ENTRIES; i++) {
+		if ( nvs[i].data && !strcmp(nvs[i].ns, nvs_namespaces[handle]) && !strcmp(nvs[i].key, key)) {
+			return &nvs[i];
+		}
+	}
+	return NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *value, size_t *length) {
+	struct nvs_entry *e = nvs_find(handle, key);
+	if ( !e) {
+		return ESP_ERR_NVS_NOT_FOUND;
+	}
+	if ( *length < e->len) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	memcpy(value, e->data, e->len);
+	*length = e->len;
+	return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length) {
+	struct nvs_entry *e = nvs_find(handle, key);
+	for ( int i = 0; !e && i < HOST_NVS_ENTRIES; i++) {
+		if ( !nvs[i].data) {
+			e = &nvs[i];
+			snprintf(e->ns, sizeof(e->ns), "%s", nvs_namespaces[handle]);
+			snprintf(e->key, sizeof(e->key), "%s", key);
+		}
+	}
+	if ( !e) {
+		return ESP_ERR_NO_MEM;
+	}
+	free(e->data);
+	e->data = malloc(length ? length : 1);
+	memcpy(e->data, value, length);
+	e->len = length;
+	return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key) {
+	struct nvs_entry *e = nvs_find(handle, key);
+	if ( !e) {
+		return ESP_ERR_NVS_NOT_FOUND;
+	}
+	free(e->data);
+	e->data = NULL;
+	return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle handle) {
+	return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle) {
+}
+
+void blue_on() {
+}
+
+void blue_off() {
+}
+
+void host_set_midi_sink(t_host_midi_sink sink, void *ctx) {
+	midi_sink = sink;
+	midi_sink_ctx = ctx;
+}
+
+static void set_now(int64_t time) {
+	host_now = time;
+	real_base = hal_stopwatch_us();
+}
+
+/**
+ * with 'on' the time the code takes counts, the clock still jumps
+ * over the waits to the next timer
+ */
+void host_real_clock(int on) {
+	set_now(hal_time_us());
+	real_clock = on;
+}
+
+static t_hal_timer next_timer() {
+	t_hal_timer next = NULL;
+	for ( int i = 0; i < ntimers; i++) {
+		if ( timers[i].armed && (!next || timers[i].due < next->due)) {
+			next = &timers[i];
+		}
+	}
+	return next;
+}
+
+/**
+ * time of the next timer, -1 if no timer is armed
+ */
+int host_timer_next(int64_t *due) {
+	t_hal_timer t = next_timer();
+	if ( !t) {
+		return -1;
+	}
+	*due = t->due;
+	return 0;
+}
+
+/**
+ * advance the clock to the next timer and call it,
+ * returns -1 if no timer is armed
+ */
+int host_timer_run_next() {
+	t_hal_timer t = next_timer();
+	if ( !t) {
+		return -1;
+	}
+	set_now(MAX(t->due, hal_time_us()));
+	if ( t->period) {
+		t->due += t->period;
+	} else {
+		t->armed = false;
+	}
+	t->callback(t->arg);
+	return 0;
+}
+
+/**
+ * runs the timers due until 'time' and sets the clock to it
+ */
+void host_advance(int64_t time) {
+	host_run(time);
+	if ( time > hal_time_us()) {
+		set_now(time);
+	}
+}
+
+/**
+ * runs the timers until none is armed or the next one is after 'until',
+ * returns the number of timer calls
+ */
+long host_run(int64_t until) {
+	long calls = 0;
+	int64_t due;
+	while ( host_timer_next(&due) == 0 && due <= until) {
+		host_timer_run_next();
+		calls++;
+	}
+	return calls;
+}
@@ -0,0 +1,100 @@
+/*
+ * host_port.h
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * the parts of ESP-IDF used by the player, mixer and synthesizer,
+ * to build them on a PC. Timers run on a virtual clock, the midi
+ * output is passed to a sink instead of the UART.
+ */
+
+#ifndef ESP32MIDI_HOST_HOST_PORT_H_
+#define ESP32MIDI_HOST_HOST_PORT_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// esp_err.h
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+
+#define ESP_ERROR_CHECK(x) do { \
+		esp_err_t __rc = (x); \
+		if (__rc != ESP_OK) { \
+			fprintf(stderr, "%s:%d: %s failed, rc=%d\n", __FILE__, __LINE__, #x, __rc); \
+			abort(); \
+		} \
+	} while (0)
+
+// esp_log.h
+extern int host_verbose;
+void host_log(int always, const char *tag, const char *fmt, ...); // no format check, the formats are written for the 32 bit ESP32
+#define ESP_LOGE(tag, fmt, ...) host_log(1, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log(1, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log(0, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) host_log(0, tag, fmt, ##__VA_ARGS__)
+
+// esp_attr.h
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+// esp_vfs.h, sdkconfig
+#define ESP_VFS_PATH_MAX 15
+extern const char *host_base_path; // the songs, "/spiffs" on the device
+#define BASE_PATH host_base_path
+#define CONFIG_SPIFFS_OBJ_NAME_LEN 32
+// task placement and polyphony, see ../main/Kconfig.projbuild
+#define CONFIG_MIDI_PLAY_CORE 1
+#define CONFIG_MIDI_PLAY_PRIORITY 20
+#define CONFIG_MIDI_IN_PRIORITY 12
+#define CONFIG_MIDI_NET_CORE 0
+#define CONFIG_MIDI_HTTPD_PRIORITY 5
+#define CONFIG_MIDI_SYNTH_POLYPHONY 38
+
+// driver/gpio.h
+#define GPIO_NUM_4 4
+#define GPIO_NUM_5 5
+
+// esp_system.h
+uint32_t esp_random(void);
+
+// freertos/task.h
+void vTaskDelete(void *task);
+
+// nvs.h, kept in memory
+typedef uint32_t nvs_handle;
+typedef nvs_handle nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode;
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle);
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *value, size_t *length);
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length);
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key);
+esp_err_t nvs_commit(nvs_handle handle);
+void nvs_close(nvs_handle handle);
+
+// host side of the port, the HAL functions are in local.h
+extern long host_bytes;
+typedef void (*t_host_midi_sink)(int64_t time, const unsigned char *data, int len, void *ctx);
+void host_set_midi_sink(t_host_midi_sink sink, void *ctx);
+int host_timer_next(int64_t *due);
+int host_timer_run_next();
+long host_run(int64_t until);
+void host_advance(int64_t time);
+void host_set_wall(int64_t wall_us, long drift_ppm);
+void host_real_clock(int on);
+
+#endif /* ESP32MIDI_HOST_HOST_PORT_H_ */
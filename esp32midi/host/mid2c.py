@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# mid2c.py
+#
+#  Created on: 19 Oct 2026
+#      Author: ankrysm
+#
+# compiles MIDI files into C tables of channel messages with their time
+# in µs, played from flash by play_jingle (../main/midi_util.c) without
+# parsing. Tempo changes are applied here, meta events and sysex dropped.
+# The name of a jingle is the file name without .mid
+#
+# usage: mid2c.py -o jingles.c song.mid ...
+#
+
+import os
+import struct
+import sys
+
+DATA_LEN = {0x80: 2, 0x90: 2, 0xA0: 2, 0xB0: 2, 0xC0: 1, 0xD0: 1, 0xE0: 2}
+
+
+def read_varlen(buf, pos):
+    value = 0
+    while True:
+        c = buf[pos]
+        pos += 1
+        value = (value << 7) | (c & 0x7F)
+        if not c & 0x80:
+            return value, pos
+
+
+def read_track(buf, trackno):
+    """(tick, trackno, seq, tempo or None, message bytes) of a track"""
+    events = []
+    pos = 0
+    tick = 0
+    status = 0
+    while pos < len(buf):
+        delta, pos = read_varlen(buf, pos)
+        tick += delta
+        c = buf[pos]
+        if c == 0xFF:
+            kind = buf[pos + 1]
+            length, pos = read_varlen(buf, pos + 2)
+            if kind == 0x51 and length == 3:
+                tempo = (buf[pos] << 16) | (buf[pos + 1] << 8) | buf[pos + 2]
+                events.append((tick, trackno, len(events), tempo, None))
+            pos += length
+            if kind == 0x2F:
+                break
+            continue
+        if c in (0xF0, 0xF7):
+            length, pos = read_varlen(buf, pos + 1)
+            pos += length
+            continue
+        if c & 0x80:
+            status = c
+            pos += 1
+        elif not status:
+            raise ValueError("track %d: data byte without status" % trackno)
+        n = DATA_LEN[status & 0xF0]
+        events.append((tick, trackno, len(events), None, bytes([status]) + buf[pos:pos + n]))
+        pos += n
+    return events
+
+
+def compile_midi(path):
+    """the channel messages of a file as (µs, bytes), sorted by time"""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[0:4] != b"MThd":
+        raise ValueError("%s: not a MIDI file" % path)
+    hdrlen, fmt, ntracks, division = struct.unpack(">IHHH", data[4:14])
+    if division & 0x8000:
+        raise ValueError("%s: SMPTE time is not supported" % path)
+    pos = 8 + hdrlen
+    events = []
+    for trackno in range(ntracks):
+        if data[pos:pos + 4] != b"MTrk":
+            raise ValueError("%s: track %d missing" % (path, trackno))
+        length = struct.unpack(">I", data[pos + 4:pos + 8])[0]
+        events += read_track(data[pos + 8:pos + 8 + length], trackno)
+        pos += 8 + length
+    events.sort(key=lambda e: e[0:3])
+
+    out = []
+    tempo = 500000  # µs per quarter note
+    last_tick = 0
+    us = 0
+    for tick, _, _, new_tempo, msg in events:
+        us += (tick - last_tick) * tempo // division
+        last_tick = tick
+        if new_tempo:
+            tempo = new_tempo
+        else:
+            out.append((us, msg))
+    return out
+
+
+def c_name(path):
+    name = os.path.splitext(os.path.basename(path))[0]
+    return "".join(c if c.isalnum() else "_" for c in name)
+
+
+def main(argv):
+    if len(argv) < 3 or argv[0] != "-o":
+        sys.stderr.write("usage: mid2c.py -o jingles.c song.mid ...\n")
+        return 1
+    paths = sorted(argv[2:])
+    lines = ["/*",
+             " * jingles.c, generated by host/mid2c.py from",
+             ]
+    lines += [" *   %s" % os.path.basename(p) for p in paths]
+    lines += [" */", "", '#include "local.h"', ""]
+    table = []
+    for path in paths:
+        name = c_name(path)
+        events = compile_midi(path)
+        if not events:
+            raise ValueError("%s: nothing to play" % path)
+        lines.append("static const t_jingle_evt %s_evts[] = {" % name)
+        for us, msg in events:
+            lines.append("\t{ %d, %d, { %s } }," % (us, len(msg), ", ".join("0x%02X" % b for b in msg)))
+        lines.append("};")
+        lines.append("")
+        table.append('\t{ "%s", %d, %s_evts },' % (name, len(events), name))
+    lines.append("const t_jingle jingles[] = {")
+    lines += table
+    lines.append("\t{ NULL, 0, NULL }")
+    lines.append("};")
+    text = "\n".join(lines) + "\n"
+
+    with open(argv[1], "w") as f:
+        f.write(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,1421 @@
+/*
+ * midihost.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * player, mixer and synthesizer on a PC:
+ *   midihost play [-d] [-t trace.json] [-x rules] <song>...
+ *   midihost record <dump> <out.mid>
+ *   midihost thru [-d] <song> <dump>
+ *   midihost render <song> <out.wav> [rate] [start_ms]
+ *   midihost bench-synth [voices] [seconds] [rate]
+ *   midihost chime-sim <rules> <yyyy-mm-dd> [days]
+ *   midihost rtp-sim [seconds] [jitter_us] [drift_ppm] [loss_permille]
+ *   midihost align <song> [starts] [drift_ppm] [step_us]
+ */
+
+#include "local.h"
+
+static const char *TAG = "midihost";
+
+#define DEFAULT_RATE 44100
+#define TAIL_US 2000000 // rendered after the end of the song
+#define RENDER_CHUNK 1024
+#define ALIGN_WALL_START 1792368000000000LL // 2026-10-19 00:00 UTC
+#define ALIGN_PREROLL_US 1000000 // like the chimes
+
+typedef struct {
+	FILE *fd;
+	int rate;
+	int64_t samples; // rendered so far
+} t_wav_out;
+
+static void put_le(FILE *fd, uint32_t v, int len) {
+	for ( int i = 0; i < len; i++) {
+		fputc((v >> (8*i)) & 0xFF, fd);
+	}
+}
+
+static void wav_header(t_wav_out *wav) {
+	uint32_t datalen = wav->samples * 2;
+	fseek(wav->fd, 0, SEEK_SET);
+	fwrite("RIFF", 1, 4, wav->fd);
+	put_le(wav->fd, 36 + datalen, 4);
+	fwrite("WAVEfmt ", 1, 8, wav->fd);
+	put_le(wav->fd, 16, 4); // fmt length
+	put_le(wav->fd, 1, 2); // PCM
+	put_le(wav->fd, 1, 2); // mono
+	put_le(wav->fd, wav->rate, 4);
+	put_le(wav->fd, wav->rate * 2, 4); // bytes per second
+	put_le(wav->fd, 2, 2); // block align
+	put_le(wav->fd, 16, 2); // bits per sample
+	fwrite("data", 1, 4, wav->fd);
+	put_le(wav->fd, datalen, 4);
+}
+
+/**
+ * render audio up to the given time
+ */
+static void render_until(t_wav_out *wav, int64_t time) {
+	int16_t buf[RENDER_CHUNK];
+	int64_t end = time * wav->rate / 1000000;
+	while ( wav->samples < end) {
+		int n = end - wav->samples > RENDER_CHUNK ? RENDER_CHUNK : end - wav->samples;
+		synth_render(buf, n);
+		for ( int i = 0; i < n; i++) {
+			put_le(wav->fd, (uint16_t) buf[i], 2);
+		}
+		wav->samples += n;
+	}
+}
+
+static void render_sink(int64_t time, const unsigned char *data, int len, void *ctx) {
+	t_wav_out *wav = ctx;
+	render_until(wav, time);
+	synth_midi_in(data, len);
+}
+
+static int render(const char *songpath, const char *wavpath, int rate, long start_ms) {
+	t_wav_out wav = { NULL, rate, 0 };
+	int rc = -1;
+
+	do {
+		if ( !(wav.fd = fopen(wavpath, "wb"))) {
+			ESP_LOGE(TAG, "cannot create %s", wavpath);
+			break;
+		}
+		wav_header(&wav);
+		synth_init(rate);
+		host_set_midi_sink(render_sink, &wav);
+
+		int64_t t0 = hal_stopwatch_us();
+		if ( mixer_play(MIX_MAIN_PLAYER, songpath, false, start_ms)) {
+			break;
+		}
+		host_run(INT64_MAX); // the mixer sends the midi bytes to the sink
+		render_until(&wav, hal_time_us() + TAIL_US);
+		wav_header(&wav);
+
+		int64_t used = hal_stopwatch_us() - t0;
+		printf("%s: %lld samples, %lld ms audio rendered in %lld ms\n", wavpath,
+				(long long) wav.samples, (long long) (wav.samples * 1000 / rate), (long long) (used / 1000));
+		rc = 0;
+	} while(0);
+
+	host_set_midi_sink(NULL, NULL);
+	if ( wav.fd) {
+		fclose(wav.fd);
+	}
+	return rc;
+}
+
+/**
+ * the contents of a text file, to be freed. NULL if it can't be read
+ */
+static char *read_text(const char *path) {
+	struct stat st;
+	FILE *fd = NULL;
+	char *text = NULL;
+
+	if ( stat(path, &st) || !(fd = fopen(path, "r")) || !(text = calloc(1, st.st_size + 1))) {
+		ESP_LOGE(TAG, "cannot read %s", path);
+	} else if ( fread(text, 1, st.st_size, fd) != st.st_size) {
+		ESP_LOGE(TAG, "cannot read %s", path);
+		free(text);
+		text = NULL;
+	}
+	if ( fd) {
+		fclose(fd);
+	}
+	return text;
+}
+
+static int set_xform(const char *path) {
+	char err[128];
+	char *text = read_text(path);
+	int rc = !text || xform_set_rules(text, err, sizeof(err)) ? -1 : 0;
+	free(text);
+	return rc;
+}
+
+static void dump_sink(int64_t time, const unsigned char *data, int len, void *ctx) {
+	printf("%10lld", (long long) time);
+	for ( int i = 0; i < len; i++) {
+		printf(" %02X", data[i]);
+	}
+	putchar('\n');
+}
+
+static int trace_put_file(const char *txt, void *ctx) {
+	return fputs(txt, (FILE *) ctx) < 0 ? -1 : 0;
+}
+
+static int write_trace(const char *path) {
+	FILE *fd = fopen(path, "w");
+	if ( !fd) {
+		ESP_LOGE(TAG, "cannot create %s", path);
+		return -1;
+	}
+	int n = trace_export(trace_put_file, fd);
+	fclose(fd);
+	fprintf(stderr, "%s: %d trace records\n", path, n);
+	return n < 0 ? -1 : 0;
+}
+
+static long play_rate = RATE_ONE; // set by -r
+static long play_rate_at_ms = 0; // into each song, 0 from the start
+
+/**
+ * plays the songs one after the other on the virtual clock,
+ * with 'dump' the bytes for the wire are listed with their time
+ */
+static int play(char **songs, int nsongs, int dump) {
+	int rc = 0;
+	host_set_midi_sink(dump ? dump_sink : NULL, NULL);
+	int64_t t0 = hal_stopwatch_us();
+	int64_t total = 0;
+	for ( int i = 0; i < nsongs; i++) {
+		int64_t start = hal_time_us();
+		long bytes = host_bytes;
+		int64_t used = hal_stopwatch_us();
+		if ( dump) {
+			printf("# %s\n", songs[i]);
+		}
+		mixer_set_rate(play_rate_at_ms ? RATE_ONE : play_rate);
+		if ( mixer_play(MIX_MAIN_PLAYER, songs[i], false, 0)) {
+			rc = -1;
+			continue;
+		}
+		long calls = 0;
+		if ( play_rate_at_ms) {
+			calls = host_run(start + play_rate_at_ms * 1000);
+			host_advance(start + play_rate_at_ms * 1000);
+			mixer_set_rate(play_rate);
+		}
+		calls += host_run(INT64_MAX);
+		used = hal_stopwatch_us() - used;
+		total += hal_time_us() - start;
+		fprintf(dump ? stderr : stdout, "%s: %lld ms, %ld bytes, %ld timer calls, played in %lld us\n",
+				songs[i], (long long) ((hal_time_us() - start) / 1000), host_bytes - bytes,
+				calls, (long long) used);
+	}
+	int64_t used = hal_stopwatch_us() - t0;
+	fprintf(dump ? stderr : stdout, "%d songs, %lld s music played in %lld ms\n",
+			nsongs, (long long) (total / 1000000), (long long) (used / 1000));
+	t_voice_stat st;
+	voice_get_stat(&st, true);
+	fprintf(dump ? stderr : stdout, "voices: peak %d of %d, %ld notes dropped, %ld shortened\n",
+			st.peak, st.limit, st.dropped, st.stolen);
+	host_set_midi_sink(NULL, NULL);
+	return rc;
+}
+
+/**
+ * lists the jingles compiled in, or plays one on the virtual clock
+ * and lists its bytes with their time
+ */
+static int jingle(const char *name) {
+	if ( !name) {
+		for ( const t_jingle *j = jingles; j->name; j++) {
+			printf("%-12s %3d events, %lld ms, %d bytes\n", j->name, j->nevents,
+					(long long) j->evts[j->nevents - 1].time_us / 1000,
+					(int) (j->nevents * sizeof(t_jingle_evt)));
+		}
+		return 0;
+	}
+	host_set_midi_sink(dump_sink, NULL);
+	int rc = play_jingle(name);
+	host_run(INT64_MAX);
+	host_set_midi_sink(NULL, NULL);
+	return rc;
+}
+
+/**
+ * optimizes a song as at the upload with ?optimize
+ */
+static int optimize(const char *srcpath, const char *dstpath, int tolerance) {
+	char report[300];
+	int rc = optimize_midifile(srcpath, dstpath, tolerance, report, sizeof(report));
+	printf("%s\n", report);
+	return rc;
+}
+
+static int export_put(const char *data, size_t len, void *ctx) {
+	return fwrite(data, 1, len, ctx) == len ? 0 : -1;
+}
+
+/**
+ * the decoded events of a song to stdout as /export sends them,
+ * through a buffer of the size of the file servers scratch buffer
+ */
+static int export(const char *filepath, int binary) {
+	char buf[8192];
+	int n = export_song(filepath, binary, buf, sizeof(buf), export_put, stdout);
+	if ( n < 0) {
+		return -1;
+	}
+	fprintf(stderr, "%s: %d events\n", filepath, n);
+	return 0;
+}
+
+/**
+ * the peak polyphony of the songs, as reported at the upload
+ */
+static int poly(char **songs, int nsongs) {
+	int rc = 0;
+	for ( int i = 0; i < nsongs; i++) {
+		int peak = midi_song_polyphony(songs[i]);
+		if ( peak < 0) {
+			rc = -1;
+			continue;
+		}
+		printf("%s: peak polyphony %d of %d%s\n", songs[i], peak, CONFIG_MIDI_SYNTH_POLYPHONY,
+				peak > CONFIG_MIDI_SYNTH_POLYPHONY ? ", notes are dropped" : "");
+	}
+	return rc;
+}
+
+/**
+ * feeds MIDI in with a list of bytes with their time (as from play -d),
+ * the bytes arrive one byte time each after the given time. Timers due
+ * before are run first
+ */
+static int feed_input(const char *dumppath) {
+	char line[1024];
+	unsigned char data[sizeof(line) / 3];
+
+	FILE *fd = fopen(dumppath, "r");
+	if ( !fd) {
+		ESP_LOGE(TAG, "cannot read %s", dumppath);
+		return -1;
+	}
+	while ( fgets(line, sizeof(line), fd)) {
+		char *p = line;
+		char *end;
+		long long time = strtoll(p, &end, 10);
+		if ( end == p || line[0] == '#') {
+			continue;
+		}
+		int n = 0;
+		for ( p = end; n < sizeof(data); p = end) {
+			long b = strtol(p, &end, 16);
+			if ( end == p) {
+				break;
+			}
+			data[n++] = b;
+		}
+		int64_t received = time + (int64_t) n * MIDI_BYTE_US;
+		host_advance(received);
+		midi_in_input(data, n, received);
+		midi_in_service(false);
+	}
+	fclose(fd);
+	return 0;
+}
+
+static void print_in_stat(FILE *out) {
+	t_midi_in_stat s;
+	midi_in_get_stat(&s);
+	fprintf(out, "in: %ld bytes, %ld messages, %ld realtime, %ld sysex, %ld incomplete, %ld stray\n",
+			s.bytes, s.events, s.realtime, s.sysex, s.incomplete, s.stray);
+	if ( s.recorded || s.dropped) {
+		fprintf(out, "recorded: %ld events, %ld dropped\n", s.recorded, s.dropped);
+	}
+	if ( s.thru) {
+		fprintf(out, "thru: %ld messages, latency avg %lld us, max %ld us, %ld late, %ld conflicts, %ld dropped\n",
+				s.thru, (long long) (s.thru_sum_us / s.thru), (long) s.thru_max_us, s.thru_late,
+				s.conflicts, s.thru_dropped);
+	}
+}
+
+/**
+ * records MIDI in from a list of bytes to a SMF
+ */
+static int record(const char *dumppath, const char *midipath) {
+	midi_in_thru(false);
+	if ( midi_in_record(midipath)) {
+		return -1;
+	}
+	int rc = feed_input(dumppath);
+	midi_in_stop();
+	midi_in_service(true);
+	printf("%s:\n", midipath);
+	print_in_stat(stdout);
+	return rc;
+}
+
+/**
+ * plays a song and merges MIDI in from a list of bytes with it,
+ * with 'dump' the bytes for the wire are listed with their time
+ */
+static int thru(const char *songpath, const char *dumppath, int dump) {
+	int rc = -1;
+	host_set_midi_sink(dump ? dump_sink : NULL, NULL);
+	midi_in_thru(true);
+	if ( !mixer_play(MIX_MAIN_PLAYER, songpath, false, 0) && !feed_input(dumppath)) {
+		host_run(INT64_MAX);
+		rc = 0;
+	}
+	host_set_midi_sink(NULL, NULL);
+	print_in_stat(dump ? stderr : stdout);
+	return rc;
+}
+
+/**
+ * renders held notes, the result is the CPU load per voice
+ */
+static int bench_synth(int nvoices, int seconds, int rate) {
+	int16_t buf[RENDER_CHUNK];
+
+	if ( nvoices < 1 || nvoices > SYNTH_VOICES || seconds < 1) {
+		ESP_LOGE(TAG, "1..%d voices, at least one second", SYNTH_VOICES);
+		return -1;
+	}
+	synth_init(rate);
+	for ( int i = 0; i < nvoices; i++) {
+		// organs on 8 channels, they sound until note off
+		unsigned char chan = i % 8;
+		unsigned char prg[2] = { 0xC0 | chan, 16 };
+		unsigned char on[3] = { 0x90 | chan, 36 + i * 2, 100 };
+		synth_midi_in(prg, sizeof(prg));
+		synth_midi_in(on, sizeof(on));
+	}
+
+	int64_t total = (int64_t) seconds * rate;
+	int64_t t0 = hal_stopwatch_us();
+	for ( int64_t done = 0; done < total; done += RENDER_CHUNK) {
+		synth_render(buf, RENDER_CHUNK);
+	}
+	int64_t used = hal_stopwatch_us() - t0;
+
+	if ( synth_active_voices() != nvoices) {
+		ESP_LOGE(TAG, "only %d of %d voices active", synth_active_voices(), nvoices);
+		return -1;
+	}
+	double load = used / (seconds * 10000.0); // percent of one CPU
+	printf("%d voices, %d Hz: %d s audio in %lld us, CPU load %.3f%%, %.1f voices per CPU percent, %.1f ns per voice sample\n",
+			nvoices, rate, seconds, (long long) used, load, nvoices / load,
+			used * 1000.0 / ((double) total * nvoices));
+	return 0;
+}
+
+/*
+ * network MIDI peer on the virtual clock: a DAW sending notes over a
+ * network with delay, jitter and loss, its clock runs a bit faster
+ */
+
+#define SIM_PENDING 256 // packets on the way
+#define SIM_PKT 64
+#define SIM_PEER_SSRC 0x5EED0001
+#define SIM_BASE_DELAY_US 500
+
+typedef struct {
+	int64_t arrival;
+	int data_port;
+	int len;
+	unsigned char data[SIM_PKT];
+} t_sim_pkt;
+
+static t_sim_pkt sim_pending[SIM_PENDING];
+static int sim_npending = 0;
+static int64_t sim_peer_base = 123456789012LL; // peer clock at our time 0, µs
+static int sim_drift_ppm = 50;
+static long sim_jitter_us = 1000;
+static int sim_loss_permille = 1;
+static long sim_accepted = 0;
+static long sim_feedback = 0;
+static int64_t *sim_sent = NULL; // our time when note i was played on the peer
+static int64_t *sim_played = NULL; // time on the wire
+static long sim_nnotes = 0;
+static long sim_last[3]; // notes of the last packet, switched off by the next one
+static int sim_nlast = 0;
+
+static int64_t sim_peer_clock(int64_t t) {
+	return sim_peer_base + t + t / 1000000 * sim_drift_ppm;
+}
+
+/**
+ * one way delay: base, uniform jitter and sometimes a spike
+ */
+static int64_t sim_delay() {
+	int64_t d = SIM_BASE_DELAY_US + rand() % (sim_jitter_us + 1);
+	if ( rand() % 100 == 0) {
+		d += rand() % (10 * sim_jitter_us + 1);
+	}
+	return d;
+}
+
+static void sim_push(int64_t arrival, int data_port, const unsigned char *data, int len) {
+	if ( sim_npending >= SIM_PENDING || len > SIM_PKT) {
+		ESP_LOGE(TAG, "too many packets on the way");
+		return;
+	}
+	t_sim_pkt *p = &sim_pending[sim_npending++];
+	p->arrival = arrival;
+	p->data_port = data_port;
+	p->len = len;
+	memcpy(p->data, data, len);
+}
+
+static void sim_put_be(unsigned char *p, uint64_t v, int len) {
+	for ( int i = len - 1; i >= 0; i--) {
+		p[i] = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+/**
+ * the peer receives a packet of the doorbell
+ */
+static void sim_receive(int data_port, const unsigned char *pkt, int len, void *ctx) {
+	int64_t now = hal_time_us();
+	if ( len < 4 || pkt[0] != 0xFF || pkt[1] != 0xFF) {
+		return;
+	}
+	if ( pkt[2] == 'O' && pkt[3] == 'K') {
+		sim_accepted++;
+	} else if ( pkt[2] == 'R' && pkt[3] == 'S') {
+		sim_feedback++;
+	} else if ( pkt[2] == 'C' && pkt[3] == 'K' && len == 36 && pkt[8] == 1) {
+		// CK2 with the time the peer got CK1
+		unsigned char ck[36];
+		int64_t back = now + sim_delay();
+		memcpy(ck, pkt, sizeof(ck));
+		sim_put_be(ck + 4, SIM_PEER_SSRC, 4);
+		ck[8] = 2;
+		sim_put_be(ck + 28, sim_peer_clock(back) / 100, 8);
+		sim_push(back + sim_delay(), data_port, ck, sizeof(ck));
+	}
+}
+
+static void sim_session(unsigned char *pkt, int cmd_a, int cmd_b) {
+	memset(pkt, 0, 16);
+	pkt[0] = pkt[1] = 0xFF;
+	pkt[2] = cmd_a;
+	pkt[3] = cmd_b;
+	sim_put_be(pkt + 4, 2, 4);
+	sim_put_be(pkt + 8, 4711, 4);
+	sim_put_be(pkt + 12, SIM_PEER_SSRC, 4);
+}
+
+/**
+ * the mixer writes the notes of a tick at once, each 3 bytes
+ */
+static void sim_sink(int64_t time, const unsigned char *data, int len, void *ctx) {
+	for ( int i = 0; i + 3 <= len; i += 3, time += 3 * MIDI_BYTE_US) {
+		if ( (data[i] & 0xF0) == 0x90 && data[i + 2] > 0) {
+			long id = ((long) (data[i] & 0x0F) * 127 + data[i + 2] - 1) * 128 + data[i + 1];
+			if ( id < sim_nnotes && !sim_played[id]) {
+				sim_played[id] = time;
+			}
+		}
+	}
+}
+
+/**
+ * the peer plays 1..3 notes within 2 ms, each with its own id in channel,
+ * velocity and note, and sends them in one RTP packet. The notes of the
+ * packet before are switched off after them, the synth has voices enough
+ */
+static void sim_notes(int64_t t, uint16_t seq) {
+	unsigned char pkt[SIM_PKT];
+	int n = 1 + rand() % 3;
+	int64_t first = t;
+	int p = 14;
+	unsigned char running = 0;
+
+	for ( int i = 0; i < n; i++) {
+		long id = sim_nnotes++;
+		unsigned char status = 0x90 | ((id / (128 * 127)) % 16);
+		if ( i > 0) {
+			int delta = rand() % 20; // 100 µs
+			t += delta * 100;
+			pkt[p++] = delta;
+		}
+		sim_sent[id] = t;
+		if ( status != running) {
+			pkt[p++] = running = status;
+		}
+		pkt[p++] = id % 128;
+		pkt[p++] = (id / 128) % 127 + 1;
+	}
+	for ( int i = 0; i < sim_nlast; i++) {
+		unsigned char status = 0x90 | ((sim_last[i] / (128 * 127)) % 16);
+		pkt[p++] = 0; // delta
+		if ( status != running) {
+			pkt[p++] = running = status;
+		}
+		pkt[p++] = sim_last[i] % 128;
+		pkt[p++] = 0;
+	}
+	sim_nlast = n;
+	for ( int i = 0; i < n; i++) {
+		sim_last[i] = sim_nnotes - n + i;
+	}
+	pkt[0] = 0x80;
+	pkt[1] = 0x61;
+	sim_put_be(pkt + 2, seq, 2);
+	sim_put_be(pkt + 4, sim_peer_clock(first) / 100, 4);
+	sim_put_be(pkt + 8, SIM_PEER_SSRC, 4);
+	// long header, no journal, first without delta
+	pkt[12] = 0x80 | (p - 14) >> 8;
+	pkt[13] = (p - 14) & 0xFF;
+	if ( rand() % 1000 >= sim_loss_permille) {
+		sim_push(t + sim_delay(), true, pkt, p);
+	}
+}
+
+static int cmp_int64(const void *a, const void *b) {
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const int64_t *v, long n, int pct) {
+	return v[MIN(n - 1, n * pct / 100)];
+}
+
+/**
+ * a session with a simulated peer, reports the latency from the peer
+ * playing a note to the note on the wire
+ */
+static int rtp_sim(int seconds) {
+	unsigned char pkt[SIM_PKT];
+	int64_t end = (int64_t) seconds * 1000000;
+	int64_t gen_next = 500000;
+	int64_t ck_next = 100000;
+	int nck = 0;
+	uint16_t seq = 1000;
+	t_rtp_stat st;
+
+	long max_notes = seconds * 1000L;
+	sim_sent = calloc(max_notes + 3, sizeof(int64_t));
+	sim_played = calloc(max_notes + 3, sizeof(int64_t));
+	int64_t *lat = calloc(max_notes + 3, sizeof(int64_t));
+	if ( !sim_sent || !sim_played || !lat) {
+		ESP_LOGE(TAG, "no memory");
+		return -1;
+	}
+	srand(1);
+	host_set_midi_sink(sim_sink, NULL);
+	rtp_midi_set_send(sim_receive, NULL);
+	rtp_midi_init();
+
+	sim_session(pkt, 'I', 'N');
+	sim_push(1000, false, pkt, 16);
+	sim_push(2000, true, pkt, 16);
+
+	while (1) {
+		int next = -1;
+		for ( int i = 0; i < sim_npending; i++) {
+			if ( next < 0 || sim_pending[i].arrival < sim_pending[next].arrival) {
+				next = i;
+			}
+		}
+		int64_t arrival = next >= 0 ? sim_pending[next].arrival : INT64_MAX;
+		if ( gen_next < end && gen_next <= arrival && gen_next <= ck_next && sim_nnotes + 3 <= max_notes) {
+			sim_notes(gen_next, seq++);
+			gen_next += 5000 + rand() % 45000;
+		} else if ( ck_next < end && ck_next <= arrival) {
+			memset(pkt, 0, 36);
+			pkt[0] = pkt[1] = 0xFF;
+			pkt[2] = 'C';
+			pkt[3] = 'K';
+			sim_put_be(pkt + 4, SIM_PEER_SSRC, 4);
+			sim_put_be(pkt + 12, sim_peer_clock(ck_next) / 100, 8);
+			sim_push(ck_next + sim_delay(), true, pkt, 36);
+			ck_next += ++nck < 6 ? 1500000 : 10000000;
+		} else if ( next >= 0) {
+			t_sim_pkt p = sim_pending[next];
+			sim_pending[next] = sim_pending[--sim_npending];
+			host_advance(p.arrival);
+			rtp_midi_packet(p.data_port, p.data, p.len, p.arrival);
+		} else {
+			break;
+		}
+	}
+	host_run(INT64_MAX);
+	host_set_midi_sink(NULL, NULL);
+
+	long n = 0;
+	int64_t sum = 0;
+	for ( long i = 0; i < sim_nnotes; i++) {
+		if ( sim_played[i]) {
+			lat[n] = sim_played[i] - sim_sent[i];
+			sum += lat[n++];
+		}
+	}
+	rtp_midi_get_stat(&st);
+	int64_t now = hal_time_us();
+	printf("session: %ld accepted, %ld clock syncs, offset error %lld us, drift %ld ppb (%d ppm), "
+			"round trip %ld us, %ld feedbacks\n",
+			sim_accepted, st.syncs, (long long) (st.offset_us - (sim_peer_clock(now) - now)),
+			st.drift_ppb, sim_drift_ppm, st.rtt_us, sim_feedback);
+	printf("packets: %ld received, %ld lost, %ld reordered; events: %ld queued, %ld dropped, %ld late (max %ld us), %ld clamped\n",
+			st.packets, st.lost, st.reordered, st.events, st.dropped, st.late, st.max_late_us, st.clamped);
+	if ( n == 0) {
+		printf("no note played\n");
+		return -1;
+	}
+	qsort(lat, n, sizeof(int64_t), cmp_int64);
+	printf("latency of %ld of %ld notes, us: min %lld, p50 %lld, p90 %lld, p99 %lld, max %lld, mean %lld\n",
+			n, sim_nnotes, (long long) lat[0], (long long) percentile(lat, n, 50),
+			(long long) percentile(lat, n, 90), (long long) percentile(lat, n, 99),
+			(long long) lat[n-1], (long long) (sum / n));
+	// histogram in ms
+	long bins[21] = { 0 };
+	for ( long i = 0; i < n; i++) {
+		bins[MAX(0, MIN(20, lat[i] / 1000))]++;
+	}
+	for ( int b = 0; b <= 20; b++) {
+		if ( bins[b]) {
+			printf("%s%2d ms %6ld %.*s\n", b == 20 ? ">=" : "  ", b, bins[b],
+					(int) (bins[b] * 60 / n), "############################################################");
+		}
+	}
+	free(sim_sent);
+	free(sim_played);
+	free(lat);
+	return 0;
+}
+
+static int64_t align_first = 0; // wall clock time of the first byte
+
+static void align_sink(int64_t time, const unsigned char *data, int len, void *ctx) {
+	if ( !align_first) {
+		align_first = hal_wall_us();
+	}
+}
+
+/**
+ * starts a song on whole seconds of a wall clock running 'drift_ppm' faster
+ * than the timers, opened ALIGN_PREROLL_US ahead like a chime. 'step_us' sets
+ * the wall clock in the middle of the pre-roll, like SNTP. Lists when the
+ * first byte is on the wire
+ */
+static int align(const char *songpath, int starts, long drift_ppm, long step_us) {
+	host_set_wall(ALIGN_WALL_START, drift_ppm);
+	int64_t sum = 0;
+	int64_t max = 0;
+	for ( int i = 0; i < starts; i++) {
+		int64_t target = (hal_wall_us() / 1000000 + 2) * 1000000;
+		host_advance(hal_time_us() + target - ALIGN_PREROLL_US - hal_wall_us());
+		if ( mixer_play_at(MIX_MAIN_PLAYER, songpath, target)) {
+			return -1;
+		}
+		// the mixer starts it with the reset at once
+		host_run(hal_time_us());
+		align_first = 0;
+		host_set_midi_sink(align_sink, NULL);
+		if ( step_us) {
+			host_advance(hal_time_us() + ALIGN_PREROLL_US / 2);
+			host_set_wall(hal_wall_us() + step_us, drift_ppm);
+		}
+		host_run(INT64_MAX);
+		host_set_midi_sink(NULL, NULL);
+		int64_t err = align_first - target;
+		printf("start %d: first byte %+lld us\n", i + 1, (long long) err);
+		sum += llabs(err);
+		max = MAX(max, llabs(err));
+	}
+	printf("%d starts, drift %ld ppm, step %ld us: error avg %lld us, max %lld us\n",
+			starts, drift_ppm, step_us, (long long) (starts ? sum / starts : 0), (long long) max);
+	return 0;
+}
+
+/**
+ * presses the buttons 'presses' times by turns, a random song of 'dir'
+ * is played on each. Follows a press to the first byte of the song,
+ * stops it and waits 'gap_ms' for the next. The clock runs while the
+ * code runs, so opening a song takes its time on the PC
+ */
+static int latency(const char *dir, int presses, long gap_ms) {
+	char txt[512];
+	t_latency lat;
+	int64_t due;
+
+	host_base_path = dir;
+	if ( count_midifiles(dir, NULL) <= 0) {
+		ESP_LOGE(TAG, "no songs in %s", dir);
+		return -1;
+	}
+	init_gpio();
+	host_real_clock(true);
+	latency_begin(&lat);
+	for ( int i = 0; i < presses; i++) {
+		int64_t end = hal_time_us() + LATENCY_TIMEOUT_US;
+		gpio_inject(i % 2);
+		// the debounce timer, then the task gets the event
+		while ( latency_collect(&lat)) {
+			if ( gpio_handle_event(0)) {
+				continue;
+			}
+			if ( host_timer_next(&due) || due > end) {
+				latency_skip(&lat);
+				break;
+			}
+			host_timer_run_next();
+		}
+		mixer_stop(MIX_MAIN_PLAYER);
+		mixer_stop(MIX_SECOND_PLAYER);
+		host_advance(hal_time_us() + gap_ms * 1000);
+	}
+	latency_end(&lat);
+	host_real_clock(false);
+	latency_report(&lat, txt, sizeof(txt));
+	fputs(txt, stdout);
+	return lat.n > 0 ? 0 : -1;
+}
+
+/*
+ * golden timing: the output of the player against the times computed
+ * from the file after the SMF spec, independently of the player
+ */
+#define VERIFY_SHOW 8 // violations listed per song
+#define VERIFY_PAIR_US 2000000 // farther apart the same bytes are different events
+
+typedef struct {
+	int64_t time; // µs
+	long order; // in the file resp. on the wire
+	long tick; // reference only
+	long tempo; // reference only, > 0 for a tempo change
+	uint32_t key; // hash of the bytes
+	int len;
+	unsigned char data[4]; // the first bytes, to show
+	int match; // index + 1 of the matching message
+} t_vmsg;
+
+typedef struct {
+	t_vmsg *msg;
+	long n;
+	long room;
+} t_vlist;
+
+static t_vlist verify_out;
+static int64_t verify_base = 0; // the start of the song
+// message on the wire being assembled
+static unsigned char verify_status = 0;
+static t_vmsg verify_cur;
+static int verify_need = 0; // data bytes missing, -1 in a sysex
+static long verify_skip = 0; // bytes of the reset sent by the mixer first
+
+static t_vmsg *vlist_add(t_vlist *l) {
+	if ( l->n >= l->room) {
+		l->room = l->room ? l->room * 2 : 1024;
+		l->msg = realloc(l->msg, l->room * sizeof(t_vmsg));
+		if ( !l->msg) {
+			ESP_LOGE(TAG, "no memory for %ld messages", l->room);
+			ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+		}
+	}
+	t_vmsg *m = &l->msg[l->n];
+	memset(m, 0, sizeof(t_vmsg));
+	m->order = l->n++;
+	m->key = 2166136261u; // FNV-1a
+	return m;
+}
+
+static void vmsg_byte(t_vmsg *m, unsigned char b) {
+	if ( m->len < sizeof(m->data)) {
+		m->data[m->len] = b;
+	}
+	m->len++;
+	m->key = (m->key ^ b) * 16777619u;
+}
+
+/**
+ * bytes after a status, -1 for a sysex
+ */
+static int verify_data_len(unsigned char status) {
+	static const int sys_len[16] = { -1, 1, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if ( status < 0xF0) {
+		return (status & 0xE0) == 0xC0 ? 1 : 2;
+	}
+	return sys_len[status & 0x0F];
+}
+
+static void verify_sink(int64_t time, const unsigned char *data, int len, void *ctx) {
+	int skip = MIN(len, verify_skip);
+	verify_skip -= skip;
+	for ( int i = skip; i < len; i++) {
+		unsigned char b = data[i];
+		if ( b >= 0xF8) {
+			continue; // realtime
+		}
+		if ( verify_need < 0) {
+			// sysex, the pieces are one message
+			vmsg_byte(&verify_cur, b);
+			if ( b == 0xF7) {
+				*vlist_add(&verify_out) = verify_cur;
+				verify_out.msg[verify_out.n - 1].order = verify_out.n - 1;
+				verify_need = 0;
+			}
+			continue;
+		}
+		if ( b & 0x80) {
+			verify_status = b;
+		} else if ( verify_need == 0) {
+			if ( !verify_status) {
+				continue; // stray data
+			}
+			// running status
+			memset(&verify_cur, 0, sizeof(verify_cur));
+			verify_cur.key = 2166136261u;
+			verify_cur.time = time - verify_base;
+			vmsg_byte(&verify_cur, verify_status);
+			verify_need = verify_data_len(verify_status);
+		}
+		if ( b & 0x80) {
+			memset(&verify_cur, 0, sizeof(verify_cur));
+			verify_cur.key = 2166136261u;
+			verify_cur.time = time - verify_base;
+			verify_need = verify_data_len(b);
+			vmsg_byte(&verify_cur, b);
+		} else {
+			vmsg_byte(&verify_cur, b);
+			verify_need--;
+		}
+		if ( verify_need == 0) {
+			*vlist_add(&verify_out) = verify_cur;
+			verify_out.msg[verify_out.n - 1].order = verify_out.n - 1;
+		}
+	}
+}
+
+static long verify_vlq(const unsigned char *p, long end, long *pos) {
+	long v = 0;
+	while ( *pos < end) {
+		unsigned char c = p[(*pos)++];
+		v = v << 7 | (c & 0x7F);
+		if ( !(c & 0x80)) {
+			break;
+		}
+	}
+	return v;
+}
+
+static long verify_be(const unsigned char *p, int len) {
+	long v = 0;
+	for ( int i = 0; i < len; i++) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+/**
+ * the events of a track with their ticks, tempo changes included.
+ * A sysex without F7 is continued by the F7 events following it,
+ * otherwise terminated as the player does
+ */
+static int verify_track(const unsigned char *p, long len, int trackno, t_vlist *ref) {
+	long pos = 0;
+	long tick = 0;
+	unsigned char status = 0;
+	long open = -1; // unterminated sysex
+	while ( pos < len) {
+		tick += verify_vlq(p, len, &pos);
+		if ( pos >= len) {
+			break;
+		}
+		unsigned char c = p[pos];
+		if ( open >= 0 && c != 0xF7) {
+			vmsg_byte(&ref->msg[open], 0xF7);
+			open = -1;
+		}
+		if ( c == 0xFF) {
+			int type = pos + 1 < len ? p[pos + 1] : 0;
+			pos += 2;
+			long n = verify_vlq(p, len, &pos);
+			if ( type == 0x51 && n == 3 && pos + 3 <= len) {
+				t_vmsg *m = vlist_add(ref);
+				m->tick = tick;
+				m->tempo = verify_be(&p[pos], 3);
+				m->time = trackno;
+			}
+			pos += n;
+			if ( type == 0x2F) {
+				break;
+			}
+			continue;
+		}
+		if ( c == 0xF0 || c == 0xF7) {
+			pos++;
+			long n = verify_vlq(p, len, &pos);
+			t_vmsg *m;
+			if ( open >= 0) {
+				m = &ref->msg[open];
+			} else {
+				m = vlist_add(ref);
+				m->tick = tick;
+				m->time = trackno;
+			}
+			if ( c == 0xF0) {
+				vmsg_byte(m, 0xF0);
+			}
+			for ( long i = 0; i < n && pos + i < len; i++) {
+				if ( p[pos + i] < 0xF8) {
+					vmsg_byte(m, p[pos + i]); // realtime is not compared
+				}
+			}
+			pos += n;
+			if ( c == 0xF0 || open >= 0) {
+				open = n > 0 && p[pos - 1] == 0xF7 ? -1 : m - ref->msg;
+			} else if ( !m->len) {
+				ref->n--; // an escape of realtime bytes only
+			}
+			continue;
+		}
+		t_vmsg *m = vlist_add(ref);
+		m->tick = tick;
+		m->time = trackno; // for sorting, set to the time later
+		if ( c & 0x80) {
+			status = c;
+			pos++;
+		} else if ( !status) {
+			ESP_LOGE(TAG, "track %d: data without status", trackno);
+			return -1;
+		}
+		vmsg_byte(m, status);
+		for ( int i = verify_data_len(status); i > 0 && pos < len; i--) {
+			vmsg_byte(m, p[pos++]);
+		}
+	}
+	if ( open >= 0) {
+		vmsg_byte(&ref->msg[open], 0xF7);
+	}
+	return 0;
+}
+
+// by tick, then track (in time for now), then file order
+static int cmp_vref(const void *a, const void *b) {
+	const t_vmsg *x = a, *y = b;
+	if ( x->tick != y->tick) {
+		return x->tick < y->tick ? -1 : 1;
+	}
+	if ( x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * reads a SMF and computes the time of every event from the tempo map
+ * at 'rate', tempo changes are removed
+ */
+static int verify_reference(const char *path, long rate, t_vlist *ref) {
+	long size = 0;
+	unsigned char *buf = NULL;
+	int rc = -1;
+	FILE *fd = fopen(path, "rb");
+
+	do {
+		if ( !fd || fseek(fd, 0, SEEK_END) || (size = ftell(fd)) < 14) {
+			ESP_LOGE(TAG, "cannot read %s", path);
+			break;
+		}
+		rewind(fd);
+		if ( !(buf = malloc(size)) || fread(buf, 1, size, fd) != size) {
+			break;
+		}
+		if ( memcmp(buf, "MThd", 4)) {
+			ESP_LOGE(TAG, "%s: not a SMF", path);
+			break;
+		}
+		int ntracks = verify_be(&buf[10], 2);
+		long tpq = verify_be(&buf[12], 2);
+		if ( tpq <= 0 || tpq & 0x8000) {
+			ESP_LOGE(TAG, "%s: SMPTE time is not supported", path);
+			break;
+		}
+		long pos = 8 + verify_be(&buf[4], 4);
+		rc = 0;
+		for ( int t = 0; t < ntracks && pos + 8 <= size && !rc; t++) {
+			long len = verify_be(&buf[pos + 4], 4);
+			if ( memcmp(&buf[pos], "MTrk", 4)) {
+				break;
+			}
+			rc = verify_track(&buf[pos + 8], MIN(len, size - pos - 8), t, ref);
+			pos += 8 + len;
+		}
+		if ( rc) {
+			break;
+		}
+		qsort(ref->msg, ref->n, sizeof(t_vmsg), cmp_vref);
+
+		// µs at the last tempo change, the spec's tempo map
+		long tempo = 500000;
+		long tempo_tick = 0;
+		int64_t tempo_us = 0;
+		long n = 0;
+		for ( long i = 0; i < ref->n; i++) {
+			t_vmsg *m = &ref->msg[i];
+			int64_t us = tempo_us + (int64_t) (m->tick - tempo_tick) * tempo / tpq;
+			if ( m->tempo) {
+				tempo_us = us;
+				tempo_tick = m->tick;
+				tempo = m->tempo;
+				continue;
+			}
+			m->time = (us << RATE_SHIFT) / rate;
+			m->order = n;
+			ref->msg[n++] = *m;
+		}
+		ref->n = n;
+	} while(0);
+
+	free(buf);
+	if ( fd) {
+		fclose(fd);
+	}
+	return rc;
+}
+
+// by bytes, then time
+static int cmp_vkey(const void *a, const void *b) {
+	const t_vmsg *x = a, *y = b;
+	if ( x->key != y->key) {
+		return x->key < y->key ? -1 : 1;
+	}
+	if ( x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int cmp_vorder(const void *a, const void *b) {
+	const t_vmsg *x = a, *y = b;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void verify_show(const char *what, const t_vmsg *m, int64_t ref_time) {
+	printf("  %-10s %10lld us", what, (long long) m->time);
+	if ( ref_time >= 0) {
+		printf(" (due %lld)", (long long) ref_time);
+	}
+	for ( int i = 0; i < MIN(m->len, sizeof(m->data)); i++) {
+		printf(" %02X", m->data[i]);
+	}
+	printf("%s\n", m->len > sizeof(m->data) ? " ..." : "");
+}
+
+/**
+ * plays a SMF and compares the messages on the wire with the times
+ * from the file: each one has to be there once, within 'tol_us' and
+ * in the order of the file. Returns the number of violations
+ */
+static long verify_song(const char *path, long rate, long tol_us) {
+	t_vlist ref = { NULL, 0, 0 };
+	long late = 0, reordered = 0, dropped = 0, duplicate = 0;
+	int64_t max_err = 0;
+	int shown = 0;
+
+	verify_out.n = 0;
+	if ( verify_reference(path, rate, &ref)) {
+		return 1;
+	}
+	mixer_set_rate(rate);
+	verify_base = hal_time_us();
+	if ( mixer_play(MIX_MAIN_PLAYER, path, false, 0)) {
+		free(ref.msg);
+		return 1;
+	}
+	// the mixer resets the synth before the song
+	verify_skip = MIDI_RESET_LEN;
+	verify_status = 0;
+	verify_need = 0;
+	host_set_midi_sink(verify_sink, NULL);
+	host_run(INT64_MAX);
+	host_set_midi_sink(NULL, NULL);
+	mixer_set_rate(RATE_ONE);
+
+	// pairs of the same bytes in the order of time
+	t_vmsg *out = verify_out.msg;
+	qsort(ref.msg, ref.n, sizeof(t_vmsg), cmp_vkey);
+	qsort(out, verify_out.n, sizeof(t_vmsg), cmp_vkey);
+	long i = 0, j = 0;
+	while ( i < ref.n && j < verify_out.n) {
+		t_vmsg *r = &ref.msg[i];
+		t_vmsg *o = &out[j];
+		if ( r->key != o->key) {
+			if ( r->key < o->key) {
+				i++;
+			} else {
+				j++;
+			}
+			continue;
+		}
+		int64_t err = o->time - r->time;
+		if ( err < -VERIFY_PAIR_US) {
+			j++;
+		} else if ( err > VERIFY_PAIR_US) {
+			i++;
+		} else {
+			r->match = o->order + 1;
+			o->match = r->order + 1;
+			i++;
+			j++;
+		}
+	}
+	qsort(ref.msg, ref.n, sizeof(t_vmsg), cmp_vorder);
+	qsort(out, verify_out.n, sizeof(t_vmsg), cmp_vorder);
+
+	int64_t last_due = 0;
+	for ( j = 0; j < verify_out.n; j++) {
+		t_vmsg *o = &out[j];
+		if ( !o->match) {
+			if ( (o->data[0] & 0xF0) == 0xB0 && o->data[1] == 0x7B) {
+				continue; // all notes off at the end of the song
+			}
+			duplicate++;
+			if ( shown++ < VERIFY_SHOW) {
+				verify_show("duplicate", o, -1);
+			}
+			continue;
+		}
+		t_vmsg *r = &ref.msg[o->match - 1];
+		int64_t err = o->time - r->time;
+		max_err = MAX(max_err, llabs(err));
+		if ( llabs(err) > tol_us) {
+			late++;
+			if ( shown++ < VERIFY_SHOW) {
+				verify_show("onset", o, r->time);
+			}
+		}
+		if ( r->time < last_due) {
+			reordered++;
+			if ( shown++ < VERIFY_SHOW) {
+				verify_show("reordered", o, r->time);
+			}
+		}
+		last_due = MAX(last_due, r->time);
+	}
+	for ( i = 0; i < ref.n; i++) {
+		if ( !ref.msg[i].match) {
+			dropped++;
+			if ( shown++ < VERIFY_SHOW) {
+				verify_show("dropped", &ref.msg[i], ref.msg[i].time);
+			}
+		}
+	}
+	long bad = late + reordered + dropped + duplicate;
+	printf("%s: %ld events, onset error max %lld us, %ld over %ld us, %ld reordered, %ld dropped, %ld duplicate: %s\n",
+			path, ref.n, (long long) max_err, late, tol_us, reordered, dropped, duplicate, bad ? "FAILED" : "ok");
+	free(ref.msg);
+	return bad;
+}
+
+/**
+ * the golden timing of songs, returns the number of failed songs
+ */
+static int verify(char **songs, int nsongs, long rate, long tol_us) {
+	int failed = 0;
+	for ( int i = 0; i < nsongs; i++) {
+		if ( verify_song(songs[i], rate, tol_us)) {
+			failed++;
+		}
+	}
+	free(verify_out.msg);
+	printf("%d songs, %d failed\n", nsongs, failed);
+	return failed;
+}
+
+static long chime_count = 0;
+
+static void chime_print(const t_chime_rule *rule, struct tm *tm) {
+	char buf[64];
+	strftime(buf, sizeof(buf), "%a %Y-%m-%d %H:%M", tm);
+	if ( rule->kind == chime_hourly && !rule->song[0]) {
+		int n = tm->tm_hour % 12;
+		printf("%s strikes %d\n", buf, n ? n : 12);
+	} else {
+		printf("%s plays %s\n", buf, rule->song[0] ? rule->song : "*");
+	}
+	chime_count++;
+}
+
+/**
+ * runs the chime rules of a file on a virtual clock
+ */
+static int chime_sim(const char *rulepath, const char *date, int days) {
+	char err[128];
+	char *text = NULL;
+	struct tm tm;
+	int rc = -1;
+
+	// the time zone of the device, see sntp.c
+	setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+	tzset();
+
+	do {
+		memset(&tm, 0, sizeof(tm));
+		if ( sscanf(date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3) {
+			ESP_LOGE(TAG, "invalid date %s", date);
+			break;
+		}
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+		time_t now = mktime(&tm);
+
+		if ( !(text = read_text(rulepath)) || chime_set_rules(text, err, sizeof(err))) {
+			break;
+		}
+		chime_set_action(chime_print);
+
+		time_t end = now + (time_t) days * 24 * 3600;
+		long wakeups = 0;
+		int64_t t0 = hal_stopwatch_us();
+		time_t next = chime_restart(now);
+		while ( next && next < end) {
+			wakeups++;
+			next = chime_advance(next);
+		}
+		int64_t used = hal_stopwatch_us() - t0;
+		printf("%d days: %ld chimes, %ld wakeups, %lld us\n", days, chime_count, wakeups, (long long) used);
+		rc = 0;
+	} while(0);
+
+	free(text);
+	return rc;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: midihost [-v] play [-d] [-t trace.json] [-x rules] [-r percent[@ms]] <song>...\n"
+			"       midihost [-v] record <dump> <out.mid>\n"
+			"       midihost [-v] thru [-d] <song> <dump>\n"
+			"       midihost [-v] render <song> <out.wav> [rate] [start_ms]\n"
+			"       midihost [-v] bench-synth [voices] [seconds] [rate]\n"
+			"       midihost [-v] chime-sim <rules> <yyyy-mm-dd> [days]\n"
+			"       midihost [-v] rtp-sim [seconds] [jitter_us] [drift_ppm] [loss_permille]\n"
+			"       midihost [-v] align <song> [starts] [drift_ppm] [step_us]\n"
+			"       midihost [-v] latency <dir> [presses] [gap_ms]\n"
+			"       midihost [-v] jingle [name]\n"
+			"       midihost [-v] poly <song>...\n"
+			"       midihost [-v] optimize [-t tolerance] <song.mid> <out.mid>\n"
+			"       midihost [-v] export [-b] <song>\n"
+			"       midihost [-v] verify [-r percent] [-t tolerance_us] <song.mid>...\n");
+}
+
+int main(int argc, char **argv) {
+	int a = 1;
+	if ( a < argc && !strcmp(argv[a], "-v")) {
+		host_verbose = true;
+		a++;
+	}
+	if ( a >= argc) {
+		usage();
+		return 1;
+	}
+	const char *cmd = argv[a++];
+	int nargs = argc - a;
+	midi_init(); // as app_main does
+	host_run(INT64_MAX); // the reset, before any output is listed
+
+	if ( !strcmp(cmd, "play")) {
+		int dump = false;
+		const char *tracepath = NULL;
+		for ( ; a < argc && argv[a][0] == '-'; a++) {
+			if ( !strcmp(argv[a], "-d")) {
+				dump = true;
+			} else if ( !strcmp(argv[a], "-t") && a + 1 < argc) {
+				tracepath = argv[++a];
+			} else if ( !strcmp(argv[a], "-r") && a + 1 < argc) {
+				char *at = strchr(argv[++a], '@');
+				play_rate = (atol(argv[a]) << RATE_SHIFT) / 100;
+				play_rate_at_ms = at ? atol(at + 1) : 0;
+			} else if ( !strcmp(argv[a], "-x") && a + 1 < argc) {
+				if ( set_xform(argv[++a])) {
+					return 1;
+				}
+			} else {
+				break;
+			}
+		}
+		if ( a < argc) {
+			int rc = play(argv + a, argc - a, dump);
+			if ( tracepath && write_trace(tracepath)) {
+				rc = -1;
+			}
+			return rc ? 1 : 0;
+		}
+	}
+	if ( !strcmp(cmd, "record") && nargs >= 2) {
+		return record(argv[a], argv[a+1]) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "thru") && nargs >= 2) {
+		int dump = !strcmp(argv[a], "-d");
+		if ( nargs - dump >= 2) {
+			return thru(argv[a+dump], argv[a+dump+1], dump) ? 1 : 0;
+		}
+	}
+	if ( !strcmp(cmd, "render") && nargs >= 2) {
+		int rate = nargs > 2 ? atoi(argv[a+2]) : DEFAULT_RATE;
+		long start_ms = nargs > 3 ? atol(argv[a+3]) : 0;
+		return render(argv[a], argv[a+1], rate, start_ms) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "bench-synth")) {
+		int nvoices = nargs > 0 ? atoi(argv[a]) : SYNTH_VOICES;
+		int seconds = nargs > 1 ? atoi(argv[a+1]) : 10;
+		int rate = nargs > 2 ? atoi(argv[a+2]) : DEFAULT_RATE;
+		return bench_synth(nvoices, seconds, rate) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "rtp-sim")) {
+		int seconds = nargs > 0 ? atoi(argv[a]) : 60;
+		sim_jitter_us = nargs > 1 ? atol(argv[a+1]) : sim_jitter_us;
+		sim_drift_ppm = nargs > 2 ? atoi(argv[a+2]) : sim_drift_ppm;
+		sim_loss_permille = nargs > 3 ? atoi(argv[a+3]) : sim_loss_permille;
+		return rtp_sim(seconds) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "align") && nargs >= 1) {
+		int starts = nargs > 1 ? atoi(argv[a+1]) : 5;
+		long drift_ppm = nargs > 2 ? atol(argv[a+2]) : 0;
+		long step_us = nargs > 3 ? atol(argv[a+3]) : 0;
+		return align(argv[a], starts, drift_ppm, step_us) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "verify")) {
+		long rate = RATE_ONE;
+		long tol_us = 1000;
+		for ( ; a + 1 < argc && argv[a][0] == '-'; a += 2) {
+			if ( !strcmp(argv[a], "-r")) {
+				rate = (atol(argv[a+1]) << RATE_SHIFT) / 100;
+			} else if ( !strcmp(argv[a], "-t")) {
+				tol_us = atol(argv[a+1]);
+			} else {
+				break;
+			}
+		}
+		if ( a < argc) {
+			return verify(argv + a, argc - a, rate, tol_us) ? 1 : 0;
+		}
+	}
+	if ( !strcmp(cmd, "optimize") && nargs >= 2) {
+		int tolerance = OPTIMIZE_TOLERANCE;
+		if ( !strcmp(argv[a], "-t") && nargs >= 4) {
+			tolerance = atoi(argv[a+1]);
+			a += 2;
+		}
+		return optimize(argv[a], argv[a+1], tolerance) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "export") && nargs >= 1) {
+		int binary = !strcmp(argv[a], "-b") && nargs >= 2;
+		return export(argv[a + binary], binary) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "poly") && nargs >= 1) {
+		return poly(argv + a, nargs) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "jingle")) {
+		return jingle(nargs > 0 ? argv[a] : NULL) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "latency") && nargs >= 1) {
+		int presses = nargs > 1 ? atoi(argv[a+1]) : 20;
+		long gap_ms = nargs > 2 ? atol(argv[a+2]) : 500;
+		return latency(argv[a], MIN(presses, LATENCY_PRESSES), gap_ms) ? 1 : 0;
+	}
+	if ( !strcmp(cmd, "chime-sim") && nargs >= 2) {
+		int days = nargs > 2 ? atoi(argv[a+2]) : 7;
+		return chime_sim(argv[a], argv[a+1], days) ? 1 : 0;
+	}
+	usage();
+	return 1;
+}
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# mkcorpus.py
+#
+#  Created on: 19 Oct 2026
+#      Author: ankrysm
+#
+# writes the songs of corpus/, checked by 'make check' with
+# 'midihost verify'. Each one holds an encoding the player has to get
+# right:
+#   format0.mid  format 0, several channels, running status, note-off
+#                as note-on with velocity 0, a tempo change
+#   format1.mid  format 1, a tempo track with changes in the middle of
+#                notes, running status across delta times
+#   sysex.mid    a sysex split into F0 and F7 continuation packets,
+#                a complete one and an F7 escape, between notes
+#
+# usage: mkcorpus.py [dir]
+#
+
+import os
+import struct
+import sys
+
+
+def varlen(value):
+    out = [value & 0x7F]
+    value >>= 7
+    while value:
+        out.insert(0, (value & 0x7F) | 0x80)
+        value >>= 7
+    return bytes(out)
+
+
+def track(events):
+    """an MTrk chunk of (delta, bytes), end of track appended"""
+    data = b"".join(varlen(delta) + bytes(msg) for delta, msg in events)
+    data += varlen(0) + bytes([0xFF, 0x2F, 0x00])
+    return b"MTrk" + struct.pack(">I", len(data)) + data
+
+
+def tempo(us):
+    return [0xFF, 0x51, 0x03, (us >> 16) & 0xFF, (us >> 8) & 0xFF, us & 0xFF]
+
+
+def sysex(status, data):
+    return [status] + list(varlen(len(data))) + data
+
+
+def smf(fmt, tpq, tracks):
+    return b"MThd" + struct.pack(">IHHH", 6, fmt, len(tracks), tpq) + b"".join(tracks)
+
+
+def format0():
+    return smf(0, 96, [track([
+        (0, tempo(500000)),
+        (0, [0xC0, 0x05]),
+        (0, [0xC1, 0x20]),
+        (0, [0x90, 60, 100]),
+        (0, [64, 90]),          # running status
+        (0, [0x91, 48, 80]),
+        (48, [0x90, 60, 0]),    # note-off as velocity 0
+        (0, [64, 0]),
+        (0, [67, 100]),
+        (48, [0x81, 48, 64]),
+        (0, [0x90, 67, 0]),
+        (0, tempo(250000)),
+        (0, [0xB0, 7, 100]),
+        (0, [10, 30]),
+        (0, [0x90, 72, 110]),
+        (96, [72, 0]),
+        (0, [0xE1, 0x00, 0x40]),
+        (24, [0x99, 36, 120]),
+        (24, [36, 0]),
+    ])])
+
+
+def format1():
+    tempo_track = track([
+        (0, [0xFF, 0x58, 0x04, 4, 2, 24, 8]),
+        (0, tempo(600000)),
+        (240, tempo(400000)),   # in the middle of the first note
+        (480, tempo(800000)),
+        (240, tempo(500000)),
+    ])
+    melody = [(0, [0xC0, 0x00]), (0, [0x90, 60, 100])]
+    last = 60
+    for i, note in enumerate([62, 64, 65, 67, 69, 71, 72]):
+        melody.append((120, [last, 0]))     # running status
+        melody.append((0, [note, 90 + i]))
+        last = note
+    melody.append((120, [last, 0]))
+    bass = [(60, [0xB1, 64, 127])]
+    for note in [36, 43, 36, 43]:
+        bass.append((0, [0x91, note, 100]))
+        bass.append((200, [0x81, note, 0]))
+    bass.append((0, [0xB1, 64, 0]))
+    drums = [(0, [0x99, 42, 70])]
+    for _ in range(6):
+        drums.append((60, [0x89, 42, 0]))
+        drums.append((60, [0x99, 42, 70]))
+    drums.append((60, [0x89, 42, 0]))
+    return smf(1, 240, [tempo_track, track(melody), track(bass), track(drums)])
+
+
+def sysex_song():
+    gm_on = [0x7E, 0x7F, 0x09, 0x01, 0xF7]
+    return smf(0, 120, [track([
+        (0, sysex(0xF0, gm_on)),
+        (0, [0x90, 60, 100]),
+        (60, sysex(0xF0, [0x41, 0x10, 0x42, 0x12])),     # no F7, continued
+        (10, sysex(0xF7, [0x40, 0x00, 0x7F])),
+        (10, sysex(0xF7, [0x00, 0x41, 0xF7])),           # the end
+        (40, [0x80, 60, 64]),
+        (0, [0x90, 64, 100]),
+        (60, sysex(0xF7, [0xFA])),                       # escape, a start
+        (60, [0x80, 64, 64]),
+        (0, sysex(0xF0, [0x43, 0x10, 0x4C, 0x00, 0x00, 0x7E, 0x00, 0xF7])),
+        (30, [0x90, 67, 100]),
+        (120, [0x90, 67, 0]),
+    ])])
+
+
+def main():
+    out = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "corpus")
+    os.makedirs(out, exist_ok=True)
+    for name, song in (("format0.mid", format0()), ("format1.mid", format1()),
+                       ("sysex.mid", sysex_song())):
+        with open(os.path.join(out, name), "wb") as f:
+            f.write(song)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,623 @@
+/*
+ * chime.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * timed chimes by the SNTP clock: songs at a time of day, hourly
+ * strikes and quiet hours, each for selected weekdays.
+ *
+ * The due times of the rules are kept in a hierarchical timer wheel
+ * with a resolution of one minute: 64 slots of one minute, 64 slots
+ * of 64 minutes and 64 slots of 4096 minutes. Slot bitmaps show the
+ * next slot with something to do, the one shot timer is armed for the
+ * first rule due there. So there is one wakeup per due chime, not per
+ * rule or minute.
+ *
+ * The engine itself only gets the time as parameter (chime_restart,
+ * chime_advance), so it can run on a virtual clock, see ../host.
+ *
+ * The timer fires CHIME_PREROLL_US before the minute and hands the chime
+ * to the chime task, which picks and opens the song, so the esp_timer
+ * task isn't held by the file system. The song starts with its first
+ * note on the minute (mixer_play_at).
+ *
+ * Rules as text, one per line:
+ *   at <days> <hh:mm> [song]          plays a song, a random one starting with 'song'
+ *   hourly <days> <hh>-<hh> <mm> [song] strikes the hour (or plays a song) at minute mm
+ *   quiet <days> <hh:mm>-<hh:mm>      no chimes, may end on the next day
+ * days: su,mo,tu,we,th,fr,sa, ranges like mo-fr, or * for every day
+ */
+
+#include "local.h"
+
+static const char *TAG = "chime";
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+#define WHEEL_SPAN (1L << (WHEEL_BITS * WHEEL_LEVELS)) // minutes
+#define WHEEL_NONE LONG_MAX
+
+#define CHIME_NVS_NAMESPACE "chime"
+#define CHIME_NVS_KEY "rules"
+#define CHIME_RETRY_US (60 * 1000000LL) // time not yet set
+#define CHIME_VALID_TIME 1451606400 // 2016-01-01
+#define CHIME_PREROLL_US 1000000 // open and decode the song before the minute
+
+typedef struct {
+	int n;
+	t_chime_rule rule[CHIME_MAX_RULES];
+} t_chime_rules;
+
+// chime_set_rules in the HTTP task publishes the rules in rules_set,
+// chime_restart copies them to 'rules' in the chime timer, which is the
+// only user of 'rules' and the timer wheel
+static t_chime_rules rules;
+static t_chime_rules rules_set;
+static uint32_t rules_seq = 0;
+static int restart = false; // rebuild the schedule with rules_set
+
+// timer wheel, the rules are linked into the slots
+static int16_t slot_head[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t slot_bits[WHEEL_LEVELS]; // slots with rules
+static int16_t rule_next[CHIME_MAX_RULES];
+static long rule_due[CHIME_MAX_RULES]; // minutes since epoch
+static long wheel_now = 0; // last processed minute
+
+static t_hal_timer chime_timer = NULL;
+static t_chime_action chime_action = NULL;
+static t_hal_queue chime_queue = NULL;
+
+// a due chime for the chime task, the rule may change meanwhile
+typedef struct {
+	t_chime_rule rule;
+	struct tm tm;
+} t_chime_event;
+
+static const char *day_names[7] = { "su", "mo", "tu", "we", "th", "fr", "sa" };
+
+/*
+ * timer wheel
+ */
+
+static void wheel_clear(long now) {
+	for ( int l = 0; l < WHEEL_LEVELS; l++) {
+		for ( int s = 0; s < WHEEL_SLOTS; s++) {
+			slot_head[l][s] = -1;
+		}
+		slot_bits[l] = 0;
+	}
+	wheel_now = now;
+}
+
+static void wheel_insert(int i, long due) {
+	long delta = due - wheel_now;
+	int level = 0;
+	while ( level < WHEEL_LEVELS - 1 && delta >= (1L << (WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+	if ( delta >= WHEEL_SPAN) {
+		ESP_LOGE(TAG, "rule %d: due time too far away", i);
+		return;
+	}
+	int slot = (due >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	rule_due[i] = due;
+	rule_next[i] = slot_head[level][slot];
+	slot_head[level][slot] = i;
+	slot_bits[level] |= 1ULL << slot;
+}
+
+/**
+ * takes all rules of a slot, returns the first one
+ */
+static int wheel_take(int level, int slot) {
+	int i = slot_head[level][slot];
+	slot_head[level][slot] = -1;
+	slot_bits[level] &= ~(1ULL << slot);
+	return i;
+}
+
+/**
+ * distance of the first slot with rules, counted from 'start', -1 if none
+ */
+static int first_slot(uint64_t bits, int start) {
+	if ( !bits) {
+		return -1;
+	}
+	uint64_t r = start ? (bits >> start) | (bits << (WHEEL_SLOTS - start)) : bits;
+	return __builtin_ctzll(r);
+}
+
+/**
+ * the next minute with something to do: a due rule in level 0
+ * or a higher level slot to be spread to the lower ones
+ */
+static long wheel_next() {
+	long next = WHEEL_NONE;
+	int d = first_slot(slot_bits[0], (wheel_now + 1) & WHEEL_MASK);
+	if ( d >= 0) {
+		next = wheel_now + 1 + d;
+	}
+	for ( int l = 1; l < WHEEL_LEVELS; l++) {
+		int shift = WHEEL_BITS * l;
+		long block = (wheel_now >> shift) + 1;
+		d = first_slot(slot_bits[l], block & WHEEL_MASK);
+		if ( d >= 0) {
+			next = MIN(next, (block + d) << shift);
+		}
+	}
+	return next;
+}
+
+/**
+ * the next minute with a due rule. Unlike wheel_next the rules of the
+ * higher levels are looked at, so no wakeups for spreading are needed
+ */
+static long wheel_next_due() {
+	long next = WHEEL_NONE;
+	int d = first_slot(slot_bits[0], (wheel_now + 1) & WHEEL_MASK);
+	if ( d >= 0) {
+		next = wheel_now + 1 + d;
+	}
+	for ( int l = 1; l < WHEEL_LEVELS; l++) {
+		int shift = WHEEL_BITS * l;
+		long block = (wheel_now >> shift) + 1;
+		d = first_slot(slot_bits[l], block & WHEEL_MASK);
+		if ( d >= 0) {
+			for ( int i = slot_head[l][(block + d) & WHEEL_MASK]; i >= 0; i = rule_next[i]) {
+				next = MIN(next, rule_due[i]);
+			}
+		}
+	}
+	return next;
+}
+
+/*
+ * rules
+ */
+
+/**
+ * true if the time is within quiet hours
+ */
+static int is_quiet(struct tm *tm) {
+	int m = tm->tm_hour * 60 + tm->tm_min;
+	int yesterday = (tm->tm_wday + 6) % 7;
+	for ( int i = 0; i < rules.n; i++) {
+		t_chime_rule *r = &rules.rule[i];
+		if ( r->kind != chime_quiet) {
+			continue;
+		}
+		int start = r->hour * 60 + r->minute;
+		int end = r->end_hour * 60 + r->end_minute;
+		if ( start <= end) {
+			if ( (r->days & (1 << tm->tm_wday)) && m >= start && m < end) {
+				return true;
+			}
+		} else if ( ((r->days & (1 << tm->tm_wday)) && m >= start)
+				|| ((r->days & (1 << yesterday)) && m < end)) {
+			// over midnight
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * the next time of a rule after 'after', 0 if never
+ */
+static time_t next_due(const t_chime_rule *r, time_t after) {
+	struct tm tm;
+	localtime_r(&after, &tm);
+	tm.tm_sec = 0;
+
+	// the next 8 days are enough for every weekday
+	int candidates = r->kind == chime_at ? 8 : 8 * 24;
+	for ( int i = 0; i < candidates; i++) {
+		struct tm c = tm;
+		if ( r->kind == chime_at) {
+			c.tm_mday += i;
+			c.tm_hour = r->hour;
+		} else {
+			c.tm_hour += i;
+		}
+		c.tm_min = r->minute;
+		c.tm_isdst = -1;
+		time_t t = mktime(&c); // normalizes c
+		if ( t <= after || !(r->days & (1 << c.tm_wday))) {
+			continue;
+		}
+		if ( r->kind == chime_hourly && (c.tm_hour < r->hour || c.tm_hour > r->end_hour)) {
+			continue;
+		}
+		return t;
+	}
+	return 0;
+}
+
+static void schedule_rule(int i, time_t after) {
+	t_chime_rule *r = &rules.rule[i];
+	if ( r->kind != chime_at && r->kind != chime_hourly) {
+		return;
+	}
+	time_t t = next_due(r, after);
+	if ( t) {
+		wheel_insert(i, t / 60);
+	}
+}
+
+/**
+ * plays the chime of a rule, in the chime task
+ */
+static void chime_play(const t_chime_rule *r, struct tm *tm) {
+	struct tm t = *tm;
+	int64_t wall_us = (int64_t) mktime(&t) * 1000000;
+	if ( r->kind == chime_hourly && !r->song[0]) {
+		int n = tm->tm_hour % 12;
+		play_strikes(n ? n : 12, wall_us);
+		return;
+	}
+	char path[256+1];
+	if ( !pick_random_midifile(BASE_PATH, r->song, path, sizeof(path))) {
+		mixer_play_at(MIX_MAIN_PLAYER, path, wall_us);
+	}
+}
+
+/**
+ * hands a chime to the chime task
+ */
+static void chime_send(const t_chime_rule *r, struct tm *tm) {
+	t_chime_event evt = { *r, *tm };
+	if ( !chime_queue || hal_queue_send(chime_queue, &evt)) {
+		ESP_LOGE(TAG, "%02d:%02d: chime lost", tm->tm_hour, tm->tm_min);
+	}
+}
+
+/**
+ * plays a chime handed over by the timer, waits up to timeout_ms for
+ * it, for ever if timeout_ms < 0. Returns true if there was one
+ */
+int chime_handle_event(int timeout_ms) {
+	t_chime_event evt;
+	if ( !hal_queue_receive(chime_queue, &evt, timeout_ms)) {
+		return false;
+	}
+	chime_play(&evt.rule, &evt.tm);
+	return true;
+}
+
+static void chime_task(void *arg) {
+	for (;;) {
+		chime_handle_event(-1);
+	}
+}
+
+static void fire(int i, long minute) {
+	time_t t = minute * 60;
+	struct tm tm;
+	localtime_r(&t, &tm);
+
+	int quiet = is_quiet(&tm);
+	TRACE(trc_chime_fire, i, quiet);
+	if ( quiet) {
+		ESP_LOGI(TAG, "rule %d: %02d:%02d quiet", i, tm.tm_hour, tm.tm_min);
+	} else {
+		ESP_LOGI(TAG, "rule %d: %02d:%02d chime", i, tm.tm_hour, tm.tm_min);
+		(chime_action ? chime_action : chime_send)(&rules.rule[i], &tm);
+	}
+	schedule_rule(i, t);
+}
+
+/**
+ * processes the minute 'minute', which is the result of wheel_next()
+ */
+static void wheel_step(long minute) {
+	wheel_now = minute;
+
+	// spread higher levels, top down
+	for ( int l = WHEEL_LEVELS - 1; l > 0; l--) {
+		int shift = WHEEL_BITS * l;
+		if ( minute & ((1L << shift) - 1)) {
+			continue;
+		}
+		int i = wheel_take(l, (minute >> shift) & WHEEL_MASK);
+		while ( i >= 0) {
+			int nxt = rule_next[i];
+			wheel_insert(i, rule_due[i]);
+			i = nxt;
+		}
+	}
+
+	int i = wheel_take(0, minute & WHEEL_MASK);
+	while ( i >= 0) {
+		int nxt = rule_next[i];
+		if ( rule_due[i] == minute) {
+			fire(i, minute);
+		} else {
+			wheel_insert(i, rule_due[i]);
+		}
+		i = nxt;
+	}
+}
+
+/**
+ * rebuilds the schedule at time 'now', with the rules set last if
+ * chime_reschedule asked for it. Returns the next due time, 0 if none
+ */
+time_t chime_restart(time_t now) {
+	if ( __atomic_exchange_n(&restart, false, __ATOMIC_ACQUIRE)
+			&& seq_read(&rules_seq, &rules, &rules_set, sizeof(rules))) {
+		// chime_set_rules is changing them, it wakes the timer again
+		rules.n = 0;
+		__atomic_store_n(&restart, true, __ATOMIC_RELAXED);
+	}
+	wheel_clear(now / 60);
+	for ( int i = 0; i < rules.n; i++) {
+		schedule_rule(i, now);
+	}
+	long next = wheel_next_due();
+	return next == WHEEL_NONE ? 0 : next * 60;
+}
+
+/**
+ * plays the chimes due until 'now', returns the next due time, 0 if none
+ */
+time_t chime_advance(time_t now) {
+	long minute = now / 60;
+	if ( minute < wheel_now || minute - wheel_now >= WHEEL_SPAN) {
+		// clock was set
+		return chime_restart(now);
+	}
+	long next;
+	while ( (next = wheel_next()) <= minute) {
+		wheel_step(next);
+	}
+	next = wheel_next_due();
+	return next == WHEEL_NONE ? 0 : next * 60;
+}
+
+void chime_set_action(t_chime_action action) {
+	chime_action = action;
+}
+
+/*
+ * device: timer and storage
+ */
+
+/**
+ * the wall clock time in seconds, CHIME_PREROLL_US ahead
+ */
+static time_t chime_now() {
+	return (hal_wall_us() + CHIME_PREROLL_US) / 1000000;
+}
+
+static void chime_arm(time_t next) {
+	hal_timer_stop(chime_timer);
+	time_t now = time(NULL);
+	int64_t wait;
+	if ( now < CHIME_VALID_TIME) {
+		wait = CHIME_RETRY_US;
+	} else if ( !next) {
+		return;
+	} else {
+		wait = (int64_t) next * 1000000 - CHIME_PREROLL_US - hal_wall_us();
+		wait = MAX(wait, 1000);
+	}
+	hal_timer_once(chime_timer, wait);
+}
+
+static void chime_timer_callback(void* arg) {
+	time_t now = chime_now();
+	if ( now < CHIME_VALID_TIME) {
+		chime_arm(0);
+		return;
+	}
+	if ( wheel_now < CHIME_VALID_TIME / 60 || __atomic_load_n(&restart, __ATOMIC_RELAXED)) {
+		// first valid time, new rules or the clock was set
+		chime_arm(chime_restart(now));
+		return;
+	}
+	chime_arm(chime_advance(now));
+}
+
+/**
+ * after a change of the rules or the clock, from any task: the chime
+ * timer rebuilds the schedule
+ */
+void chime_reschedule() {
+	__atomic_store_n(&restart, true, __ATOMIC_RELEASE);
+	if ( chime_timer) {
+		hal_timer_wake(chime_timer, 0);
+	}
+}
+
+static void load_rules() {
+	size_t size = nvs_load_blob(CHIME_NVS_NAMESPACE, CHIME_NVS_KEY, rules_set.rule, sizeof(rules_set.rule));
+	rules_set.n = size / sizeof(t_chime_rule);
+	ESP_LOGI(TAG, "%d rules loaded", rules_set.n);
+}
+
+void chime_init() {
+	if ( chime_timer) {
+		return;
+	}
+	load_rules();
+	chime_queue = hal_queue_create(4, sizeof(t_chime_event));
+	if ( hal_task_start(chime_task, "chime", 4096, 5, CONFIG_MIDI_NET_CORE, NULL)) {
+		ESP_LOGE(TAG, "chime task not started");
+	}
+	chime_timer = hal_timer_create(&chime_timer_callback, NULL, "chime");
+	chime_reschedule();
+}
+
+/*
+ * text format
+ */
+
+static const char *parse_days(const char *s, unsigned char *days) {
+	*days = 0;
+	if ( *s == '*') {
+		*days = 0x7F;
+		return s + 1;
+	}
+	while ( *s && !isspace((uchar) *s)) {
+		int from = -1, to;
+		for ( int d = 0; d < 7; d++) {
+			if ( strncasecmp(s, day_names[d], 2) == 0) {
+				from = d;
+			}
+		}
+		if ( from < 0) {
+			return NULL;
+		}
+		s += 2;
+		to = from;
+		if ( *s == '-') {
+			s++;
+			to = -1;
+			for ( int d = 0; d < 7; d++) {
+				if ( strncasecmp(s, day_names[d], 2) == 0) {
+					to = d;
+				}
+			}
+			if ( to < 0) {
+				return NULL;
+			}
+			s += 2;
+		}
+		for ( int d = from; ; d = (d + 1) % 7) {
+			*days |= 1 << d;
+			if ( d == to)
+				break;
+		}
+		if ( *s == ',') {
+			s++;
+		}
+	}
+	return s;
+}
+
+/**
+ * parses a rule, see above. returns 0 if ok
+ */
+static int parse_rule(const char *line, void *rule) {
+	t_chime_rule *r = rule;
+	char kind[8];
+	char days[32];
+	char song[CHIME_SONG_LEN + 1];
+	int h1, m1, h2, m2, n;
+
+	memset(r, 0, sizeof(t_chime_rule));
+	memset(song, 0, sizeof(song));
+	if ( sscanf(line, "%7s %31s %n", kind, days, &n) != 2) {
+		return -1;
+	}
+	if ( !parse_days(days, &r->days) || !r->days) {
+		return -1;
+	}
+	const char *args = line + n;
+
+	if ( !strcmp(kind, "at")) {
+		if ( sscanf(args, "%d:%d %10s", &h1, &m1, song) < 2) {
+			return -1;
+		}
+		r->kind = chime_at;
+		h2 = h1;
+		m2 = m1;
+	} else if ( !strcmp(kind, "hourly")) {
+		if ( sscanf(args, "%d-%d %d %10s", &h1, &h2, &m1, song) < 3) {
+			return -1;
+		}
+		r->kind = chime_hourly;
+		m2 = m1;
+	} else if ( !strcmp(kind, "quiet")) {
+		if ( sscanf(args, "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4) {
+			return -1;
+		}
+		r->kind = chime_quiet;
+	} else {
+		return -1;
+	}
+	if ( h1 < 0 || h1 > 23 || h2 < 0 || h2 > 23 || m1 < 0 || m1 > 59 || m2 < 0 || m2 > 59
+			|| strlen(song) >= CHIME_SONG_LEN) {
+		return -1;
+	}
+	r->hour = h1;
+	r->minute = m1;
+	r->end_hour = h2;
+	r->end_minute = m2;
+	strcpy(r->song, song);
+	return 0;
+}
+
+static int format_days(char *buf, size_t len, unsigned char days) {
+	if ( days == 0x7F) {
+		return snprintf(buf, len, "*");
+	}
+	int n = 0;
+	for ( int d = 0; d < 7; d++) {
+		if ( days & (1 << d)) {
+			n += snprintf(&buf[n], len - MIN(n, len), "%s%s", n ? "," : "", day_names[d]);
+		}
+	}
+	return n;
+}
+
+/**
+ * replaces all rules by the rules in 'text', one per line.
+ * Empty lines and lines starting with # are ignored.
+ * returns 0 if ok, otherwise the rules are unchanged and err tells why
+ */
+int chime_set_rules(const char *text, char *err, size_t errlen) {
+	t_chime_rule *parsed = calloc(CHIME_MAX_RULES, sizeof(t_chime_rule));
+	if ( !parsed) {
+		snprintf(err, errlen, "no memory");
+		return -1;
+	}
+	int n = parse_rule_lines(text, parse_rule, parsed, sizeof(t_chime_rule), CHIME_MAX_RULES, err, errlen);
+	if ( n < 0) {
+		ESP_LOGE(TAG, "%s", err);
+		free(parsed);
+		return -1;
+	}
+	seq_write_begin(&rules_seq);
+	memcpy(rules_set.rule, parsed, n * sizeof(t_chime_rule));
+	rules_set.n = n;
+	seq_write_end(&rules_seq);
+	free(parsed);
+	if ( nvs_save_blob(CHIME_NVS_NAMESPACE, CHIME_NVS_KEY, rules_set.rule, n * sizeof(t_chime_rule))) {
+		snprintf(err, errlen, "rules not stored");
+	}
+	ESP_LOGI(TAG, "%d rules set", n);
+	chime_reschedule();
+	return 0;
+}
+
+/**
+ * the rules set last as text, returns the length. In the HTTP task
+ * like chime_set_rules
+ */
+int chime_get_rules(char *buf, size_t len) {
+	int n = 0;
+	buf[0] = '\0';
+	for ( int i = 0; i < rules_set.n && n < len; i++) {
+		t_chime_rule *r = &rules_set.rule[i];
+		char days[32];
+		format_days(days, sizeof(days), r->days);
+		switch (r->kind) {
+		case chime_at:
+			n += snprintf(&buf[n], len - n, "at %s %02d:%02d %s\n", days, r->hour, r->minute, r->song);
+			break;
+		case chime_hourly:
+			n += snprintf(&buf[n], len - n, "hourly %s %02d-%02d %02d %s\n", days, r->hour, r->end_hour, r->minute, r->song);
+			break;
+		case chime_quiet:
+			n += snprintf(&buf[n], len - n, "quiet %s %02d:%02d-%02d:%02d\n", days, r->hour, r->minute, r->end_hour, r->end_minute);
+			break;
+		default:
+			break;
+		}
+	}
+	return MIN(n, len);
+}
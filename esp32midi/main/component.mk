@@ -5,3 +5,15 @@
 
 COMPONENT_EMBED_FILES := favicon.ico
 COMPONENT_EMBED_FILES += upload_script.html
+
+# jingles, compiled from jingles/*.mid into tables in flash by host/mid2c.py
+JINGLES := $(sort $(wildcard $(COMPONENT_PATH)/jingles/*.mid))
+
+COMPONENT_OBJS := $(patsubst $(COMPONENT_PATH)/%.c,%.o,$(wildcard $(COMPONENT_PATH)/*.c)) jingles.o
+COMPONENT_EXTRA_CLEAN := jingles.c
+
+jingles.c: $(JINGLES) $(COMPONENT_PATH)/../host/mid2c.py
+	$(PYTHON) $(COMPONENT_PATH)/../host/mid2c.py -o $@ $(JINGLES)
+
+jingles.o: jingles.c
+	$(CC) $(CFLAGS) $(CPPFLAGS) $(addprefix -I ,$(COMPONENT_INCLUDES)) -I $(COMPONENT_PATH) -c $< -o $@
@@ -13,6 +13,11 @@
 /* Scratch buffer size */
 #define SCRATCH_BUFSIZE  8192
 
+/* Status push to the web page as server-sent events */
+#define STATUS_CLIENTS 3
+#define STATUS_PERIOD_US 500000 // at most two updates per second
+#define STATUS_KEEPALIVE 20 // periods without change until a comment is sent
+
 struct file_server_data {
     /* Base path of file storage */
     char base_path[ESP_VFS_PATH_MAX + 1];
@@ -23,6 +28,15 @@ struct file_server_data {
 
 static const char *TAG = "file_server";
 
+// sockets of the status clients, -1 if free. Only used in the server task
+static int status_fds[STATUS_CLIENTS] = { -1, -1, -1 };
+static httpd_handle_t status_server = NULL;
+static t_hal_timer status_timer = NULL;
+static char status_last[320];
+static int status_unchanged = 0;
+static long status_events = 0;
+static int64_t status_time = 0;
+
 /* Handler to redirect incoming GET request for /index.html to /
  * This can be overridden by uploading file with same name */
 static esp_err_t index_html_get_handler(httpd_req_t *req)
@@ -87,19 +101,11 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
     httpd_resp_send_chunk(req, (const char *)upload_script_start, upload_script_size);
 
     // Send file-list table definition and column labels
-#ifdef WITH_PRINING_MIDIFILES
-    httpd_resp_sendstr_chunk(req,
-        "<table class=\"fixed\" border=\"1\">"
-        "<col width=\"800px\" /><col width=\"300px\" /><col width=\"300px\" /><col width=\"100px\" />"
-        "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Delete</th><th>Play</th><th>Print</th></tr></thead>"
-        "<tbody>");
-#else
     httpd_resp_sendstr_chunk(req,
         "<table class=\"fixed\" border=\"1\">"
         "<col width=\"800px\" /><col width=\"300px\" /><col width=\"300px\" /><col width=\"100px\" />"
-        "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Delete</th><th>Play</th></tr></thead>"
+        "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Delete</th><th>Play</th><th>Compact</th><th>Events</th></tr></thead>"
         "<tbody>");
-#endif
 
     // Iterate over all files / folders and fetch their names and sizes
     while ((entry = readdir(dir)) != NULL) {
@@ -138,13 +144,25 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
         httpd_resp_sendstr_chunk(req, req->uri);
         httpd_resp_sendstr_chunk(req, entry->d_name);
         httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Play</button></form>");
-#ifdef WITH_PRINING_MIDIFILES
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/print");
+        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/mix");
         httpd_resp_sendstr_chunk(req, req->uri);
         httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Print</button></form>");
-#endif
+        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Mix</button></form>");
+
+        httpd_resp_sendstr_chunk(req, "</td><td>");
+        if (IS_FILE_EXT(entry->d_name, ".mid")) {
+            httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/compact");
+            httpd_resp_sendstr_chunk(req, req->uri);
+            httpd_resp_sendstr_chunk(req, entry->d_name);
+            httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Compact</button></form>");
+        }
+        httpd_resp_sendstr_chunk(req, "</td><td>");
+        if (IS_SONG_FILE(entry->d_name)) {
+            httpd_resp_sendstr_chunk(req, "<a href=\"/export");
+            httpd_resp_sendstr_chunk(req, req->uri);
+            httpd_resp_sendstr_chunk(req, entry->d_name);
+            httpd_resp_sendstr_chunk(req, "\">JSON</a>");
+        }
         httpd_resp_sendstr_chunk(req, "</td></tr>\n");
     }
     closedir(dir);
@@ -158,21 +176,13 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
     httpd_resp_sendstr_chunk(req, fsinfo);
     httpd_resp_sendstr_chunk(req, "</td><td></td><td><form method=\"post\" action=\"/stop\">");
     httpd_resp_sendstr_chunk(req, "<button type=\"submit\">Stop</button></form></td>");
-#ifdef WITH_PRINING_MIDIFILES
     httpd_resp_sendstr_chunk(req, "<td> </td><td> </td></tr>\n");
-#else
-    httpd_resp_sendstr_chunk(req, "</tr>\n");
-#endif
 
     // line with play random button
     httpd_resp_sendstr_chunk(req, "<tr><td></td><td></td><td>");
     httpd_resp_sendstr_chunk(req, "</td><td></td><td><form method=\"post\" action=\"/playrandom\">");
     httpd_resp_sendstr_chunk(req, "<button type=\"submit\">Play Random</button></form></td>");
-#ifdef WITH_PRINING_MIDIFILES
     httpd_resp_sendstr_chunk(req, "<td> </td><td> </td></tr>\n");
-#else
-    httpd_resp_sendstr_chunk(req, "</tr>\n");
-#endif
 
     /* Finish the file list table */
     httpd_resp_sendstr_chunk(req, "</tbody></table>");
@@ -243,7 +253,7 @@ static esp_err_t playrandom_post_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Play something random %s",req->uri);
 
     // play with delay
-    handle_play_random_midifile(((struct file_server_data *)req->user_ctx)->base_path, 1 );
+    handle_play_random_midifile(((struct file_server_data *)req->user_ctx)->base_path, NULL, MIX_MAIN_PLAYER, 1 );
 
     // Redirect onto root to see the file list
     httpd_resp_set_status(req, "303 See Other");
@@ -411,12 +421,14 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
     // Content length of the request gives
     // the size of the file being uploaded
     int remaining = req->content_len;
+    TRACE(trc_upload_begin, 0, remaining);
 
     while (remaining > 0) {
 
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
         // Receive the file part by part into a buffer
-        if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
+        received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE));
+        TRACE(trc_upload_chunk, remaining, received);
+        if (received <= 0) {
             if (received == HTTPD_SOCK_ERR_TIMEOUT) {
                 // Retry if timeout occurred
                 continue;
@@ -426,6 +438,7 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
             // close and delete the unfinished file
             fclose(fd);
             unlink(filepath);
+            TRACE(trc_upload_end, 0, -1);
 
             ESP_LOGE(TAG, "File reception failed!");
             // Respond with 500 Internal Server Error
@@ -439,6 +452,7 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
             // Storage may be full?
             fclose(fd);
             unlink(filepath);
+            TRACE(trc_upload_end, 0, -1);
 
             ESP_LOGE(TAG, "File write failed!");
             /* Respond with 500 Internal Server Error */
@@ -453,12 +467,58 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
 
     // Close file upon upload completion
     fclose(fd);
+    TRACE(trc_upload_end, 0, 0);
     ESP_LOGI(TAG, "File reception complete");
 
-    // Redirect onto root to see the updated file list
-    httpd_resp_set_status(req, "303 See Other");
-    httpd_resp_set_hdr(req, "Location", "/");
-    httpd_resp_sendstr(req, "File uploaded successfully");
+    // ?optimize=<tolerance> replaces a midi file by its optimized version
+    char query[32];
+    char value[8];
+    // the scratch buffer holds the texts, the file is received
+    char *report = buf;
+    char *txt = &buf[SCRATCH_BUFSIZE / 2];
+    report[0] = '\0';
+    if (IS_FILE_EXT(filename, ".mid") &&
+            httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "optimize", value, sizeof(value)) == ESP_OK) {
+        const char *base_path = ((struct file_server_data *)req->user_ctx)->base_path;
+        char tmppath[FILE_PATH_MAX];
+        char bakpath[FILE_PATH_MAX];
+        snprintf(tmppath, sizeof(tmppath), "%s%s", base_path, OPTIMIZE_TMP_FILE);
+        snprintf(bakpath, sizeof(bakpath), "%s%s", base_path, OPTIMIZE_BAK_FILE);
+        if (optimize_midifile(filepath, tmppath, atoi(value), report, SCRATCH_BUFSIZE / 2) == 0) {
+            // the song is deleted only when the optimized one is in its place
+            unlink(bakpath);
+            if (rename(filepath, bakpath)) {
+                ESP_LOGE(TAG, "Failed to rename %s to %s", filepath, bakpath);
+                unlink(tmppath);
+                snprintf(report, SCRATCH_BUFSIZE / 2, "not optimized, the song is kept");
+            } else if (rename(tmppath, filepath)) {
+                ESP_LOGE(TAG, "Failed to rename %s to %s", tmppath, filepath);
+                unlink(tmppath);
+                if (rename(bakpath, filepath)) {
+                    ESP_LOGE(TAG, "Failed to restore %s from %s", filepath, bakpath);
+                    snprintf(report, SCRATCH_BUFSIZE / 2, "not optimized, the song is left in %s", OPTIMIZE_BAK_FILE);
+                } else {
+                    snprintf(report, SCRATCH_BUFSIZE / 2, "not optimized, the song is kept");
+                }
+            } else {
+                unlink(bakpath);
+            }
+        }
+    }
+
+    // Songs with more notes than the synth has voices are played shortened
+    strcpy(txt, "File uploaded successfully");
+    if (IS_SONG_FILE(filename)) {
+        int peak = midi_song_polyphony(filepath);
+        ESP_LOGI(TAG, "%s: peak polyphony %d of %d voices", filename, peak, CONFIG_MIDI_SYNTH_POLYPHONY);
+        snprintf(txt, SCRATCH_BUFSIZE / 2, "File uploaded successfully, peak polyphony %d of %d\n%s",
+                peak, CONFIG_MIDI_SYNTH_POLYPHONY, report);
+    }
+
+    // the report, the page shows it and reloads the file list
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
     return ESP_OK;
 }
 
@@ -509,19 +569,20 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
 }
 
 /**
- *  Handler to play a midifile
+ *  Handler to play a midifile, "/mix" plays it additionally to running songs
  */
 static esp_err_t play_post_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
     struct stat file_stat;
+    const int mix = strncmp(req->uri, "/mix/", strlen("/mix/")) == 0;
 
-    // Skip leading "/play" from URI to get filename
+    // Skip leading "/play" resp. "/mix" from URI to get filename
     // Note sizeof() counts NULL termination hence the -1
     const char *filename = get_path_from_uri(
     		filepath,
 			((struct file_server_data *)req->user_ctx)->base_path,
-			req->uri + sizeof("/play") - 1,
+			req->uri + (mix ? sizeof("/mix") : sizeof("/play")) - 1,
 			sizeof(filepath));
     if (!filename) {
         // Respond with 500 Internal Server Error
@@ -543,10 +604,20 @@ static esp_err_t play_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "play file : %s at %s", filename, filepath);
+    // optional start position: ?start=<milliseconds>
+    long start_ms = 0;
+    char query[32];
+    char value[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "start", value, sizeof(value)) == ESP_OK) {
+        start_ms = atol(value);
+    }
+
+    ESP_LOGI(TAG, "%s file : %s at %s, start %ld ms", mix ? "mix" : "play", filename, filepath, start_ms);
+    TRACE(trc_http_play, mix, start_ms);
 
     // play with delay
-    if ( handle_play_midifile(filepath, 1)) {
+    if ( mix ? handle_mix_midifile(filepath, 1, start_ms) : handle_play_midifile(filepath, 1, start_ms)) {
     	play_err();
         ESP_LOGE(TAG, "not a valid midi file : %s", filename);
          // Respond with 400 Bad Request
@@ -561,29 +632,32 @@ static esp_err_t play_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-#ifdef WITH_PRINING_MIDIFILES
 /**
- *  Handler to play a midifile
+ *  Handler to convert a midifile into a compact song
  */
-static esp_err_t print_post_handler(httpd_req_t *req)
+static esp_err_t compact_post_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
+    char dstpath[FILE_PATH_MAX];
+    char report[256];
     struct stat file_stat;
 
-    // Skip leading "/print" from URI to get filename
+    // Skip leading "/compact" from URI to get filename
     // Note sizeof() counts NULL termination hence the -1
-    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
-                                             req->uri  + sizeof("/print") - 1, sizeof(filepath));
+    const char *filename = get_path_from_uri(
+    		filepath,
+			((struct file_server_data *)req->user_ctx)->base_path,
+			req->uri + sizeof("/compact") - 1,
+			sizeof(filepath));
     if (!filename) {
-        /* Respond with 500 Internal Server Error */
+        // Respond with 500 Internal Server Error
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
         return ESP_FAIL;
     }
 
-    // Filename cannot have a trailing '/'
-    if (filename[strlen(filename) - 1] == '/') {
-        ESP_LOGE(TAG, "Invalid filename : %s", filename);
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Invalid filename");
+    if (!IS_FILE_EXT(filename, ".mid")) {
+        ESP_LOGE(TAG, "Not a midi file : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Only *.mid files can be compacted");
         return ESP_FAIL;
     }
 
@@ -594,23 +668,693 @@ static esp_err_t print_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "print file : %s at %s", filename, filepath);
+    // same name, other extension
+    strlcpy(dstpath, filepath, sizeof(dstpath));
+    strcpy(&dstpath[strlen(dstpath) - strlen(".mid")], COMPACT_EXT);
 
-    if ( handle_print_midifile(filepath)) {
-    	play_err();
-        ESP_LOGE(TAG, "not a valid midi file : %s", filename);
-         // Respond with 400 Bad Request
-         httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not a valid MIDI-File");
-         return ESP_FAIL;
+    if (stat(dstpath, &file_stat) == 0) {
+        ESP_LOGE(TAG, "File already exists : %s", dstpath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Compact file already exists");
+        return ESP_FAIL;
     }
 
-    // Redirect onto root to see the updated file list
-    httpd_resp_set_status(req, "303 See Other");
-    httpd_resp_set_hdr(req, "Location", "/");
-    httpd_resp_sendstr(req, "Printing successfully");
+    ESP_LOGI(TAG, "compact file : %s to %s", filepath, dstpath);
+
+    if (compact_midifile(filepath, dstpath, report, sizeof(report))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, report);
+        return ESP_FAIL;
+    }
+
+    // show the result, the file list is one click away
+    httpd_resp_sendstr_chunk(req, "<!DOCTYPE html><html><body><p>");
+    httpd_resp_sendstr_chunk(req, report);
+    httpd_resp_sendstr_chunk(req, "</p><a href=\"/\">back</a></body></html>");
+    httpd_resp_sendstr_chunk(req, NULL);
     return ESP_OK;
 }
+
+/**
+ *  Handler to list the chime rules as text
+ */
+static esp_err_t chime_get_handler(httpd_req_t *req)
+{
+    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+
+    int len = chime_get_rules(buf, SCRATCH_BUFSIZE);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, buf, len);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to replace the chime rules, the body contains the rules as text
+ */
+static esp_err_t chime_post_handler(httpd_req_t *req)
+{
+    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+    char err[128];
+    int received = 0;
+
+    if (req->content_len >= SCRATCH_BUFSIZE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many rules");
+        return ESP_FAIL;
+    }
+    while (received < req->content_len) {
+        int n = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (n <= 0) {
+            if (n == HTTPD_SOCK_ERR_TIMEOUT) {
+                // Retry if timeout occurred
+                continue;
+            }
+            ESP_LOGE(TAG, "Chime rules reception failed!");
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive rules");
+            return ESP_FAIL;
+        }
+        received += n;
+    }
+    buf[received] = '\0';
+
+    if (chime_set_rules(buf, err, sizeof(err))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+    return chime_get_handler(req);
+}
+
+/**
+ *  Handler to list the transform rules as text
+ */
+static esp_err_t xform_get_handler(httpd_req_t *req)
+{
+    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+
+    int len = xform_get_rules(buf, SCRATCH_BUFSIZE);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, buf, len);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to replace the transform rules, the body contains the rules as text.
+ *  The running songs are transformed at once
+ */
+static esp_err_t xform_post_handler(httpd_req_t *req)
+{
+    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+    char err[128];
+    int received = 0;
+
+    if (req->content_len >= SCRATCH_BUFSIZE) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many rules");
+        return ESP_FAIL;
+    }
+    while (received < req->content_len) {
+        int n = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (n <= 0) {
+            if (n == HTTPD_SOCK_ERR_TIMEOUT) {
+                // Retry if timeout occurred
+                continue;
+            }
+            ESP_LOGE(TAG, "Transform rules reception failed!");
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive rules");
+            return ESP_FAIL;
+        }
+        received += n;
+    }
+    buf[received] = '\0';
+
+    if (xform_set_rules(buf, err, sizeof(err))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
+    return xform_get_handler(req);
+}
+
+/**
+ *  Handler to record MIDI in to a new midifile
+ */
+static esp_err_t record_post_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    struct stat file_stat;
+
+    // Skip leading "/record" from URI to get filename
+    // Note sizeof() counts NULL termination hence the -1
+    const char *filename = get_path_from_uri(
+    		filepath,
+			((struct file_server_data *)req->user_ctx)->base_path,
+			req->uri + sizeof("/record") - 1,
+			sizeof(filepath));
+    if (!filename) {
+        // Respond with 500 Internal Server Error
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return ESP_FAIL;
+    }
+
+    if (!IS_FILE_EXT(filename, ".mid")) {
+        ESP_LOGE(TAG, "Not a midi file : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Only *.mid files can be recorded");
+        return ESP_FAIL;
+    }
+
+    if (stat(filepath, &file_stat) == 0) {
+        ESP_LOGE(TAG, "File already exists : %s", filepath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File already exists");
+        return ESP_FAIL;
+    }
+
+    if (midi_in_record(filepath)) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Recording not started");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, "recording, stop with POST /recstop\n");
+    return ESP_OK;
+}
+
+/**
+ *  Handler to stop the recording, reports what was received
+ */
+static esp_err_t recstop_post_handler(httpd_req_t *req)
+{
+    char txt[200];
+    t_midi_in_stat in_stat;
+
+    int rc = midi_in_stop();
+    midi_in_get_stat(&in_stat);
+    snprintf(txt, sizeof(txt), "%s: %ld events recorded, %ld dropped; received %ld bytes, "
+            "%ld messages, %ld realtime, %ld sysex, %ld incomplete, %ld stray\n",
+            rc ? "not recording" : "stopped", in_stat.recorded, in_stat.dropped, in_stat.bytes,
+            in_stat.events, in_stat.realtime, in_stat.sysex, in_stat.incomplete, in_stat.stray);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+static void thru_stat_text(char *txt, size_t len)
+{
+    t_midi_in_stat in_stat;
+
+    midi_in_get_stat(&in_stat);
+    snprintf(txt, len, "thru %s: %ld messages, latency avg %lld us, max %ld us, %ld late, "
+            "%ld conflicts, %ld dropped\n",
+            midi_in_thru_on() ? "on" : "off", in_stat.thru,
+            (long long) (in_stat.thru ? in_stat.thru_sum_us / in_stat.thru : 0),
+            in_stat.thru_max_us, in_stat.thru_late, in_stat.conflicts, in_stat.thru_dropped);
+}
+
+/**
+ *  Handler to report MIDI thru and its latency
+ */
+static esp_err_t thru_get_handler(httpd_req_t *req)
+{
+    char txt[200];
+
+    thru_stat_text(txt, sizeof(txt));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to switch MIDI thru, ?on=0|1
+ */
+static esp_err_t thru_post_handler(httpd_req_t *req)
+{
+    char query[32];
+    char value[8];
+    char txt[200];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+            httpd_query_key_value(query, "on", value, sizeof(value)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing ?on=0|1");
+        return ESP_FAIL;
+    }
+    midi_in_thru(atoi(value) != 0);
+    thru_stat_text(txt, sizeof(txt));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+static void rate_text(char *txt, size_t len)
+{
+    long rate = mixer_get_rate();
+    snprintf(txt, len, "rate %ld%%\n", (rate * 100 + RATE_ONE / 2) >> RATE_SHIFT);
+}
+
+/**
+ *  Handler to report the playback rate
+ */
+static esp_err_t rate_get_handler(httpd_req_t *req)
+{
+    char txt[32];
+
+    rate_text(txt, sizeof(txt));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to set the playback rate of all songs, ?percent=25..400
+ */
+static esp_err_t rate_post_handler(httpd_req_t *req)
+{
+    char query[32];
+    char value[8];
+    char txt[32];
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+            httpd_query_key_value(query, "percent", value, sizeof(value)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing ?percent=25..400");
+        return ESP_FAIL;
+    }
+    if (mixer_set_rate(((long) atoi(value) << RATE_SHIFT) / 100)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Rate out of range 25..400");
+        return ESP_FAIL;
+    }
+    rate_text(txt, sizeof(txt));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+static void timing_text(char *txt, size_t len, int clear)
+{
+    static const char *buckets[MIX_LATE_BUCKETS] = { "< 100", "< 250", "< 500", "< 1000", "< 2000", ">= 2000" };
+    t_mixer_timing t;
+
+    mixer_get_timing(&t, clear);
+#ifdef CONFIG_MIDI_PLAY_HW_TIMER
+    const char *timer = "hardware timer";
+#else
+    const char *timer = "esp_timer";
 #endif
+    int n = snprintf(txt, len, "play core %d priority %d (%s), network core %d, http priority %d\n"
+            "mixer wake-ups: %ld, late avg %lld us, max %ld us\n",
+            CONFIG_MIDI_PLAY_CORE, CONFIG_MIDI_PLAY_PRIORITY, timer, CONFIG_MIDI_NET_CORE,
+            CONFIG_MIDI_HTTPD_PRIORITY, t.wakeups,
+            (long long) (t.wakeups ? t.late_sum_us / t.wakeups : 0), t.late_max_us);
+    for (int b = 0; b < MIX_LATE_BUCKETS && n < len; b++) {
+        n += snprintf(&txt[n], len - n, "%8s us: %ld\n", buckets[b], t.late[b]);
+    }
+}
+
+/**
+ *  Handler to report how late playback is woken
+ */
+static esp_err_t timing_get_handler(httpd_req_t *req)
+{
+    char txt[400];
+
+    timing_text(txt, sizeof(txt), false);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to report and clear the timing
+ */
+static esp_err_t timing_post_handler(httpd_req_t *req)
+{
+    char txt[400];
+
+    timing_text(txt, sizeof(txt), true);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+static void voices_text(char *txt, size_t len, int clear)
+{
+    t_voice_stat st;
+
+    voice_get_stat(&st, clear);
+    snprintf(txt, len, "voices %d of %d, peak %d, %ld notes dropped, %ld shortened\n",
+            st.active, st.limit, st.peak, st.dropped, st.stolen);
+}
+
+/**
+ *  Handler to report the voices used on the synth
+ */
+static esp_err_t voices_get_handler(httpd_req_t *req)
+{
+    char txt[100];
+
+    voices_text(txt, sizeof(txt), false);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to report and clear the voice counts
+ */
+static esp_err_t voices_post_handler(httpd_req_t *req)
+{
+    char txt[100];
+
+    voices_text(txt, sizeof(txt), true);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to report the network MIDI session
+ */
+static esp_err_t rtp_get_handler(httpd_req_t *req)
+{
+    char txt[400];
+    t_rtp_stat st;
+
+    rtp_midi_get_stat(&st);
+    snprintf(txt, sizeof(txt), "session %s%s: %ld sessions, %ld packets, %ld events, %ld lost, "
+            "%ld reordered, %ld dropped, %ld late (max %ld us), %ld clamped; %ld clock syncs, "
+            "round trip %ld us, offset %lld us, drift %ld ppb\n",
+            st.active ? "with " : "none", st.active ? st.peer : "", st.sessions, st.packets, st.events,
+            st.lost, st.reordered, st.dropped, st.late, st.max_late_us, st.clamped, st.syncs,
+            st.rtt_us, (long long) st.offset_us, st.drift_ppb);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+// the latency measurement runs in its own task, GET /latency reports it
+enum LATENCY_JOB { latency_idle, latency_running, latency_done };
+static int latency_job = latency_idle;
+static int latency_presses = 0;
+static char latency_txt[512];
+
+/**
+ *  Presses the buttons by turns through the interrupt handler, each
+ *  song is stopped after its first byte
+ */
+static void latency_task(void *arg)
+{
+    t_latency *lat = arg;
+
+    latency_begin(lat);
+    for (int i = 0; i < latency_presses; i++) {
+        int64_t end = hal_time_us() + LATENCY_TIMEOUT_US;
+        int rc;
+        while ((rc = gpio_inject(i % 2)) && hal_time_us() <= end) {
+            // a real press is debounced
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+        while (rc || latency_collect(lat)) {
+            if (rc || hal_time_us() > end) {
+                latency_skip(lat);
+                break;
+            }
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+        mixer_stop(MIX_MAIN_PLAYER);
+        mixer_stop(MIX_SECOND_PLAYER);
+        vTaskDelay(500 / portTICK_PERIOD_MS);
+    }
+    latency_end(lat);
+    latency_report(lat, latency_txt, sizeof(latency_txt));
+    free(lat);
+    __atomic_store_n(&latency_job, latency_done, __ATOMIC_RELEASE);
+    vTaskDelete(NULL);
+}
+
+/**
+ *  Handler to start measuring the button to sound latency, ?presses=<n>
+ */
+static esp_err_t latency_post_handler(httpd_req_t *req)
+{
+    char query[32];
+    char value[16];
+    int presses = 20;
+
+    if (__atomic_load_n(&latency_job, __ATOMIC_ACQUIRE) == latency_running) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "latency measurement running");
+        return ESP_OK;
+    }
+    t_latency *lat = malloc(sizeof(t_latency));
+    if (!lat) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "presses", value, sizeof(value)) == ESP_OK) {
+        presses = MIN(MAX(atoi(value), 1), LATENCY_PRESSES);
+    }
+    latency_presses = presses;
+    __atomic_store_n(&latency_job, latency_running, __ATOMIC_RELAXED);
+    if (hal_task_start(latency_task, "latency", 4096, 5, CONFIG_MIDI_NET_CORE, lat)) {
+        __atomic_store_n(&latency_job, latency_idle, __ATOMIC_RELAXED);
+        free(lat);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to start the measurement");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, "latency measurement started, GET /latency reports it\n");
+    return ESP_OK;
+}
+
+/**
+ *  Handler to report the latency measured last
+ */
+static esp_err_t latency_get_handler(httpd_req_t *req)
+{
+    const char *txt;
+    switch (__atomic_load_n(&latency_job, __ATOMIC_ACQUIRE)) {
+    case latency_running:
+        txt = "latency measurement running\n";
+        break;
+    case latency_done:
+        txt = latency_txt;
+        break;
+    default:
+        txt = "no latency measured, POST /latency?presses=<n>\n";
+        break;
+    }
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, txt);
+    return ESP_OK;
+}
+
+static int export_put_chunk(const char *data, size_t len, void *ctx)
+{
+    return httpd_resp_send_chunk((httpd_req_t *) ctx, data, len) == ESP_OK ? 0 : -1;
+}
+
+/**
+ *  Handler to download the decoded events of a song with their time in us,
+ *  NDJSON or with ?format=bin binary, see midi_export.c
+ */
+static esp_err_t export_get_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    char query[32];
+    char value[8];
+    int binary = false;
+
+    // Skip leading "/export" from URI to get filename
+    // Note sizeof() counts NULL termination hence the -1
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
+                                             req->uri  + sizeof("/export") - 1, sizeof(filepath));
+    if (!filename || !IS_SONG_FILE(filename)) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not a song");
+        return ESP_FAIL;
+    }
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK) {
+        binary = !strcmp(value, "bin");
+    }
+
+    // the song is read event by event, the scratch buffer collects the chunks
+    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+    httpd_resp_set_type(req, binary ? "application/octet-stream" : "application/x-ndjson");
+    int n = export_song(filepath, binary, buf, SCRATCH_BUFSIZE, export_put_chunk, req);
+    if (n == EXPORT_NO_SONG) {
+        // nothing sent yet
+        ESP_LOGE(TAG, "not a valid midi file : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not a valid MIDI-File");
+        return ESP_FAIL;
+    }
+    if (n < 0) {
+        ESP_LOGE(TAG, "Export of %s failed!", filename);
+        // Abort sending
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "exported %d events of %s", n, filename);
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static int trace_put_chunk(const char *txt, void *ctx)
+{
+    return httpd_resp_sendstr_chunk((httpd_req_t *) ctx, txt) == ESP_OK ? 0 : -1;
+}
+
+/**
+ *  Handler to download the trace as Chrome trace-event JSON
+ */
+static esp_err_t trace_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"trace.json\"");
+    if (trace_export(trace_put_chunk, req) < 0) {
+        ESP_LOGE(TAG, "Trace sending failed!");
+        // Abort sending
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+/**
+ *  Handler to set the traced subsystems, ?mask=<hex>, the trace is cleared
+ */
+static esp_err_t trace_post_handler(httpd_req_t *req)
+{
+    char query[32];
+    char value[16];
+    uint32_t mask = TRACE_ALL;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "mask", value, sizeof(value)) == ESP_OK) {
+        mask = strtoul(value, NULL, 16);
+    }
+    trace_set_mask(mask);
+    snprintf(value, sizeof(value), "%x\n", mask);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr(req, value);
+    return ESP_OK;
+}
+
+/**
+ * the status as JSON, events per second since the last call
+ */
+static int status_json(char *txt, size_t len)
+{
+    t_mixer_status st;
+    int64_t now = hal_time_us();
+
+    if (mixer_get_status(&st)) {
+        return -1;
+    }
+    long rate = now > status_time ? (st.events - status_events) * 1000000LL / (now - status_time) : 0;
+    status_events = st.events;
+    status_time = now;
+
+    int n = snprintf(txt, len, "{\"events_s\":%ld,\"dropped\":%ld,\"queued\":%d,\"playing\":[",
+            rate, st.dropped, st.queued);
+    int first = true;
+    for (int p = 0; p < MIX_PLAYERS && n < len; p++) {
+        if (st.player[p].file[0]) {
+            // no quotes or backslashes in the JSON string
+            for (char *c = st.player[p].file; *c; c++) {
+                if (*c == '"' || *c == '\\' || (unsigned char) *c < ' ') {
+                    *c = '_';
+                }
+            }
+            n += snprintf(txt + n, len - n, "%s{\"player\":%d,\"file\":\"%s\",\"pos_ms\":%lld}",
+                    first ? "" : ",", p, st.player[p].file, (long long) ((now - st.player[p].start) / 1000));
+            first = false;
+        }
+    }
+    if (n < len) {
+        n += snprintf(txt + n, len - n, "]}");
+    }
+    return n < len ? n : -1;
+}
+
+/**
+ * sends the status to the clients if it changed or 'arg' is set,
+ * in the server task
+ */
+static void status_push(void *arg)
+{
+    char txt[sizeof(status_last)];
+    char json[sizeof(status_last) - 16];
+    int force = arg != NULL;
+    int n;
+
+    if (status_json(json, sizeof(json)) < 0) {
+        return;
+    }
+    if (force || strcmp(json, status_last)) {
+        strcpy(status_last, json);
+        status_unchanged = 0;
+        n = snprintf(txt, sizeof(txt), "data: %s\n\n", json);
+    } else if (++status_unchanged >= STATUS_KEEPALIVE) {
+        // finds closed connections
+        status_unchanged = 0;
+        n = snprintf(txt, sizeof(txt), ":\n\n");
+    } else {
+        return;
+    }
+    for (int i = 0; i < STATUS_CLIENTS; i++) {
+        if (status_fds[i] >= 0 && httpd_socket_send(status_server, status_fds[i], txt, n, 0) < 0) {
+            // the slot is freed by status_client_closed
+            ESP_LOGI(TAG, "Status client %d gone", status_fds[i]);
+            httpd_sess_trigger_close(status_server, status_fds[i]);
+        }
+    }
+}
+
+static void status_timer_callback(void *arg)
+{
+    for (int i = 0; i < STATUS_CLIENTS; i++) {
+        if (status_fds[i] >= 0) {
+            // the clients belong to the server task
+            httpd_queue_work(status_server, status_push, NULL);
+            return;
+        }
+    }
+}
+
+/* Called by the server when the connection of a status client is closed */
+static void status_client_closed(void *ctx)
+{
+    int *slot = ctx;
+    *slot = -1;
+}
+
+/**
+ *  Handler for the status stream (server-sent events): the connection stays
+ *  open, the status is pushed whenever it changes
+ */
+static esp_err_t events_get_handler(httpd_req_t *req)
+{
+    static const char hdr[] = "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n\r\n"
+            "retry: 3000\n\n";
+    int i;
+
+    for (i = 0; i < STATUS_CLIENTS && status_fds[i] >= 0; i++) {
+    }
+    if (i >= STATUS_CLIENTS) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_sendstr(req, "Too many status clients");
+        return ESP_OK;
+    }
+    if (httpd_send(req, hdr, strlen(hdr)) < 0) {
+        return ESP_FAIL;
+    }
+    status_server = req->handle;
+    status_fds[i] = httpd_req_to_sockfd(req);
+    // the server tells when the connection is closed
+    req->sess_ctx = &status_fds[i];
+    req->free_ctx = status_client_closed;
+    if (!status_timer) {
+        status_timer = hal_timer_create(status_timer_callback, NULL, "status");
+        hal_timer_periodic(status_timer, STATUS_PERIOD_US);
+    }
+    status_push(req);
+    return ESP_OK;
+}
 
 /**
  *  Function to start the file server
@@ -647,12 +1391,173 @@ esp_err_t start_file_server(const char *base_path)
     // target URIs which match the wildcard scheme
     config.uri_match_fn = httpd_uri_match_wildcard;
 
+    // more handlers than the default of 8
+    config.max_uri_handlers = 30;
+
+    // away from playback, see Kconfig.projbuild
+    config.core_id = CONFIG_MIDI_NET_CORE;
+    config.task_priority = CONFIG_MIDI_HTTPD_PRIORITY;
+
     ESP_LOGI(TAG, "Starting HTTP Server");
     if (httpd_start(&server, &config) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to start file server!");
         return ESP_FAIL;
     }
 
+    // URI handlers for the chime and transform rules, MIDI thru, the rate, network MIDI, timing, latency, the status and the trace, before the download handler matching all URIs
+    httpd_uri_t chime_get = {
+        .uri       = "/chime",
+        .method    = HTTP_GET,
+        .handler   = chime_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &chime_get);
+
+    httpd_uri_t chime_post = {
+        .uri       = "/chime",
+        .method    = HTTP_POST,
+        .handler   = chime_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &chime_post);
+
+    httpd_uri_t xform_get = {
+        .uri       = "/xform",
+        .method    = HTTP_GET,
+        .handler   = xform_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &xform_get);
+
+    httpd_uri_t xform_post = {
+        .uri       = "/xform",
+        .method    = HTTP_POST,
+        .handler   = xform_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &xform_post);
+
+    httpd_uri_t thru_get = {
+        .uri       = "/thru",
+        .method    = HTTP_GET,
+        .handler   = thru_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &thru_get);
+
+    httpd_uri_t thru_post = {
+        .uri       = "/thru",
+        .method    = HTTP_POST,
+        .handler   = thru_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &thru_post);
+
+    httpd_uri_t rate_get = {
+        .uri       = "/rate",
+        .method    = HTTP_GET,
+        .handler   = rate_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &rate_get);
+
+    httpd_uri_t rate_post = {
+        .uri       = "/rate",
+        .method    = HTTP_POST,
+        .handler   = rate_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &rate_post);
+
+    httpd_uri_t rtp_get = {
+        .uri       = "/rtp",
+        .method    = HTTP_GET,
+        .handler   = rtp_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &rtp_get);
+
+    httpd_uri_t timing_get = {
+        .uri       = "/timing",
+        .method    = HTTP_GET,
+        .handler   = timing_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &timing_get);
+
+    httpd_uri_t timing_post = {
+        .uri       = "/timing",
+        .method    = HTTP_POST,
+        .handler   = timing_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &timing_post);
+
+    httpd_uri_t voices_get = {
+        .uri       = "/voices",
+        .method    = HTTP_GET,
+        .handler   = voices_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &voices_get);
+
+    httpd_uri_t voices_post = {
+        .uri       = "/voices",
+        .method    = HTTP_POST,
+        .handler   = voices_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &voices_post);
+
+    httpd_uri_t latency_get = {
+        .uri       = "/latency",
+        .method    = HTTP_GET,
+        .handler   = latency_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &latency_get);
+
+    httpd_uri_t latency_post = {
+        .uri       = "/latency",
+        .method    = HTTP_POST,
+        .handler   = latency_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &latency_post);
+
+    httpd_uri_t events_get = {
+        .uri       = "/events",
+        .method    = HTTP_GET,
+        .handler   = events_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &events_get);
+
+    httpd_uri_t trace_get = {
+        .uri       = "/trace",
+        .method    = HTTP_GET,
+        .handler   = trace_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &trace_get);
+
+    httpd_uri_t trace_post = {
+        .uri       = "/trace",
+        .method    = HTTP_POST,
+        .handler   = trace_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &trace_post);
+
+    // URI handler for the decoded events of a song, before the one for all files
+    httpd_uri_t file_export = {
+        .uri       = "/export/*",   // Match all URIs of type /export/path/to/file
+        .method    = HTTP_GET,
+        .handler   = export_get_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_export);
+
     // URI handler for getting uploaded files
     httpd_uri_t file_download = {
         .uri       = "/*",  // Match all URIs of type /path/to/file
@@ -689,16 +1594,23 @@ esp_err_t start_file_server(const char *base_path)
     };
     httpd_register_uri_handler(server, &file_play);
 
-#ifdef WITH_PRINING_MIDIFILES
-    // URI handler for printing a midifile - serial monitor needed
-     httpd_uri_t file_print = {
-         .uri       = "/print/*",   // Match all URIs of type /delete/path/to/file
-         .method    = HTTP_POST,
-         .handler   = print_post_handler,
-         .user_ctx  = server_data    // Pass server data as context
-     };
-     httpd_register_uri_handler(server, &file_print);
-#endif
+    // URI handler for playing a midifile together with the running ones
+    httpd_uri_t file_mix = {
+        .uri       = "/mix/*",   // Match all URIs of type /mix/path/to/file
+        .method    = HTTP_POST,
+        .handler   = play_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_mix);
+
+    // URI handler for compacting a midifile
+    httpd_uri_t file_compact = {
+        .uri       = "/compact/*",   // Match all URIs of type /compact/path/to/file
+        .method    = HTTP_POST,
+        .handler   = compact_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_compact);
 
     // URI handler for stop playing
     httpd_uri_t stop_playing = {
@@ -709,6 +1621,22 @@ esp_err_t start_file_server(const char *base_path)
     };
     httpd_register_uri_handler(server, &stop_playing);
 
+    httpd_uri_t record = {
+        .uri       = "/record/*",   // Match all URIs of type /record/path/to/file
+        .method    = HTTP_POST,
+        .handler   = record_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &record);
+
+    httpd_uri_t recstop = {
+        .uri       = "/recstop",
+        .method    = HTTP_POST,
+        .handler   = recstop_post_handler,
+        .user_ctx  = server_data    // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &recstop);
+
     // URI handler for playing random
     httpd_uri_t playrandom = {
         .uri       = "/playrandom",
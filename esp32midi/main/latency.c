@@ -0,0 +1,116 @@
+/*
+ * latency.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * button to sound latency from the trace: a press is followed from the
+ * edge interrupt through the debounce timer, the event queue, the
+ * random pick, opening the song and starting the player to the first
+ * bytes written to MIDI out. Each stage is the time from the one before.
+ *
+ * The presses are injected with gpio_inject, by midihost on the virtual
+ * clock or on the device by POST /latency.
+ */
+
+#include "local.h"
+
+static const char *TAG = "latency";
+
+typedef struct {
+	uint16_t id; // trace record ending the stage
+	const char *name;
+} t_latency_stage;
+
+static const t_latency_stage stages[LATENCY_STAGES] = {
+	{ trc_button_queued, "debounce" },
+	{ trc_button_press, "queue" },
+	{ trc_random_pick, "pick" },
+	{ trc_song_open_end, "open" },
+	{ trc_player_start, "start" },
+	{ trc_player_first_out, "first byte" },
+};
+
+/**
+ * traces all subsystems, the trace is cleared
+ */
+void latency_begin(t_latency *lat) {
+	memset(lat, 0, sizeof(t_latency));
+	lat->mask = trace_mask;
+	trace_set_mask(TRACE_ALL);
+	lat->mark = trace_head();
+}
+
+/**
+ * looks for the stages of the next press in the trace.
+ * Returns 0 if it's complete, -1 if a stage is missing yet
+ */
+int latency_collect(t_latency *lat) {
+	int32_t us[LATENCY_STAGES];
+	uint32_t idx = lat->mark;
+	int64_t prev, t;
+
+	if ( lat->n >= LATENCY_PRESSES || trace_find(&idx, trc_button_isr, &prev)) {
+		return -1;
+	}
+	for ( int s = 0; s < LATENCY_STAGES; s++) {
+		if ( trace_find(&idx, stages[s].id, &t)) {
+			return -1;
+		}
+		us[s] = t - prev;
+		prev = t;
+	}
+	for ( int s = 0; s < LATENCY_STAGES; s++) {
+		lat->us[s][lat->n] = us[s];
+	}
+	lat->n++;
+	lat->mark = idx;
+	return 0;
+}
+
+/**
+ * gives up the press being followed
+ */
+void latency_skip(t_latency *lat) {
+	lat->lost++;
+	lat->mark = trace_head();
+}
+
+void latency_end(t_latency *lat) {
+	trace_set_mask(lat->mask);
+	ESP_LOGI(TAG, "%d presses, %d lost", lat->n, lat->lost);
+}
+
+static int cmp_int32(const void *a, const void *b) {
+	int32_t x = *(const int32_t *) a;
+	int32_t y = *(const int32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * p50, p99 and max of each stage and the total as text,
+ * returns the length
+ */
+int latency_report(t_latency *lat, char *txt, size_t len) {
+	int32_t v[LATENCY_PRESSES];
+	int n = snprintf(txt, len, "%d presses, %d lost\n%-12s %10s %10s %10s\n",
+			lat->n, lat->lost, "stage, us", "p50", "p99", "max");
+
+	for ( int s = 0; s <= LATENCY_STAGES && lat->n > 0 && n < len; s++) {
+		for ( int i = 0; i < lat->n; i++) {
+			if ( s < LATENCY_STAGES) {
+				v[i] = lat->us[s][i];
+			} else {
+				v[i] = 0;
+				for ( int k = 0; k < LATENCY_STAGES; k++) {
+					v[i] += lat->us[k][i];
+				}
+			}
+		}
+		qsort(v, lat->n, sizeof(int32_t), cmp_int32);
+		n += snprintf(&txt[n], len - n, "%-12s %10d %10d %10d\n",
+				s < LATENCY_STAGES ? stages[s].name : "total",
+				v[(lat->n - 1) * 50 / 100], v[(lat->n - 1) * 99 / 100], v[lat->n - 1]);
+	}
+	return n < len ? n : len - 1;
+}
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/param.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
@@ -18,8 +19,13 @@
 #include <time.h>
 #include <sys/time.h>
 
+#ifdef MIDI_HOST
+// player, mixer and synthesizer built on a PC, see ../host
+#include "host_port.h"
+#else
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 
 #include "driver/uart.h"
@@ -41,13 +47,13 @@
 #include "tcpip_adapter.h"
 #include "protocol_examples_common.h"
 #include "esp_http_server.h"
-
-
+#include "lwip/sockets.h"
 
 // to make eclipse happy:
 #ifndef size_t
 #define size_t unsigned int
 #endif
+#endif // MIDI_HOST
 
 #ifndef false
 #define false 0
@@ -88,9 +94,6 @@ enum EVENT_STATE
 // for better resolution: ticks multiplied by this factor
 #define TICKFACTOR 10
 
-// for calculate timing
-#define DELTATIMERMILLIES 10
-
 // Max length a file path can have on storage
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
 
@@ -98,22 +101,72 @@ enum EVENT_STATE
 // value is same as that set in upload_script.html
 #define MAX_FILE_SIZE   (200*1024) // 200 KB
 #define MAX_FILE_SIZE_STR "200KB"
+#ifndef BASE_PATH
 #define BASE_PATH "/spiffs"
+#endif
 
 #define IS_FILE_EXT(filename, ext) \
     (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
+#define IS_SONG_FILE(filename) \
+    (IS_FILE_EXT(filename, ".mid") || IS_FILE_EXT(filename, COMPACT_EXT))
+
 #define DELAY_MILLIES 2000 // 2 secs
-//#define WITH_PRINING_MIDIFILES
+#define RATE_SHIFT 16 // playback rate in fixed point
+#define RATE_ONE (1L << RATE_SHIFT)
+#define RATE_MIN (RATE_ONE / 4)
+#define RATE_MAX (RATE_ONE * 4)
+#define MIDI_BYTE_US 320 // 31250 baud, 10 bits per byte
+#define MIDI_RESET_LEN 33 // system reset and 16 program changes, sent by the mixer
+#define SYSEX_CHUNK 32 // sysex data are sent in pieces of this size
 
 // structures
 // static midi-Data
 typedef struct  {
 	int  datalen;
-    const char data[10];  // MIDI-Daten
+    char data[10];  // MIDI-Daten
 } t_midi_data;
 
+// jingles: songs compiled into flash from main/jingles/*.mid by host/mid2c.py
+typedef struct {
+	uint32_t time_us; // from the start
+	uint8_t len;
+	uint8_t data[3]; // a channel message
+} t_jingle_evt;
+
+typedef struct {
+	const char *name; // the file name without .mid
+	int nevents;
+	const t_jingle_evt *evts;
+} t_jingle;
+
+extern const t_jingle jingles[]; // ends with name NULL, see jingles.c
+#define DEFAULT_JINGLE "doorbell" // played by the buttons without songs
+
+
+
+// compact song files: header followed by LZ compressed data
+#define COMPACT_EXT ".kmf"
+#define COMPACT_MAGIC "KMF1"
+#define COMPACT_HEADER_LEN 20
+#define COMPACT_WINDOW 1024 // must be a power of 2, max 1024
+#define COMPACT_MIN_MATCH 3
+#define COMPACT_MAX_MATCH (COMPACT_MIN_MATCH + 63)
+
+// optimized songs, see midi_optimize.c
+#define OPTIMIZE_TOLERANCE 1 // controller steps a curve may be off
+#define OPTIMIZE_TMP_FILE "/optimize.tmp" // in BASE_PATH, written before replacing the song
+#define OPTIMIZE_BAK_FILE "/optimize.bak" // in BASE_PATH, the song while it is replaced
 
+// decoder state of a compact song, the only buffer is the window
+typedef struct {
+	unsigned char window[COMPACT_WINDOW];
+	unsigned int wpos; // write position in window
+	unsigned int flags; // remaining flag bits, literal = 1
+	unsigned int copy_dist; // distance of actual match
+	unsigned int copy_len; // remaining bytes of actual match
+	long remaining; // number of decoded bytes left
+} t_compact_dec;
 
 // Midi data from file
 typedef struct midi_evt {
@@ -124,13 +177,20 @@ typedef struct midi_evt {
 	int status;
 	size_t datalen;
 	char *data;
+	size_t datasize; // allocated for data, kept for the next event
+	long sysex_len; // sysex data not yet read from the file
 } t_midi_evt;
 
-// Track
+#define TRACK_BUF_SIZE 256 // read buffer of a track, smaller for short tracks
+#define TRACK_NEED_EVENT -1L // next_ticks of a track without pending event
+#define TRACK_FINISHED LONG_MAX // next_ticks of a finished track
+
+// Track, all tracks of a song are in one array
 typedef struct midi_track {
 	int trackno;
 	unsigned int len;
-	char buf[256];
+	char *buf; // part of the songs trackbuf
+	unsigned int bufsize;
 	long fpos; // file position
 	unsigned int buflen; // number of bytes in buffer
 	unsigned int rdpos; // read position on buffer
@@ -138,9 +198,9 @@ typedef struct midi_track {
 	long track_ticks;
 	unsigned char lastevent; // in case of repeated events
 	int finished; // finished means: got end of track Event FF 21 00
+	int sysex_open; // sysex without F7, continued by F7 events
 	t_midi_evt evt;
-	//
-	struct midi_track *nxt;
+	t_compact_dec *compact; // only for compact songs
 } t_midi_track;
 
 // Midi Song
@@ -148,53 +208,427 @@ typedef struct {
 	FILE *fd;
 	char *filepath;
 	int format; // from header
-	int ntracks;
+	int ntracks; // track chunks found
+	int compact; // compact song, not a SMF
+	long nevents; // number of events read
+	int64_t read_us; // time needed to read/decode events
 	//
 	long tpq; // division
 	long microsecsperquarter; // tempo
-	long microseconds_per_tick;
+	long tempo_ticks; // position of the last tempo change
+	int64_t tempo_us; // time of the last tempo change since start
 	long song_ticks; // ticks from the beginning
 	// play parameter
-	long timermillies; // timerperiod in ms
-	long timer_ticks; // ticks per timer processing
-	int blink_cnt;
-	int is_on;
-#ifdef WITH_PRINING_MIDIFILES
-	int printonly;
-#endif
-	int64_t starttime;
+	int64_t starttime; // esp_timer time of tick 0
+	long rate; // playback rate, RATE_ONE is as written
 	t_midi_track *tracks;
+	// ticks of the pending event per track, the only track data
+	// looked at for every event
+	long *next_ticks;
+	int peeked; // track of the last peek, its event may have been consumed since
+	char *trackbuf; // next_ticks and the read buffers of all tracks
+	size_t trackmem; // bytes allocated for the tracks
+	// sysex in progress, nothing else is sent until it is complete
+	t_midi_track *sysex_trck;
+	int64_t sysex_due; // time of the next piece
+	int sysex_fill; // bytes already in sysex_buf
+	char sysex_buf[SYSEX_CHUNK + 2]; // F0 + data + F7
 } t_midi_song;
 
+// receives the events of a player to be sent,
+// sysex pieces come as event F0 with the bytes for the wire in data
+typedef void (*t_player_out)(t_midi_song *song, t_midi_evt *evt, void *ctx);
+
+// state of the channels for starting a song in the middle
+#define CHASE_UNSET 0xFF
+#define CHASE_CONTROLLERS 120 // 120..127 are channel mode messages
+#define CHASE_RPNS 3 // bend range, fine and coarse tuning
+
+typedef struct {
+	unsigned char program;
+	unsigned char cc[CHASE_CONTROLLERS];
+	unsigned char rpn[2]; // selected RPN, MSB and LSB
+	unsigned char rpn_value[CHASE_RPNS][2]; // data entry MSB and LSB
+	int bend; // 0..16383, -1 if not set
+} t_chase_channel;
+
+typedef struct {
+	t_chase_channel ch[16];
+} t_chase;
+
+// number of songs which can be played simultaneously
+#define MIX_PLAYERS 3
+#define MIX_MAIN_PLAYER 0 // player for the doorbell and the play button
+#define MIX_SECOND_PLAYER 1 // player of the second doorbell input
+
+// what the mixer does, for the web page
+typedef struct {
+	long events; // sent since boot
+	long dropped;
+	int queued; // players waiting for their next event
+	struct {
+		char file[32]; // empty if idle
+		int64_t start; // time of the song's start, may be in the future
+	} player[MIX_PLAYERS];
+} t_mixer_status;
+
+#define MIX_LATE_BUCKETS 6
+
+// how late the mixer is woken, for the task placement
+typedef struct {
+	long wakeups;
+	int64_t late_sum_us;
+	long late_max_us;
+	long late[MIX_LATE_BUCKETS]; // below 100, 250, 500, 1000, 2000 µs, above
+} t_mixer_timing;
+
+// chimes
+#define CHIME_MAX_RULES 256
+#define CHIME_SONG_LEN 10
+
+enum CHIME_KIND { chime_none, chime_at, chime_hourly, chime_quiet };
+
+// a rule as stored in NVS
+typedef struct {
+	unsigned char kind;
+	unsigned char days; // bit 0 sunday .. bit 6 saturday
+	unsigned char hour;
+	unsigned char minute;
+	unsigned char end_hour; // hourly: last hour, quiet: end
+	unsigned char end_minute;
+	char song[CHIME_SONG_LEN]; // beginning of the song file names, empty: strikes resp. any song
+} t_chime_rule;
+
+typedef void (*t_chime_action)(const t_chime_rule *rule, struct tm *tm);
+
+// event transforms
+#define XFORM_MAX_RULES 32
+#define XFORM_SONG_LEN 16
+#define XFORM_DROP 0xFF
+
+enum XFORM_KIND { xform_none, xform_transpose, xform_curve, xform_velocity, xform_channel, xform_mute };
+
+// a rule as stored in NVS
+typedef struct {
+	unsigned char kind;
+	signed char a; // semitones, curve, min. velocity, output channel 0..15
+	unsigned char b; // max. velocity
+	uint16_t channels; // bit 0 channel 1 .. bit 15 channel 16
+	char song[XFORM_SONG_LEN]; // beginning of the song file names, empty: all songs
+} t_xform_rule;
+
+// compiled rules of a song, indexed by the song channel
+typedef struct {
+	unsigned char note[16][128]; // XFORM_DROP: left out
+	unsigned char velocity[16][128]; // of note on
+	unsigned char channel[16]; // XFORM_DROP: muted
+} t_xform;
+
+// software synthesizer
+#define SYNTH_VOICES 32
+#define SYNTH_BLOCK 32 // samples per envelope step
+
+// clock, timers and MIDI output, see midi_hal.c
+typedef struct hal_timer *t_hal_timer;
+typedef void (*t_hal_timer_cb)(void *arg);
+typedef struct hal_queue *t_hal_queue;
+
+// binary trace, see trace.c. The subsystem is the high byte of the id
+enum TRACE_SUBSYS { trace_gpio, trace_http, trace_file, trace_mixer, trace_chime, TRACE_SUBSYSTEMS };
+#define TRACE_ALL ((1 << TRACE_SUBSYSTEMS) - 1)
+#define TRACE_ID(subsys, n) ((subsys) << 8 | (n))
+
+enum TRACE_EVENT {
+	trc_button_isr = TRACE_ID(trace_gpio, 0),
+	trc_button_press,
+	trc_button_ignored,
+	trc_button_queued,
+	trc_upload_begin = TRACE_ID(trace_http, 0),
+	trc_upload_chunk,
+	trc_upload_end,
+	trc_http_play,
+	trc_random_entry = TRACE_ID(trace_file, 0),
+	trc_random_pick,
+	trc_song_open_begin,
+	trc_track_chunk,
+	trc_song_open_end,
+	trc_track_end,
+	trc_player_start = TRACE_ID(trace_mixer, 0),
+	trc_player_end,
+	trc_mixer_tick,
+	trc_player_align,
+	trc_player_first_out,
+	trc_player_shift,
+	trc_player_chase,
+	trc_channel_shared,
+	trc_mixer_rate,
+	trc_mixer_idle,
+	trc_song_decoded,
+	trc_chime_fire = TRACE_ID(trace_chime, 0),
+};
+
+extern uint32_t trace_mask;
+#define TRACE(id, a, b) do { \
+		if ( trace_mask & (1 << ((id) >> 8))) { \
+			trace_put((id), (a), (b)); \
+		} \
+	} while (0)
+
+// receives the exported text, returns 0 if ok
+typedef int (*t_trace_put)(const char *txt, void *ctx);
+
+// button to sound latency, see latency.c
+#define LATENCY_PRESSES 64
+#define LATENCY_TIMEOUT_US 2000000 // a press not played by then is lost
+
+// the stages of a press after the edge interrupt
+enum LATENCY_STAGE { lat_debounce, lat_queue, lat_pick, lat_open, lat_start, lat_first_out, LATENCY_STAGES };
+
+typedef struct {
+	int n; // presses measured
+	int lost; // presses with a missing stage
+	uint32_t mask; // trace mask to restore
+	uint32_t mark; // next trace record to look at
+	int32_t us[LATENCY_STAGES][LATENCY_PRESSES]; // from the stage before
+} t_latency;
+
+// voice limiter, see midi_voice.c
+enum VOICE_RC { VOICE_PLAY, VOICE_DROP, VOICE_STEAL };
+
+typedef struct {
+	int limit; // CONFIG_MIDI_SYNTH_POLYPHONY
+	int active; // notes sounding
+	int peak;
+	long dropped; // new notes given way
+	long stolen; // sounding notes shortened
+} t_voice_stat;
+
+// MIDI in, see midi_in.c
+#define MIDI_IN_PRIORITY CONFIG_MIDI_IN_PRIORITY // above HTTP and buttons for MIDI thru, mostly waiting
+#define MIDI_THRU_DEFAULT true
+
+typedef struct {
+	int64_t time; // µs of the first byte
+	unsigned char status;
+	unsigned char data[2];
+} t_midi_in_evt;
+
+typedef struct {
+	long bytes;
+	long events; // complete messages
+	long realtime;
+	long sysex;
+	long incomplete; // messages interrupted by a status
+	long stray; // data bytes without status
+	long recorded; // events of the recording
+	long dropped; // ring full
+	long thru; // messages sent on
+	int64_t thru_sum_us; // latency
+	long thru_max_us;
+	long thru_late; // above 1 ms
+	long conflicts; // waiting for the sysex of a song
+	long thru_dropped; // too many waiting
+} t_midi_in_stat;
+
+// network MIDI, see rtp_midi.c
+#define RTP_MIDI_PORT 5004 // control, the data port is the next one
+#define RTP_MIDI_PRIORITY 11 // below MIDI in
+
+// sends a packet to the peer on the control or data port
+typedef void (*t_rtp_send)(int data_port, const unsigned char *pkt, int len, void *ctx);
+
+typedef struct {
+	int active; // session running
+	char peer[32]; // name of the peer
+	long sessions;
+	long packets;
+	long events; // channel messages queued
+	long lost; // missing packets
+	long reordered;
+	long dropped; // queue or wire queue full
+	long late; // received more than 1 ms after their time to be played
+	long max_late_us;
+	long clamped; // time too far in the future
+	long syncs; // clock syncs
+	long rtt_us; // round trip of the last sync
+	int64_t offset_us; // peer clock - our clock, now
+	long drift_ppb; // the peer clock is faster by this
+} t_rtp_stat;
+
 // Prototypes
 // gpio.c
 void init_gpio();
+int gpio_handle_event(int timeout_ms);
+int gpio_inject(int button);
+
+// latency
+void latency_begin(t_latency *lat);
+int latency_collect(t_latency *lat);
+void latency_skip(t_latency *lat);
+void latency_end(t_latency *lat);
+int latency_report(t_latency *lat, char *txt, size_t len);
 
 // GPIO/LED
 void led_init();
 void blue_on();
 void blue_off();
 
+// rules stored in NVS
+typedef int (*t_parse_rule)(const char *line, void *rule);
+size_t nvs_load_blob(const char *name, const char *key, void *data, size_t size);
+int nvs_save_blob(const char *name, const char *key, const void *data, size_t size);
+int parse_rule_lines(const char *text, t_parse_rule parse, void *rules, size_t size, int max,
+		char *err, size_t errlen);
+
+// HAL
+int64_t hal_time_us();
+int64_t hal_stopwatch_us();
+int64_t hal_wall_us();
+int hal_core_id();
+void hal_critical_enter();
+void hal_critical_exit();
+t_hal_timer hal_timer_create(t_hal_timer_cb callback, void *arg, const char *name);
+t_hal_timer hal_timer_create_play(t_hal_timer_cb callback, void *arg, const char *name);
+void hal_timer_once(t_hal_timer timer, int64_t timeout_us);
+void hal_timer_periodic(t_hal_timer timer, int64_t period_us);
+esp_err_t hal_timer_start_periodic(t_hal_timer timer, int64_t period_us);
+void hal_timer_stop(t_hal_timer timer);
+void hal_timer_wake(t_hal_timer timer, int64_t timeout_us);
+void hal_midi_init();
+void hal_midi_write(const char *data, int len);
+int hal_midi_read(unsigned char *buf, int len, int timeout_ms);
+void hal_gpio_input(const int *pins, int npins, void (*isr)(void *arg));
+int hal_gpio_level(int pin);
+t_hal_queue hal_queue_create(int len, int size);
+int hal_queue_send(t_hal_queue queue, const void *item);
+int hal_queue_receive(t_hal_queue queue, void *item, int timeout_ms);
+int hal_queue_pending(t_hal_queue queue);
+int hal_task_start(void (*task)(void *arg), const char *name, int stack, int priority, int core, void *arg);
+
 // MIDI
 void midi_init();
 void midi_out( const char *data, int len);
 void midi_out_evt( const char evt, const char *data, int len);
 void play_ok();
 void play_err();
+const t_jingle *find_jingle(const char *name);
+int play_jingle(const char *name);
+void play_strikes(int n, int64_t wall_us);
 void midi_reset();
+void seq_write_begin(uint32_t *seq);
+void seq_write_end(uint32_t *seq);
+int seq_read(const uint32_t *seq, void *dst, const void *src, size_t len);
+
+// MIDI in
+void midi_in_init();
+void midi_in_input(const unsigned char *data, int len, int64_t time);
+void midi_in_service(int idle);
+int midi_in_record(const char *filepath);
+int midi_in_stop();
+int midi_in_recording();
+void midi_in_get_stat(t_midi_in_stat *s);
+void midi_in_thru(int on);
+int midi_in_thru_on();
+void midi_in_thru_sent(int64_t received, int64_t start, int held);
+int midi_in_send(unsigned char status, const unsigned char *data);
+
+// network MIDI
+void rtp_midi_init();
+void rtp_midi_packet(int data_port, const unsigned char *pkt, int len, int64_t now);
+void rtp_midi_set_send(t_rtp_send send, void *ctx);
+void rtp_midi_get_stat(t_rtp_stat *s);
 
 // MIDI file
-int open_midifile(const char *filename);
-int parse_midifile();
-int handle_play_midifile(const char *filename, int with_delay);
-int handle_print_midifile(const char *filename);
+int count_midifiles(const char *dirpath, const char *prefix);
+int pick_random_midifile(const char *dirpath, const char *prefix, char *entrypath, size_t len);
+int handle_play_random_midifile(const char *path, const char *prefix, int player, int with_delay );
+t_midi_song *midi_song_open(const char *filepath);
+void midi_song_close(t_midi_song *song);
+t_midi_track *midi_song_next_event(t_midi_song *song);
+int midi_song_read_sysex(t_midi_song *song, t_midi_track *trck, char *buf, int len);
+int midi_song_sysex_continues(t_midi_song *song, t_midi_track *trck);
+int player_next_due(t_midi_song *song, int64_t *due);
+int player_process(t_midi_song *song, int64_t now, t_player_out out, void *ctx);
+long player_seek(t_midi_song *song, int64_t start_us, t_chase *chase);
+t_midi_track *midi_song_next_timed(t_midi_song *song, int64_t *us);
+void player_set_rate(t_midi_song *song, long rate, int64_t now);
+
+// chase
+void chase_init(t_chase *chase);
+void chase_event(t_chase *chase, t_midi_evt *evt);
+int chase_send(t_chase *chase, int full, t_midi_song *song, t_player_out out, void *ctx);
+
+// voice limiter
+void voice_reset();
+int voice_note_on(int ch, int note, int velocity, unsigned char off[3]);
+int voice_note_off(int ch, int note);
+void voice_channel_off(int ch);
+void voice_get_stat(t_voice_stat *st, int clear);
+int midi_song_polyphony(const char *filepath);
+
+// mixer
+void mixer_init();
+int mixer_play(int player, const char *filename, int with_delay, long start_ms);
+int mixer_play_at(int player, const char *filename, int64_t wall_us);
+int mixer_stop(int player);
+int handle_play_midifile(const char *filename, int with_delay, long start_ms);
+int handle_mix_midifile(const char *filename, int with_delay, long start_ms);
 int handle_stop_midifile();
-int handle_play_random_midifile(const char *path, int with_delay );
+int mixer_send(const unsigned char *msg, int len, int64_t received);
+void mixer_xform_update();
+int mixer_set_rate(long rate);
+long mixer_get_rate();
+int mixer_get_status(t_mixer_status *status);
+void mixer_get_timing(t_mixer_timing *timing, int clear);
+
+// event transforms
+void xform_init();
+t_xform *xform_compile(const char *filepath);
+int xform_set_rules(const char *text, char *err, size_t errlen);
+int xform_get_rules(char *buf, size_t len);
+
+// compact songs
+void compact_init(t_compact_dec *dec, long decoded_len);
+int compact_getc(t_compact_dec *dec, int (*src)(void *ctx), void *ctx);
+int compact_midifile(const char *srcpath, const char *dstpath, char *report, size_t reportlen);
+
+// optimized songs
+int optimize_midifile(const char *srcpath, const char *dstpath, int tolerance, char *report, size_t reportlen);
+
+// export
+#define EXPORT_NO_SONG -2 // export_song could not read the song
+typedef int (*t_export_put)(const char *data, size_t len, void *ctx);
+int export_song(const char *filepath, int binary, char *buf, size_t bufsize, t_export_put put, void *ctx);
+
+// chimes
+void chime_init();
+void chime_reschedule();
+time_t chime_restart(time_t now);
+time_t chime_advance(time_t now);
+void chime_set_action(t_chime_action action);
+int chime_handle_event(int timeout_ms);
+int chime_set_rules(const char *text, char *err, size_t errlen);
+int chime_get_rules(char *buf, size_t len);
+
+// trace
+void trace_put(uint16_t id, int32_t a, int32_t b);
+void trace_set_mask(uint32_t mask);
+int trace_export(t_trace_put put, void *ctx);
+uint32_t trace_head();
+int trace_find(uint32_t *idx, uint16_t id, int64_t *time);
+
+// synthesizer
+void synth_init(int rate);
+void synth_reset();
+void synth_midi_in(const unsigned char *data, int len);
+void synth_render(int16_t *out, int n);
+int synth_active_voices();
 
 // Start Fileserver
 esp_err_t start_file_server(const char *base_path);
 
 // sntp
+void init_timezone();
 void test_sntp();
 void obtain_time(void);
 void initialize_sntp(void);
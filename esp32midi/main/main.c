@@ -21,7 +21,7 @@ static esp_err_t init_spiffs(void)
     ESP_LOGI(TAG, "Initializing SPIFFS");
 
     esp_vfs_spiffs_conf_t conf = {
-      .base_path = "/spiffs",
+      .base_path = BASE_PATH,
       .partition_label = NULL,
       .max_files = 5,   // This decides the maximum number of files that can be created on the storage
       .format_if_mount_failed = true
@@ -51,15 +51,19 @@ static esp_err_t init_spiffs(void)
 }
 
 
-void app_main()
+/**
+ * logs the time a stage of the startup is ready
+ */
+static void boot_stage(const char *name)
 {
-	init_gpio();
-	midi_init();
-	led_init();
-
-	blue_on();
+    ESP_LOGI(TAG, "boot %5lld ms: %s", hal_time_us() / 1000, name);
+}
 
-    ESP_ERROR_CHECK(nvs_flash_init());
+/**
+ * the network comes up in the background, the doorbell works meanwhile
+ */
+static void network_task(void *arg)
+{
     tcpip_adapter_init();
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
@@ -68,16 +72,62 @@ void app_main()
      * examples/protocols/README.md for more information about this function.
      */
     ESP_ERROR_CHECK(example_connect());
-
-    /* Initialize file storage */
-    ESP_ERROR_CHECK(init_spiffs());
+    boot_stage("network connected");
 
     /* Start the file server */
-    ESP_ERROR_CHECK(start_file_server("/spiffs"));
+    ESP_ERROR_CHECK(start_file_server(BASE_PATH));
+    boot_stage("file server ready");
+
+    /* network MIDI from DAWs on the LAN */
+    rtp_midi_init();
+    boot_stage("network MIDI ready");
 
 	play_ok();
 
     blue_off();
 
+    // may wait up to 20 s for the time
     test_sntp();
+    boot_stage("time set");
+
+    vTaskDelete(NULL);
+}
+
+/**
+ * starts in stages: the player and the buttons first, so the doorbell
+ * works within a few hundred ms, with a jingle from flash until the
+ * songs are mounted. Wi-Fi, the file server and SNTP follow
+ * in the background
+ */
+void app_main()
+{
+    boot_stage("app_main");
+	midi_init();
+	midi_in_init();
+	led_init();
+
+	blue_on();
+    boot_stage("MIDI ready");
+
+    ESP_ERROR_CHECK(nvs_flash_init());
+    xform_init();
+
+    // buttons play songs from now on, the default jingle until they are there
+	init_gpio();
+    boot_stage("doorbell ready");
+
+    /* Initialize file storage */
+    ESP_ERROR_CHECK(init_spiffs());
+    ESP_LOGI(TAG, "%d songs", count_midifiles(BASE_PATH, NULL));
+    boot_stage("storage ready");
+
+    // chimes wait for the time, SNTP reschedules them
+    init_timezone();
+    chime_init();
+    boot_stage("chimes ready");
+
+    if (hal_task_start(network_task, "network", 4096, 5, CONFIG_MIDI_NET_CORE, NULL)) {
+        ESP_LOGE(TAG, "network task not started");
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
 }
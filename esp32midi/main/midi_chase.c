@@ -0,0 +1,211 @@
+/*
+ * midi_chase.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * controller, program and pitch bend state of the channels of a song.
+ * A song started in the middle has to set up the synthesizer like the
+ * skipped events would have done: the events are collected while
+ * skipping, then only the messages which change something are sent.
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_chase";
+
+#define CHASE_BEND_UNSET -1
+#define RPN_NULL 0x7F
+
+/**
+ * value of a controller after a reset, GM defaults
+ */
+static unsigned char cc_default(int cc) {
+	switch (cc) {
+	case 7: // volume
+		return 100;
+	case 8: // balance
+	case 10: // pan
+		return 64;
+	case 11: // expression
+		return 127;
+	default:
+		return 0;
+	}
+}
+
+// defaults of the RPNs 0 (bend range), 1 (fine tuning), 2 (coarse tuning)
+static const unsigned char rpn_default[CHASE_RPNS][2] = { {2, 0}, {64, 0}, {64, 0} };
+
+/**
+ * controllers sent in other ways: bank select, data entry, (N)RPN select
+ */
+static int cc_special(int cc) {
+	return cc == 0 || cc == 32 || cc == 6 || cc == 38 || (cc >= 98 && cc <= 101);
+}
+
+static void reset_channel(t_chase_channel *ch) {
+	ch->program = CHASE_UNSET;
+	memset(ch->cc, CHASE_UNSET, sizeof(ch->cc));
+	memset(ch->rpn_value, CHASE_UNSET, sizeof(ch->rpn_value));
+	ch->rpn[0] = ch->rpn[1] = RPN_NULL;
+	ch->bend = CHASE_BEND_UNSET;
+}
+
+void chase_init(t_chase *chase) {
+	for ( int c = 0; c < 16; c++) {
+		reset_channel(&chase->ch[c]);
+	}
+}
+
+static void control_change(t_chase_channel *ch, int cc, int value) {
+	switch (cc) {
+	case 101: // RPN MSB
+	case 100: // RPN LSB
+		ch->rpn[101 - cc] = value;
+		break;
+	case 99: // NRPN, data entry does not change a RPN
+	case 98:
+		ch->rpn[0] = ch->rpn[1] = RPN_NULL;
+		break;
+	case 6: // data entry
+	case 38:
+		if ( ch->rpn[0] == 0 && ch->rpn[1] < CHASE_RPNS) {
+			ch->rpn_value[ch->rpn[1]][cc == 38] = value;
+		}
+		break;
+	case 121: { // reset all controllers, bank, volume and pan are kept
+		unsigned char keep[4] = { ch->cc[0], ch->cc[32], ch->cc[7], ch->cc[10] };
+		memset(ch->cc, CHASE_UNSET, sizeof(ch->cc));
+		ch->cc[0] = keep[0];
+		ch->cc[32] = keep[1];
+		ch->cc[7] = keep[2];
+		ch->cc[10] = keep[3];
+		ch->rpn[0] = ch->rpn[1] = RPN_NULL;
+		ch->bend = CHASE_BEND_UNSET;
+		break;
+	}
+	default:
+		if ( cc < CHASE_CONTROLLERS) {
+			ch->cc[cc] = value;
+		}
+		// channel mode messages are no state
+		break;
+	}
+}
+
+/**
+ * collects the state changes of a channel event
+ */
+void chase_event(t_chase *chase, t_midi_evt *evt) {
+	t_chase_channel *ch = &chase->ch[evt->event & 0x0F];
+	switch (evt->event & 0xF0) {
+	case 0xB0:
+		if ( evt->datalen >= 2) {
+			control_change(ch, evt->data[0] & 0x7F, evt->data[1] & 0x7F);
+		}
+		break;
+	case 0xC0:
+		if ( evt->datalen >= 1) {
+			ch->program = evt->data[0] & 0x7F;
+		}
+		break;
+	case 0xE0:
+		if ( evt->datalen >= 2) {
+			ch->bend = (evt->data[1] & 0x7F) << 7 | (evt->data[0] & 0x7F);
+		}
+		break;
+	default:
+		// notes and aftertouch are no state
+		break;
+	}
+}
+
+static int send_msg(t_midi_song *song, t_player_out out, void *ctx, unsigned char event, int d1, int d2, int len) {
+	char data[2] = { d1, d2 };
+	t_midi_evt evt;
+	memset(&evt, 0, sizeof(evt));
+	evt.evt_ticks = song->song_ticks;
+	evt.event = event;
+	evt.status = has_event;
+	evt.data = data;
+	evt.datalen = len;
+	out(song, &evt, ctx);
+	return 1 + len;
+}
+
+/**
+ * sends the state of all channels. Without 'full' only values which
+ * differ from the state after midi_reset are sent, 'full' is needed
+ * when the channels were used before without reset.
+ * returns the number of bytes sent
+ */
+int chase_send(t_chase *chase, int full, t_midi_song *song, t_player_out out, void *ctx) {
+	int bytes = 0;
+	int messages = 0;
+
+	for ( int c = 0; c < 16; c++) {
+		t_chase_channel *ch = &chase->ch[c];
+		unsigned char cc_evt = 0xB0 | c;
+
+		// bank select is valid with the next program change
+		int bank = false;
+		for ( int i = 0; i <= 32; i += 32) {
+			if ( ch->cc[i] != CHASE_UNSET && (full || ch->cc[i] != 0)) {
+				bytes += send_msg(song, out, ctx, cc_evt, i, ch->cc[i], 2);
+				messages++;
+				bank = true;
+			}
+		}
+		if ( ch->program != CHASE_UNSET && (full || bank || ch->program != 0)) {
+			bytes += send_msg(song, out, ctx, 0xC0 | c, ch->program, 0, 1);
+			messages++;
+		}
+
+		for ( int i = 0; i < CHASE_CONTROLLERS; i++) {
+			if ( cc_special(i) || ch->cc[i] == CHASE_UNSET) {
+				continue;
+			}
+			if ( full || ch->cc[i] != cc_default(i)) {
+				bytes += send_msg(song, out, ctx, cc_evt, i, ch->cc[i], 2);
+				messages++;
+			}
+		}
+
+		int rpn_sent = false;
+		for ( int r = 0; r < CHASE_RPNS; r++) {
+			unsigned char *v = ch->rpn_value[r];
+			if ( v[0] == CHASE_UNSET && v[1] == CHASE_UNSET) {
+				continue;
+			}
+			if ( !full && (v[0] == CHASE_UNSET || v[0] == rpn_default[r][0])
+					&& (v[1] == CHASE_UNSET || v[1] == rpn_default[r][1])) {
+				continue;
+			}
+			bytes += send_msg(song, out, ctx, cc_evt, 101, 0, 2);
+			bytes += send_msg(song, out, ctx, cc_evt, 100, r, 2);
+			messages += 2;
+			for ( int i = 0; i < 2; i++) {
+				if ( v[i] != CHASE_UNSET) {
+					bytes += send_msg(song, out, ctx, cc_evt, i ? 38 : 6, v[i], 2);
+					messages++;
+				}
+			}
+			rpn_sent = true;
+		}
+		if ( rpn_sent || ch->rpn[0] != RPN_NULL || ch->rpn[1] != RPN_NULL) {
+			// selection of the song, following data entries belong to it
+			bytes += send_msg(song, out, ctx, cc_evt, 101, ch->rpn[0], 2);
+			bytes += send_msg(song, out, ctx, cc_evt, 100, ch->rpn[1], 2);
+			messages += 2;
+		}
+
+		if ( ch->bend != CHASE_BEND_UNSET && (full || ch->bend != 8192)) {
+			bytes += send_msg(song, out, ctx, 0xE0 | c, ch->bend & 0x7F, ch->bend >> 7, 2);
+			messages++;
+		}
+	}
+
+	ESP_LOGI(TAG, "%s: chase %s, %d messages, %d bytes", song->filepath, full ? "full" : "minimal", messages, bytes);
+	return bytes;
+}
@@ -0,0 +1,396 @@
+/*
+ * midi_compact.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * compact song format (*.kmf)
+ *
+ * All tracks of a midi file are merged into one track (like format 0),
+ * meta events except tempo are removed, running status is used wherever
+ * possible. The result is still valid SMF track data, so the player reads
+ * it with the same event parser. This stream is compressed with a LZSS
+ * coder using a window of COMPACT_WINDOW bytes. The decoder needs only
+ * the window, the song is never inflated as a whole.
+ *
+ * File layout, numbers big endian like SMF:
+ *   0  "KMF1"
+ *   4  2 byte ticks per quarter
+ *   6  2 byte reserved
+ *   8  4 byte length of the decoded track data
+ *  12  4 byte size of the original file
+ *  16  4 byte number of events
+ *  20  compressed data: a flag byte for 8 items, bit=1: literal byte,
+ *      bit=0: match of 2 bytes, 10 bit distance-1, 6 bit length-3
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_compact";
+
+#define LZ_HASH_SIZE 4096
+#define LZ_BUF_SIZE (2*COMPACT_WINDOW) // history + lookahead
+#define LZ_MAX_CHAIN 32
+
+typedef struct {
+	FILE *fd;
+	unsigned char buf[LZ_BUF_SIZE];
+	long wr; // number of bytes put into the encoder
+	long rd; // next position to encode
+	long head[LZ_HASH_SIZE];
+	long prev[COMPACT_WINDOW];
+	unsigned char group[1 + 8*2]; // flag byte and up to 8 items
+	int grouplen;
+	int nitems;
+	long outlen; // compressed bytes written
+	int failed;
+} t_lz_enc;
+
+/**
+ * initialize the decoder for a compressed stream
+ */
+void compact_init(t_compact_dec *dec, long decoded_len) {
+	memset(dec, 0, sizeof(t_compact_dec));
+	dec->remaining = decoded_len;
+}
+
+/**
+ * get the next decoded byte, -1 at the end of data
+ */
+int compact_getc(t_compact_dec *dec, int (*src)(void *ctx), void *ctx) {
+	int c;
+
+	if ( dec->remaining <= 0) {
+		return -1;
+	}
+
+	if ( dec->copy_len == 0) {
+		if ( dec->flags <= 1) {
+			// all items of the group done, get next flag byte
+			if ( (c = src(ctx)) < 0) {
+				return -1;
+			}
+			dec->flags = c | 0x100;
+		}
+		int literal = dec->flags & 1;
+		dec->flags >>= 1;
+
+		if ( literal) {
+			if ( (c = src(ctx)) < 0) {
+				return -1;
+			}
+			dec->window[dec->wpos++ & (COMPACT_WINDOW-1)] = c;
+			dec->remaining--;
+			return c;
+		}
+
+		int b0 = src(ctx);
+		int b1 = src(ctx);
+		if ( b0 < 0 || b1 < 0) {
+			return -1;
+		}
+		dec->copy_dist = (b0 | ((b1 & 0x03) << 8)) + 1;
+		dec->copy_len = (b1 >> 2) + COMPACT_MIN_MATCH;
+	}
+
+	c = dec->window[(dec->wpos - dec->copy_dist) & (COMPACT_WINDOW-1)];
+	dec->copy_len--;
+	dec->window[dec->wpos++ & (COMPACT_WINDOW-1)] = c;
+	dec->remaining--;
+	return c;
+}
+
+static void lz_flush_group(t_lz_enc *enc) {
+	if ( enc->nitems == 0) {
+		return;
+	}
+	if ( fwrite(enc->group, 1, enc->grouplen, enc->fd) != enc->grouplen) {
+		enc->failed = true;
+	}
+	enc->outlen += enc->grouplen;
+	enc->grouplen = 0;
+	enc->nitems = 0;
+}
+
+static void lz_emit(t_lz_enc *enc, int literal, unsigned char b0, unsigned char b1) {
+	if ( enc->nitems == 0) {
+		enc->group[0] = 0;
+		enc->grouplen = 1;
+	}
+	if ( literal) {
+		enc->group[0] |= 1 << enc->nitems;
+		enc->group[enc->grouplen++] = b0;
+	} else {
+		enc->group[enc->grouplen++] = b0;
+		enc->group[enc->grouplen++] = b1;
+	}
+	if ( ++enc->nitems == 8) {
+		lz_flush_group(enc);
+	}
+}
+
+static inline unsigned char lz_byte(t_lz_enc *enc, long pos) {
+	return enc->buf[pos & (LZ_BUF_SIZE-1)];
+}
+
+static inline int lz_hash(t_lz_enc *enc, long pos) {
+	return ((lz_byte(enc, pos) << 8) ^ (lz_byte(enc, pos+1) << 4) ^ lz_byte(enc, pos+2)) & (LZ_HASH_SIZE-1);
+}
+
+static void lz_insert(t_lz_enc *enc, long pos) {
+	if ( pos + 2 >= enc->wr) {
+		return; // not enough data for a hash
+	}
+	int h = lz_hash(enc, pos);
+	enc->prev[pos & (COMPACT_WINDOW-1)] = enc->head[h];
+	enc->head[h] = pos;
+}
+
+/**
+ * encode one item at the read position
+ */
+static void lz_encode_one(t_lz_enc *enc) {
+	long avail = enc->wr - enc->rd;
+	int best_len = 0;
+	long best_pos = 0;
+
+	if ( avail >= COMPACT_MIN_MATCH) {
+		int maxlen = avail < COMPACT_MAX_MATCH ? avail : COMPACT_MAX_MATCH;
+		long cand = enc->head[lz_hash(enc, enc->rd)];
+		for ( int chain = 0; chain < LZ_MAX_CHAIN && cand >= 0 && enc->rd - cand <= COMPACT_WINDOW; chain++) {
+			int len = 0;
+			while ( len < maxlen && lz_byte(enc, cand + len) == lz_byte(enc, enc->rd + len)) {
+				len++;
+			}
+			if ( len > best_len) {
+				best_len = len;
+				best_pos = cand;
+				if ( len == maxlen)
+					break;
+			}
+			long nxt = enc->prev[cand & (COMPACT_WINDOW-1)];
+			if ( nxt >= cand)
+				break; // overwritten entry
+			cand = nxt;
+		}
+	}
+
+	if ( best_len >= COMPACT_MIN_MATCH) {
+		unsigned int dist = enc->rd - best_pos - 1;
+		lz_emit(enc, false, dist & 0xFF, (dist >> 8) | ((best_len - COMPACT_MIN_MATCH) << 2));
+		for ( int i = 0; i < best_len; i++) {
+			lz_insert(enc, enc->rd++);
+		}
+	} else {
+		lz_emit(enc, true, lz_byte(enc, enc->rd), 0);
+		lz_insert(enc, enc->rd++);
+	}
+}
+
+static void lz_put(t_lz_enc *enc, unsigned char c) {
+	enc->buf[enc->wr++ & (LZ_BUF_SIZE-1)] = c;
+	if ( enc->wr - enc->rd >= COMPACT_MAX_MATCH) {
+		lz_encode_one(enc);
+	}
+}
+
+static void lz_put_vlq(t_lz_enc *enc, unsigned long val) {
+	unsigned char tmp[5];
+	int n = 0;
+	do {
+		tmp[n++] = val & 0x7F;
+		val >>= 7;
+	} while ( val);
+	while ( n > 1) {
+		lz_put(enc, tmp[--n] | 0x80);
+	}
+	lz_put(enc, tmp[0]);
+}
+
+static void lz_finish(t_lz_enc *enc) {
+	while ( enc->rd < enc->wr) {
+		lz_encode_one(enc);
+	}
+	lz_flush_group(enc);
+}
+
+static void write_long(FILE *fd, unsigned long val, int n) {
+	while ( n-- > 0) {
+		fputc((val >> (8*n)) & 0xFF, fd);
+	}
+}
+
+/**
+ * reads all events of a song, returns the number of events
+ */
+static long count_events(const char *filepath, int64_t *read_us) {
+	t_midi_song *song = midi_song_open(filepath);
+	if ( !song) {
+		return -1;
+	}
+	long n = 0;
+	while ( midi_song_next_event(song)) {
+		n++;
+	}
+	*read_us = song->read_us;
+	midi_song_close(song);
+	return n;
+}
+
+/**
+ * converts a midi file into a compact song file
+ */
+int compact_midifile(const char *srcpath, const char *dstpath, char *report, size_t reportlen) {
+	struct stat file_stat;
+	t_midi_song *song = NULL;
+	t_lz_enc *enc = NULL;
+	FILE *fd = NULL;
+	int rc = -1;
+
+	snprintf(report, reportlen, "compacting %s failed", srcpath);
+
+	do {
+		if ( stat(srcpath, &file_stat) == -1) {
+			ESP_LOGE(TAG, "Failed to stat file : %s", srcpath);
+			break;
+		}
+		if ( !(song = midi_song_open(srcpath))) {
+			break;
+		}
+		if ( song->compact || song->format == 2) {
+			ESP_LOGE(TAG, "%s: format not supported for compacting", srcpath);
+			snprintf(report, reportlen, "%s: format not supported", srcpath);
+			break;
+		}
+		if ( !(enc = calloc(1, sizeof(t_lz_enc)))) {
+			ESP_LOGE(TAG, "no memory for encoder");
+			break;
+		}
+		for ( int i = 0; i < LZ_HASH_SIZE; i++) {
+			enc->head[i] = -1;
+		}
+		if ( !(fd = fopen(dstpath, "w"))) {
+			ESP_LOGE(TAG, "Failed to create file : %s", dstpath);
+			break;
+		}
+		enc->fd = fd;
+
+		// header is written when all data are known
+		char header[COMPACT_HEADER_LEN];
+		memset(header, 0, sizeof(header));
+		fwrite(header, 1, sizeof(header), fd);
+
+		long last_ticks = 0;
+		long nevents = 0;
+		unsigned char running = 0;
+		t_midi_track *trck;
+		while ( (trck = midi_song_next_event(song))) {
+			t_midi_evt *evt = &(trck->evt);
+
+			if ( evt->event == 0xFF && evt->metaevent != 0x51) {
+				continue; // text, end of track etc.
+			}
+
+			long ticks = evt->evt_ticks / TICKFACTOR;
+			lz_put_vlq(enc, ticks - last_ticks);
+			last_ticks = ticks;
+			nevents++;
+
+			if ( evt->event == 0xFF) {
+				// tempo
+				lz_put(enc, 0xFF);
+				lz_put(enc, evt->metaevent);
+				lz_put_vlq(enc, evt->datalen);
+				running = 0;
+			} else if ( (evt->event & 0xF0) == 0xF0) {
+				// sysex, data as in file. Continuation events are taken
+				// from the same track, the merged track has no gaps in between
+				int open = evt->event == 0xF0;
+				for (;;) {
+					lz_put(enc, evt->event);
+					lz_put_vlq(enc, evt->sysex_len);
+					char chunk[SYSEX_CHUNK];
+					int n, last = 0;
+					while ( (n = midi_song_read_sysex(song, trck, chunk, sizeof(chunk))) > 0) {
+						for ( int i = 0; i < n; i++) {
+							lz_put(enc, chunk[i]);
+						}
+						last = (unsigned char) chunk[n-1];
+					}
+					if ( !open || last == 0xF7 || !midi_song_sysex_continues(song, trck)) {
+						break;
+					}
+					// consumed here
+					evt->status = need_event;
+					lz_put_vlq(enc, 0);
+					nevents++;
+				}
+				running = 0;
+				continue; // evt may hold the next event of the track
+			} else if ( evt->event != running) {
+				lz_put(enc, evt->event);
+				running = evt->event;
+			}
+			for ( int i = 0; i < evt->datalen; i++) {
+				lz_put(enc, evt->data[i]);
+			}
+		}
+
+		// end of track
+		lz_put(enc, 0x00);
+		lz_put(enc, 0xFF);
+		lz_put(enc, 0x2F);
+		lz_put(enc, 0x00);
+
+		long packedlen = enc->wr;
+		lz_finish(enc);
+
+		fseek(fd, 0, SEEK_SET);
+		fwrite(COMPACT_MAGIC, 1, 4, fd);
+		write_long(fd, song->tpq, 2);
+		write_long(fd, 0, 2);
+		write_long(fd, packedlen, 4);
+		write_long(fd, file_stat.st_size, 4);
+		write_long(fd, nevents, 4);
+
+		if ( enc->failed || ferror(fd)) {
+			ESP_LOGE(TAG, "File write failed : %s", dstpath);
+			break;
+		}
+		fclose(fd);
+		fd = NULL;
+
+		// read it back, get the costs of both formats
+		int64_t smf_us = 0, kmf_us = 0;
+		long smf_events = count_events(srcpath, &smf_us);
+		long kmf_events = count_events(dstpath, &kmf_us);
+		if ( kmf_events != nevents) {
+			ESP_LOGE(TAG, "%s: verify failed, %ld events expected, got %ld", dstpath, nevents, kmf_events);
+			break;
+		}
+
+		long outlen = COMPACT_HEADER_LEN + enc->outlen;
+		snprintf(report, reportlen,
+				"%s: %ld -> %ld bytes, ratio %ld.%02ld:1, %ld events, decode %lld ns/event (midi file %lld ns/event)",
+				dstpath, (long) file_stat.st_size, outlen,
+				(long) file_stat.st_size / outlen, ((long) file_stat.st_size * 100 / outlen) % 100,
+				nevents,
+				(long long) (nevents > 0 ? kmf_us * 1000 / nevents : 0),
+				(long long) (smf_events > 0 ? smf_us * 1000 / smf_events : 0));
+		ESP_LOGI(TAG, "%s", report);
+		rc = 0;
+	} while (0);
+
+	if ( fd) {
+		fclose(fd);
+	}
+	if ( rc) {
+		unlink(dstpath);
+	}
+	if ( enc) {
+		free(enc);
+	}
+	midi_song_close(song);
+
+	return rc;
+}
@@ -0,0 +1,178 @@
+/*
+ * midi_export.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * export of the decoded events of a song with their time in µs since the
+ * start, tempo changes applied. The events are read one by one and written
+ * to a buffer of the caller, 'put' gets it whenever it is full, so a song of
+ * any size is exported with the memory of the player.
+ *
+ * NDJSON, one object per line:
+ *   {"file":"x.mid","format":1,"tracks":2,"tpq":480}
+ *   {"t":0,"tr":1,"s":144,"d":[60,100]}             channel event
+ *   {"t":0,"tr":0,"s":255,"m":81,"d":[7,161,32]}    meta event
+ *   {"t":0,"tr":1,"s":240,"d":[65,16,...,247]}      sysex as in the file
+ *   {"end":12000000,"events":1234}
+ *
+ * binary, little endian:
+ *   "KEV1", u16 tpq, u16 tracks
+ *   per event u32 time, u8 track, u8 status, u16 len, data;
+ *   the data of a meta event start with its type
+ */
+
+#include <stdarg.h>
+#include "local.h"
+
+static const char *TAG = "midi_export";
+
+#define EXPORT_SYSEX_CHUNK 64 // sysex data are read in pieces of this size
+
+typedef struct {
+	char *buf;
+	size_t size;
+	size_t fill;
+	t_export_put put;
+	void *ctx;
+	int failed;
+} t_export_out;
+
+static void out_flush(t_export_out *out) {
+	if ( out->fill && !out->failed && out->put(out->buf, out->fill, out->ctx)) {
+		out->failed = true;
+	}
+	out->fill = 0;
+}
+
+static void out_bytes(t_export_out *out, const void *data, size_t len) {
+	const char *p = data;
+	while ( len > 0 && !out->failed) {
+		size_t n = MIN(len, out->size - out->fill);
+		memcpy(out->buf + out->fill, p, n);
+		out->fill += n;
+		p += n;
+		len -= n;
+		if ( out->fill == out->size) {
+			out_flush(out);
+		}
+	}
+}
+
+static void out_text(t_export_out *out, const char *fmt, ...) {
+	char txt[128];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(txt, sizeof(txt), fmt, ap);
+	va_end(ap);
+	out_bytes(out, txt, MIN(len, sizeof(txt) - 1));
+}
+
+static void out_le(t_export_out *out, uint32_t value, int len) {
+	unsigned char b[4];
+	for ( int i = 0; i < len; i++) {
+		b[i] = value >> (8 * i);
+	}
+	out_bytes(out, b, len);
+}
+
+/**
+ * the data bytes of a JSON event, with a comma before the first one if sep
+ */
+static void out_json_data(t_export_out *out, const unsigned char *data, int len, int sep) {
+	for ( int i = 0; i < len; i++) {
+		out_text(out, sep || i ? ",%d" : "%d", data[i]);
+	}
+}
+
+/**
+ * writes the decoded events of a song, binary or NDJSON, to 'put'
+ * through buf. Returns the number of events, EXPORT_NO_SONG if the song
+ * can't be read (nothing was put then), -1 if 'put' failed
+ */
+int export_song(const char *filepath, int binary, char *buf, size_t bufsize, t_export_put put, void *ctx) {
+	t_export_out out = { buf, bufsize, 0, put, ctx, false };
+	unsigned char chunk[EXPORT_SYSEX_CHUNK];
+	t_midi_track *trck;
+	int64_t us = 0;
+	int n = 0;
+
+	t_midi_song *song = midi_song_open(filepath);
+	if ( !song) {
+		return EXPORT_NO_SONG;
+	}
+	if ( binary) {
+		out_bytes(&out, "KEV1", 4);
+		out_le(&out, song->tpq, 2);
+		out_le(&out, song->ntracks, 2);
+	} else {
+		// the name without directory, no quotes or backslashes in the JSON string
+		char file[CONFIG_SPIFFS_OBJ_NAME_LEN + 1];
+		const char *name = strrchr(filepath, '/');
+		snprintf(file, sizeof(file), "%s", name ? name + 1 : filepath);
+		for ( char *c = file; *c; c++) {
+			if ( *c == '"' || *c == '\\' || (unsigned char) *c < ' ') {
+				*c = '_';
+			}
+		}
+		out_text(&out, "{\"file\":\"%s\",\"format\":%d,\"tracks\":%d,\"tpq\":%ld}\n",
+				file, song->format, song->ntracks, song->tpq);
+	}
+	while ( !out.failed && (trck = midi_song_next_timed(song, &us))) {
+		t_midi_evt *evt = &(trck->evt);
+		int meta = evt->event == 0xFF;
+		int sysex = evt->event == 0xF0 || evt->event == 0xF7;
+		long len = sysex ? evt->sysex_len : evt->datalen;
+
+		if ( binary) {
+			if ( len + meta > 0xFFFF) {
+				ESP_LOGE(TAG, "%s: event of %ld bytes at %lld us too long", filepath, len, (long long) us);
+				out.failed = true;
+				break;
+			}
+			out_le(&out, us, 4);
+			out_le(&out, trck->trackno, 1);
+			out_le(&out, evt->event, 1);
+			out_le(&out, len + meta, 2);
+			if ( meta) {
+				out_le(&out, evt->metaevent, 1);
+			}
+		} else {
+			out_text(&out, "{\"t\":%lld,\"tr\":%d,\"s\":%d", (long long) us, trck->trackno, evt->event);
+			if ( meta) {
+				out_text(&out, ",\"m\":%d", evt->metaevent);
+			}
+			out_text(&out, ",\"d\":[");
+		}
+		if ( sysex) {
+			long done = 0;
+			int rd;
+			while ( (rd = midi_song_read_sysex(song, trck, (char *) chunk, sizeof(chunk))) > 0) {
+				if ( binary) {
+					out_bytes(&out, chunk, rd);
+				} else {
+					out_json_data(&out, chunk, rd, done > 0);
+				}
+				done += rd;
+			}
+			if ( binary && done < len) {
+				// truncated file, the length is already written
+				out.failed = true;
+			}
+		} else if ( binary) {
+			out_bytes(&out, evt->data, len);
+		} else {
+			out_json_data(&out, (unsigned char *) evt->data, len, false);
+		}
+		if ( !binary) {
+			out_text(&out, "]}\n");
+		}
+		n++;
+	}
+	if ( !binary) {
+		out_text(&out, "{\"end\":%lld,\"events\":%d}\n", (long long) us, n);
+	}
+	out_flush(&out);
+	midi_song_close(song);
+	return out.failed ? -1 : n;
+}
@@ -9,10 +9,6 @@
 
 static const char *TAG = "midi_file";
 
-static esp_timer_handle_t periodic_midi_timer = NULL;
-
-static 	t_midi_song *globalSongData=NULL;
-
 static long read_long(size_t n, FILE *fd) {
     unsigned char buf[32];
 	memset(buf, 0, sizeof(buf));
@@ -29,6 +25,9 @@ static long read_long(size_t n, FILE *fd) {
 }
 
 
+/**
+ * resets the event, the data buffer is kept for the next one
+ */
 static void clearEvent(t_midi_evt *evt) {
 	evt->event = 0;
 	evt->metaevent = 0;
@@ -36,47 +35,104 @@ static void clearEvent(t_midi_evt *evt) {
 	evt->evt_ticks = 0;
 	evt->status = no_event;
 	evt->datalen = 0;
+	evt->sysex_len = 0;
+}
 
+static void freeEvent(t_midi_evt *evt) {
+	clearEvent(evt);
 	if ( evt->data) {
 		free(evt->data);
 	}
 	evt->data = NULL;
+	evt->datasize = 0;
+}
+
+/**
+ * appends a data byte to the event
+ */
+static void addEventData(t_midi_evt *evt, unsigned char c) {
+	if ( evt->datalen >= evt->datasize) {
+		size_t size = evt->datasize + 16;
+		char *data = realloc(evt->data, size);
+		if ( !data) {
+			ESP_LOGE(TAG, "no memory for event data");
+			return;
+		}
+		evt->data = data;
+		evt->datasize = size;
+	}
+	evt->data[(evt->datalen)++] = c;
 }
 /**
  * gets the next byte from stream,
  * fills the tracks buffer if necessary
  */
-static unsigned char readNxtTrackData(FILE *fd, t_midi_track *trck) {
+static unsigned char readRawTrackData(t_midi_song *song, t_midi_track *trck) {
 	if ( trck->rdpos >= trck->buflen) {
 		// need new data for buffer
 		trck->rdpos=0;
 
-		fsetpos(fd, &(trck->fpos));
-		trck->buflen=fread(trck->buf, 1, sizeof(trck->buf), fd);
+		fseek(song->fd, trck->fpos, SEEK_SET);
+		trck->buflen=fread(trck->buf, 1, trck->bufsize, song->fd);
 		if ( trck->buflen < 1) {
 			// EOF or read error
 			trck->finished = true;
 			return '\0';
 		}
-		fgetpos(fd, &(trck->fpos));
+		trck->fpos = ftell(song->fd);
 	}
     return trck->buf[(trck->rdpos)++];
 }
 
-static void readNxtEvent(t_midi_track *trck) {
+struct track_reader {
+	t_midi_song *song;
+	t_midi_track *trck;
+};
+
+static int compactSource(void *ctx) {
+	struct track_reader *rd = ctx;
+	unsigned char c = readRawTrackData(rd->song, rd->trck);
+	return rd->trck->finished ? -1 : c;
+}
+
+/**
+ * gets the next byte of the track data,
+ * compact songs are decoded on the fly
+ */
+static unsigned char readNxtTrackData(t_midi_song *song, t_midi_track *trck) {
+	if ( trck->compact) {
+		struct track_reader rd = { song, trck };
+		int c = compact_getc(trck->compact, compactSource, &rd);
+		if ( c < 0) {
+			trck->finished = true;
+			return '\0';
+		}
+		return c;
+	}
+	return readRawTrackData(song, trck);
+}
+
+static void readNxtEvent(t_midi_song *song, t_midi_track *trck) {
 	int phase = 0;
+	int sysex = false;
 
 	t_midi_evt *evt = &(trck->evt);
+	// skip sysex data not read by the consumer
+	while ( evt->sysex_len > 0 && !trck->finished) {
+		readNxtTrackData(song, trck);
+		evt->sysex_len--;
+	}
 	clearEvent(evt);
 
-	size_t szData = 16; // initial ssize of data
-	evt->data = calloc(szData, sizeof(unsigned char));
-	evt->datalen = 0;
-
 	size_t datalen = 0; // number of bytes to read
 
 	do {
-		unsigned char c = readNxtTrackData(globalSongData->fd, trck);
+		unsigned char c = readNxtTrackData(song, trck);
+		if ( trck->finished) {
+			// unexpected end of data, treat it like end of track
+			evt->status = has_end_of_track;
+			break;
+		}
 
 		switch (phase) {
 			case 0: // get delta time
@@ -93,12 +149,7 @@ static void readNxtEvent(t_midi_track *trck) {
 					// use last event
 					evt->event = trck->lastevent;
 					datalen = -1; // 1 byte less to read
-
-					if (evt->datalen >= szData) {
-						szData += 16;
-						evt->data = realloc(evt->data, szData);
-					}
-					evt->data[(evt->datalen)++] = c;
+					addEventData(evt, c);
 
 				} else {
 					// new event
@@ -126,9 +177,12 @@ static void readNxtEvent(t_midi_track *trck) {
 						// bei evt=F0 muss in den Daten das Start-F0 hinzugefügt werden,
 						// die Daten sollten das Ende-F7-Datum enthalten
 						// bei evt=F7 muss F0 und F7n in den Daten enthalten sein
+						// Die Daten bleiben in der Datei, sie werden stückweise
+						// mit midi_song_read_sysex gelesen
 
 						phase = 2; // read event len
 						datalen = 0;
+						sysex = true;
 					} else {
 						// all others need 2 data bytes
 						datalen += 2;
@@ -140,7 +194,12 @@ static void readNxtEvent(t_midi_track *trck) {
 				datalen = (datalen << 7) + (c & 0x7F);
 				if (c < 0x80) {
 					// datalen complete
-					if (datalen == 0) {
+					if (sysex) {
+						// data are read by midi_song_read_sysex
+						evt->sysex_len = datalen;
+						evt->status = has_event;
+						phase = 99;
+					} else if (datalen == 0) {
 						phase = 99; // completed
 					} else {
 						phase = 3; // read data
@@ -148,11 +207,7 @@ static void readNxtEvent(t_midi_track *trck) {
 				}
 				break;
 			case 3: // read data
-				if (evt->datalen >= szData) {
-					szData += 16;
-					evt->data = realloc(evt->data, szData);
-				}
-				evt->data[(evt->datalen)++] = c;
+				addEventData(evt, c);
 				datalen--;
 				if (datalen == 0) {
 					// completed
@@ -173,47 +228,82 @@ static void readNxtEvent(t_midi_track *trck) {
 		}
 	} while (phase < 99);
 
+	if ( evt->status == no_event) {
+		// events without data bytes left, e.g. running status program change
+		evt->status = has_event;
+	}
 	// all data for midi event complete.
 }
 
-static void initSongData() {
-	if (globalSongData == NULL) {
-		// create new data
-		globalSongData = calloc(1, sizeof(t_midi_song));
-
-	} else {
-		// reset data
-		if (globalSongData->tracks) {
-			while (globalSongData->tracks) {
-				t_midi_track *tmp = globalSongData->tracks->nxt;
-				globalSongData->tracks = globalSongData->tracks->nxt;
-				if ( tmp ) {
-					free(tmp);
-				}
-			}
+/**
+ * release tracks and file of a song, the structure itself is kept
+ */
+static void freeSongData(t_midi_song *song) {
+	for (int i = 0; i < song->ntracks; i++) {
+		t_midi_track *trck = &song->tracks[i];
+		freeEvent(&(trck->evt));
+		if ( trck->compact) {
+			free(trck->compact);
 		}
+	}
+	if (song->tracks) {
+		free(song->tracks);
+	}
+	if (song->trackbuf) {
+		free(song->trackbuf);
+	}
 
-		if (globalSongData->filepath) {
-			free(globalSongData->filepath);
-		}
+	if (song->filepath) {
+		free(song->filepath);
+	}
 
-		if (globalSongData->fd) {
-			fclose(globalSongData->fd);
-		}
+	if (song->fd) {
+		fclose(song->fd);
+	}
+
+	memset(song, 0, sizeof(t_midi_song));
+}
 
-		memset(globalSongData, 0, sizeof(t_midi_song));
+/**
+ * converts song ticks into microseconds since the start of the song,
+ * based on the last tempo change
+ */
+static int64_t songTicksToUs(t_midi_song *song, long ticks) {
+	return song->tempo_us
+			+ (int64_t) (ticks - song->tempo_ticks) * song->microsecsperquarter / (song->tpq * TICKFACTOR);
+}
 
-	}
+/**
+ * hal_time_us time of a tick, at the playback rate
+ */
+static int64_t songTicksToTime(t_midi_song *song, long ticks) {
+	return song->starttime + (songTicksToUs(song, ticks) << RATE_SHIFT) / song->rate;
+}
 
-	globalSongData->is_on=-1;
-	blue_off();
+/**
+ * changes the playback rate at 'now', the position in the song stays.
+ * Before the start the waiting time is scaled as well
+ */
+void player_set_rate(t_midi_song *song, long rate, int64_t now) {
+	int64_t pos = (now - song->starttime) * song->rate >> RATE_SHIFT;
+	song->starttime = now - (pos << RATE_SHIFT) / rate;
+	song->rate = rate;
+}
 
+/**
+ * reads the next event and accounts the decoding costs
+ */
+static void readSongEvent(t_midi_song *song, t_midi_track *trck) {
+	int64_t t = hal_stopwatch_us();
+	readNxtEvent(song, trck);
+	song->read_us += hal_stopwatch_us() - t;
+	song->nevents++;
 }
 
 /**
- * timing has changed
+ * a new tempo is valid from the given position on
  */
-static void calcTimermillies() {
+static void setTempo(t_midi_song *song, long ticks, long microsecsperquarter) {
 	/*
 	ticks_per_quarter (tpq) = <PPQ from the header>
 	µs_per_quarter = <Tempo in latest Set Tempo event>
@@ -221,43 +311,72 @@ static void calcTimermillies() {
 	seconds_per_tick = µs_per_tick / 1.000.000
 	seconds = ticks * seconds_per_tick
 	*/
+	song->tempo_us = songTicksToUs(song, ticks);
+	song->tempo_ticks = ticks;
+	song->microsecsperquarter = microsecsperquarter;
+}
 
-	globalSongData->timermillies = 0; // const value
-
-	/*
-	ESP_LOGI(TAG, "calcTimermillies: microsecPerQuarter=%ld, tempo=%ld BPM, microseconds_per_tick=%ld",
-			globalSongData->microsecsperquarter,
-			60000000/globalSongData->microsecsperquarter,
-			globalSongData->microseconds_per_tick);
-	*/
-
-	do {
-		globalSongData->timermillies += DELTATIMERMILLIES;
-		long quantization = globalSongData->microsecsperquarter/1000/globalSongData->timermillies;
-		if ( quantization <= 0)
-			quantization=1;
-
-		globalSongData->timer_ticks = TICKFACTOR * globalSongData->tpq / quantization;
-		globalSongData->microseconds_per_tick = globalSongData->microsecsperquarter / globalSongData->tpq;
-
-		if ( globalSongData->timer_ticks < 1 ) {
-			globalSongData->timer_ticks = 1;
+/**
+ * appends a track to the songs track array, 'room' is the number of
+ * tracks it has space for. Returns the track or NULL if out of memory
+ */
+static t_midi_track *addTrack(t_midi_song *song, int *room, long fpos, long trackLen) {
+	if ( song->ntracks >= *room) {
+		int n = MAX(4, 2 * *room);
+		t_midi_track *tracks = realloc(song->tracks, n * sizeof(t_midi_track));
+		if ( !tracks) {
+			ESP_LOGE(TAG, "no memory for %d tracks", n);
+			return NULL;
 		}
+		song->tracks = tracks;
+		*room = n;
+	}
+	t_midi_track *trck = &song->tracks[song->ntracks];
+	memset(trck, 0, sizeof(t_midi_track));
+	trck->len = trackLen;
+	trck->trackno = song->ntracks++;
+	trck->rdpos = 0;
+	trck->buflen = 0;
+	trck->finished = false;
+	trck->lastevent = 0;
+	trck->fpos = fpos;
+	trck->track_ticks = 0;
+	trck->evt.status = need_event;
+	return trck;
+}
 
-		/*
-		ESP_LOGI(TAG, "calcTimermillies: quantization=%ld -> millies=%ld, tickspercycle = %ld",
-				quantization,
-				globalSongData->timermillies,
-				globalSongData->timer_ticks
-				);
-		*/
-	} while ( globalSongData->timer_ticks < 100);
+/**
+ * allocates next_ticks and the read buffers of all tracks in one block,
+ * a buffer holds the whole track data up to TRACK_BUF_SIZE
+ */
+static int allocTrackBuffers(t_midi_song *song) {
+	size_t size = song->ntracks * sizeof(long);
+	for (int i = 0; i < song->ntracks; i++) {
+		t_midi_track *trck = &song->tracks[i];
+		trck->bufsize = MAX(1, MIN(trck->len, TRACK_BUF_SIZE));
+		size += trck->bufsize;
+	}
+	if ( !(song->trackbuf = malloc(size))) {
+		ESP_LOGE(TAG, "no memory for track buffers (%d bytes)", size);
+		return -1;
+	}
+	song->next_ticks = (long *) song->trackbuf;
+	char *buf = song->trackbuf + song->ntracks * sizeof(long);
+	for (int i = 0; i < song->ntracks; i++) {
+		t_midi_track *trck = &song->tracks[i];
+		trck->buf = buf;
+		buf += trck->bufsize;
+		song->next_ticks[i] = TRACK_NEED_EVENT;
+	}
+	song->peeked = -1;
+	song->trackmem = size + song->ntracks * sizeof(t_midi_track);
+	return 0;
 }
 
 /**
- * open a midi file and initialize song structure
+ * open a midi file (SMF or compact song) and initialize song structure
  */
-int open_midifile(const char *filepath) {
+static int open_song(t_midi_song *song, const char *filepath) {
 
 	struct stat file_stat;
 
@@ -265,7 +384,7 @@ int open_midifile(const char *filepath) {
 	int rc = -1;
 
 
-	globalSongData->filepath = strdup(filepath);
+	song->filepath = strdup(filepath);
 
 	// try to open file
 	if (stat(filepath, &file_stat) == -1) {
@@ -273,405 +392,485 @@ int open_midifile(const char *filepath) {
 		return -1;
 	}
 
-	fpos_t fsz = file_stat.st_size;
+	long fsz = file_stat.st_size;
 
-	globalSongData->fd = fopen(filepath, "r");
-	if (!globalSongData->fd) {
+	song->fd = fopen(filepath, "r");
+	if (!song->fd) {
 		ESP_LOGE(TAG, "Failed to open existing file : %s", filepath);
 		return -1;
 	}
-	ESP_LOGI(TAG, "File opened: %s, size=%ld", filepath, fsz);
+	TRACE(trc_song_open_begin, 0, fsz);
 
-	t_midi_track *last_track = NULL;
+	int room = 0; // tracks allocated
 
 	do {
 		memset(buf, 0, sizeof(buf));
-		fread(buf, 1, 4, globalSongData->fd);
+		fread(buf, 1, 4, song->fd);
+
+		song->microsecsperquarter = 500000; // Tempo 120 = 500ms je 1/4 = 500 000 µs
+		song->tempo_ticks = 0;
+		song->tempo_us = 0;
+		song->song_ticks = 0;
+		song->rate = RATE_ONE;
+
+		if (strncmp(buf, COMPACT_MAGIC, 4) == 0) {
+			// compact song: one merged track, LZ compressed
+			song->compact = true;
+			song->format = 0;
+			song->tpq = read_long(2, song->fd);
+			read_long(2, song->fd); // reserved
+			long packedLen = read_long(4, song->fd);
+			long origLen = read_long(4, song->fd);
+			long nevents = read_long(4, song->fd);
+			if (song->tpq <= 0 || packedLen <= 0) {
+				ESP_LOGE(TAG, "invalid compact song header");
+				break;
+			}
+
+			ESP_LOGI(TAG, "Compact song, tpq=%ld, events=%ld, packed=%ld, original=%ld",
+					song->tpq, nevents, packedLen, origLen);
+
+			t_midi_track *trck = addTrack(song, &room, COMPACT_HEADER_LEN, fsz - COMPACT_HEADER_LEN);
+			if ( !trck || !(trck->compact = calloc(1, sizeof(t_compact_dec)))) {
+				ESP_LOGE(TAG, "no memory for compact song");
+				break;
+			}
+			compact_init(trck->compact, packedLen);
+			rc = allocTrackBuffers(song);
+			break;
+		}
+
 		// must start with "MThd"
 		if (strncmp(buf, "MThd", 4)) {
 			ESP_LOGE(TAG, "not a MIDI file");
 			break;
 		}
 		// 4 byte headerlen
-		long headerLen = read_long(4, globalSongData->fd);
+		long headerLen = read_long(4, song->fd);
 		if (headerLen != 6) {
 			ESP_LOGE(TAG, "header len is not 6");
 			break;
 		}
 		// 2 byte format
-		globalSongData->format = read_long(2, globalSongData->fd);
-		// 2 byte #tracks
-		globalSongData->ntracks = read_long(2, globalSongData->fd);
+		song->format = read_long(2, song->fd);
+		// 2 byte #tracks, the chunks found are counted
+		room = read_long(2, song->fd);
 		// 2 byte division resp. ticks per quarter
-		globalSongData->tpq = read_long(2, globalSongData->fd);
-
-		globalSongData->microsecsperquarter = 500000; // Tempo 120 = 500ms je 1/4 = 500 000 µs
-		globalSongData->timermillies = 0;
-
-		calcTimermillies();
-
-		globalSongData->song_ticks = 0;
-
-		ESP_LOGI(TAG, "Midi-Format=%d, tracks=%d, tpq=%ld, timerticks=%ld, timermillies=%ld",
-				globalSongData->format, globalSongData->ntracks,
-				globalSongData->tpq, globalSongData->timer_ticks,
-				globalSongData->timermillies);
+		song->tpq = read_long(2, song->fd);
+		if (song->tpq <= 0 || song->tpq & 0x8000) {
+			ESP_LOGE(TAG, "SMPTE time division is not supported");
+			break;
+		}
 
+		ESP_LOGI(TAG, "Midi-Format=%d, tracks=%d, tpq=%ld",
+				song->format, room, song->tpq);
+		if (room > 0 && !(song->tracks = malloc(room * sizeof(t_midi_track)))) {
+			ESP_LOGE(TAG, "no memory for %d tracks", room);
+			break;
+		}
 
 		// Tracks
-		int trackno = 0;
-		fpos_t fpos = 14; // beginning of first track
+		long fpos = 14; // beginning of first track
 		int failed = false;
 		while (fpos < fsz) {
-			if (fsetpos(globalSongData->fd, &fpos)) {
-				ESP_LOGE(TAG, "fsetpos failed at %ld", fpos);
+			if (fseek(song->fd, fpos, SEEK_SET)) {
+				ESP_LOGE(TAG, "fseek failed at %ld", fpos);
 				failed = true;
 				break;
 			}
 
 			// Read chunk type 4 byte
 			memset(buf, 0, sizeof(buf));
-			fread(buf, 1, 4, globalSongData->fd);
+			fread(buf, 1, 4, song->fd);
 			// 4 byte headerlen
-			long trackLen = read_long(4, globalSongData->fd);
+			long trackLen = read_long(4, song->fd);
 
 			// actual file position - track data starts here
-			fgetpos(globalSongData->fd, &fpos);
+			fpos = ftell(song->fd);
 
 			// must start with "MTrk"
 			if (strncmp(buf, "MTrk", 4)) {
 				ESP_LOGI(TAG, "fpos %ld: not a MidiTrackChunk '%s', len=%ld", fpos, buf, trackLen);
 			} else {
 				// it's a track chunk
-				ESP_LOGI(TAG, "fpos %ld: MidiTrackChunk(%d) len='%ld'", fpos, trackno, trackLen);
-
-				t_midi_track *trck = calloc(1, sizeof(t_midi_track));
-				trck->len = trackLen;
-				trck->trackno = trackno++;
-				trck->rdpos = 0;
-				trck->buflen = 0;
-				trck->finished = false;
-				trck->lastevent = 0;
-				trck->fpos = fpos;
-				trck->track_ticks = 0;
-				trck->evt.status = need_event;
-
-				// add to song
-				if (last_track) {
-					last_track->nxt = trck;
-					last_track = last_track->nxt;
-				} else {
-					globalSongData->tracks = trck;
-					last_track = trck;
+				TRACE(trc_track_chunk, song->ntracks, trackLen);
+				if (!addTrack(song, &room, fpos, trackLen)) {
+					failed = true;
+					break;
 				}
 			}
 			fpos += trackLen;
 		};
-		if (failed) {
+		if (failed || allocTrackBuffers(song)) {
 			break;
 		}
+		ESP_LOGI(TAG, "%d tracks, %d bytes track memory", song->ntracks, song->trackmem);
 		rc = 0;
 	} while (0);
 
-	ESP_LOGI(TAG, "File open complete");
+	TRACE(trc_song_open_end, 0, song->ntracks);
 
 	return rc;
 }
 
-static void printEvent(int trackno, t_midi_evt *evt, const char *msg) {
-	char txt[1024];
-	memset(txt, 0, sizeof(txt));
-	if (evt->datalen > 0) {
-		for (int i = 0; i < evt->datalen; i++) {
-			snprintf(&txt[strlen(txt)], sizeof(txt) - strlen(txt), "%02X ", evt->data[i]);
-		}
-		snprintf(&txt[strlen(txt)], sizeof(txt) - strlen(txt), "%s"," '");
-		for (int i = 0; i < evt->datalen; i++) {
-			snprintf(&txt[strlen(txt)], sizeof(txt) - strlen(txt), "%c",
-					isprint((uchar)evt->data[i]) ? evt->data[i] :'.');
-		}
-		snprintf(&txt[strlen(txt)], sizeof(txt) - strlen(txt), "%s","'");
+/**
+ * open a song for sequential reading, independent from the player
+ */
+t_midi_song *midi_song_open(const char *filepath) {
+	t_midi_song *song = calloc(1, sizeof(t_midi_song));
+	if ( !song) {
+		ESP_LOGE(TAG, "midi_song_open: no memory");
+		return NULL;
+	}
+	if ( open_song(song, filepath)) {
+		midi_song_close(song);
+		return NULL;
 	}
-	ESP_LOGI(TAG, "track %d, T=%7ld, DT=%5ld, E=%x, M=%x, L=%d %s %s %s",
-			trackno,
-			evt->evt_ticks,
-			evt->delta_ticks,
-			evt->event, evt->metaevent, evt->datalen,
-			evt->status != has_event ? EVENT_STATE2TXT(evt->status):"",
-			msg,
-			txt);
+	return song;
+}
 
+void midi_song_close(t_midi_song *song) {
+	if ( song) {
+		freeSongData(song);
+		free(song);
+	}
 }
 
 /**
- * single cycle of playing/printing midi events
+ * reads the next event of a track if its event was consumed,
+ * returns the ticks of the pending event
  */
-int parse_midifile() {
-	if (!globalSongData || !globalSongData->tracks || !globalSongData->fd) {
-		ESP_LOGE(TAG, "parse_midifile: nodata / notracks or no open file");
-		return -1;
-	}
-
-	if ( globalSongData->song_ticks < 0 ) {
-		// we have waited now start with the song
-		esp_timer_stop(periodic_midi_timer);
-		ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_midi_timer, globalSongData->timermillies*1000));
+static long fillTrack(t_midi_song *song, t_midi_track *trck) {
+	if ( trck->finished)
+		return TRACK_FINISHED;
 
-		globalSongData->song_ticks = 0;
-		return 1;
-
-	} if (globalSongData->song_ticks == 0 ) {
-		// playing the song will start
-		ESP_LOGI(TAG, "---- Start %s -----", globalSongData->filepath);
+	t_midi_evt *evt = &(trck->evt);
+	if ( evt->status == need_event || evt->status == no_event) {
+		readSongEvent(song, trck);
+	}
+	if ( evt->status != has_event) {
+		// end of track or garbage
+		if ( evt->status != has_end_of_track) {
+			ESP_LOGE(TAG, "track %d: should have an event at fpos %ld, T=%ld E=%x %s", trck->trackno, trck->fpos,
+					evt->evt_ticks, evt->event, EVENT_STATE2TXT(evt->status));
+		}
+		TRACE(trc_track_end, trck->trackno, trck->evt.evt_ticks);
+		trck->finished = true;
+		freeEvent(evt);
+		return TRACK_FINISHED;
 	}
+	return evt->evt_ticks;
+}
 
+/**
+ * the track with the next event of the song, the event is not consumed.
+ * Only the track of the last peek can have been changed since (event consumed,
+ * sysex continued), the others are compared by next_ticks.
+ * returns NULL at the end of the song
+ */
+static t_midi_track *peekSongEvent(t_midi_song *song) {
+	long *next_ticks = song->next_ticks;
+	long ticks = TRACK_FINISHED;
+	int next = -1;
 
-	if ( globalSongData->is_on < 0 ) {
-		globalSongData->is_on = 0;
-		globalSongData->blink_cnt = 0;
+	if ( song->peeked >= 0) {
+		next_ticks[song->peeked] = fillTrack(song, &song->tracks[song->peeked]);
 	}
-	if ( --globalSongData->blink_cnt <= 0) {
-		globalSongData->blink_cnt = 50;
-		globalSongData->is_on = globalSongData->is_on ? 0 : 1;
-		if ( globalSongData->is_on ) {
-			blue_on();
-		} else {
-			blue_off();
+	for (int i = 0; i < song->ntracks; i++) {
+		if ( next_ticks[i] == TRACK_NEED_EVENT) {
+			next_ticks[i] = fillTrack(song, &song->tracks[i]);
+		}
+		if ( next_ticks[i] < ticks) {
+			ticks = next_ticks[i];
+			next = i;
 		}
 	}
+	song->peeked = next;
+	return next < 0 ? NULL : &song->tracks[next];
+}
 
-	char *data=NULL;
-	char *ptr=NULL;
-	size_t datalen = 0;
-	size_t sz_data=512;
-
-#ifdef WITH_PRINING_MIDIFILES
-	if ( globalSongData->printonly)
-		ESP_LOGI(TAG, "---- %6ld -----",globalSongData->song_ticks);
-#endif
-
-	long min_deltatime=LONG_MAX;
-	int activeTracks=0;
-	for (t_midi_track *midi_track = globalSongData->tracks; midi_track; midi_track = midi_track->nxt) {
-		if (midi_track->finished )
-			continue;
-
-		t_midi_evt *evt = &(midi_track->evt);
-
-		while( !midi_track->finished) {
-			if ( evt->status == need_event) {
-				// needs an event
-				readNxtEvent(midi_track);
-			}
-
-			if ( evt->status == has_end_of_track) {
-				midi_track->finished = true;
-				clearEvent(evt);
-				ESP_LOGI(TAG,
-						"%6ld: end of track %d",
-						globalSongData->song_ticks,
-						midi_track->trackno);
-				break; // with next track
-			}
+/**
+ * delivers the events of all tracks sorted by time,
+ * the event of the returned track is valid until the next call.
+ * returns NULL at the end of the song
+ */
+t_midi_track *midi_song_next_event(t_midi_song *song) {
+	t_midi_track *next = peekSongEvent(song);
+	if ( next) {
+		// consumed with the next call
+		next->evt.status = need_event;
+	}
+	return next;
+}
 
-			if (evt->status != has_event ) {
-				printEvent( midi_track->trackno, evt, "ups");
-				ESP_LOGE(TAG, "track %d: should have an event at fpos %ld", midi_track->trackno, midi_track->fpos);
-				midi_track->finished = true;
-				break;  // ups
-			}
+/**
+ * the most notes sounding at the same time in a song,
+ * -1 if it can't be read
+ */
+int midi_song_polyphony(const char *filepath) {
+	uint32_t on[16][128 / 32];
+	int n = 0, peak = 0;
+	t_midi_track *trck;
 
-			if (evt->evt_ticks > globalSongData->song_ticks ) {
-				// have to wait
-				long dt = evt->evt_ticks - globalSongData->song_ticks;
-				if (dt < min_deltatime) {
-					min_deltatime = dt;
+	t_midi_song *song = midi_song_open(filepath);
+	if ( !song) {
+		return -1;
+	}
+	memset(on, 0, sizeof(on));
+	while ( (trck = midi_song_next_event(song))) {
+		t_midi_evt *evt = &(trck->evt);
+		int status = evt->event & 0xF0;
+		int ch = evt->event & 0x0F;
+		if ( (status == 0x80 || status == 0x90) && evt->datalen == 2) {
+			int note = evt->data[0] & 0x7F;
+			uint32_t bit = 1U << (note % 32);
+			if ( status == 0x90 && evt->data[1] > 0) {
+				if ( !(on[ch][note / 32] & bit)) {
+					on[ch][note / 32] |= bit;
+					n++;
+					peak = MAX(peak, n);
 				}
-				break; // while
+			} else if ( on[ch][note / 32] & bit) {
+				on[ch][note / 32] &= ~bit;
+				n--;
 			}
-
-			// process event
-			if ( evt->event == 0xFF && evt->metaevent == 0x51) {
-				// *** new tempo
-				// printEvent( midi_track->trackno, evt, "new tempo");
-				long tempo =0;
-				for ( int i=0; i< evt->datalen; i++){
-					tempo = tempo << 8 | evt->data[i];
-				}
-				if ( tempo == 0 ){
-					ESP_LOGE(TAG, "track %d: could not calculate tempo at fpos %ld", midi_track->trackno, midi_track->fpos);
-				} else {
-					//ESP_LOGI(TAG,
-					//		"%6ld: track %d: new tempo %ld",
-					//		//globalSongData->song_ticks * globalSongData->microseconds_per_tick / 1000,
-					//		globalSongData->song_ticks,
-					//		midi_track->trackno, tempo);
-					globalSongData->microsecsperquarter = tempo;
-					calcTimermillies();
-#ifdef WITH_PRINING_MIDIFILES
-					if ( ! globalSongData->printonly ) {
-#endif
-						// restart timer
-						esp_timer_stop(periodic_midi_timer);
-						ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_midi_timer, globalSongData->timermillies*1000));
-#ifdef WITH_PRINING_MIDIFILES
-					}
-#endif
-				}
-			} else if ( (evt->event & 0xF0) != 0xF0 ) {
-				// *** event to play
-#ifdef WITH_PRINING_MIDIFILES
-				if ( globalSongData->printonly) {
-					printEvent( midi_track->trackno, evt, "play");
-				} else {
-#endif
-					//play
-					midi_out_evt(evt->event, evt->data, evt->datalen);
-					if ( ! ptr  ) {
-						ptr = data = calloc(sz_data, sizeof(char));
-					}
-					int new_datalen = datalen + evt->datalen +1;
-					if ( new_datalen < sz_data) {
-						*ptr=evt->event;
-						ptr++;
-						memcpy(ptr,evt->data, evt->datalen);
-						ptr += evt->datalen;
-						datalen= new_datalen;
-					} else {
-						ESP_LOGE(TAG, "track %d: too many data needed %d, max %d", midi_track->trackno, new_datalen, sz_data);
-					}
-#ifdef WITH_PRINING_MIDIFILES
- 				}
-#endif
-			} else {
-#ifdef WITH_PRINING_MIDIFILES
-				if ( globalSongData->printonly) {
-					printEvent( midi_track->trackno, evt, "ignored");
-				}
-#endif
+		} else if ( status == 0xB0 && evt->datalen == 2 && (evt->data[0] == 0x78 || evt->data[0] == 0x7B)) {
+			for ( int i = 0; i < 128 / 32; i++) {
+				n -= __builtin_popcount(on[ch][i]);
+				on[ch][i] = 0;
 			}
-
-			readNxtEvent(midi_track);
-
-		} // while, one track completed
-
-		if ( ! midi_track->finished) {
-			activeTracks++;
 		}
-	} // all tracks processed
+	}
+	midi_song_close(song);
+	return peak;
+}
 
-	// something to play?
-	if ( datalen > 0) {
-		midi_out(data,datalen);
-		free(data);
+/**
+ * reads up to len bytes of the sysex data of the tracks event,
+ * returns the number of bytes read
+ */
+int midi_song_read_sysex(t_midi_song *song, t_midi_track *trck, char *buf, int len) {
+	t_midi_evt *evt = &(trck->evt);
+	int n = 0;
+	while ( n < len && evt->sysex_len > 0) {
+		unsigned char c = readNxtTrackData(song, trck);
+		if ( trck->finished) {
+			ESP_LOGE(TAG, "track %d: sysex data truncated", trck->trackno);
+			evt->sysex_len = 0;
+			break;
+		}
+		buf[n++] = c;
+		evt->sysex_len--;
 	}
+	return n;
+}
 
-	if ( activeTracks > 0) {
-#ifdef WITH_PRINING_MIDIFILES
-		if ( globalSongData->printonly) {
-			if ( min_deltatime < 0) {
-				min_deltatime = 1;
-			}
-			globalSongData->song_ticks += min_deltatime;
-		} else {
-#endif
-			if ( globalSongData->timer_ticks == 0) {
-				ESP_LOGE(TAG, "NO TIMERTICKS");
-				return 0;
+/**
+ * reads the next event of a track after a sysex without F7,
+ * returns true if it continues the sysex (F7 event)
+ */
+int midi_song_sysex_continues(t_midi_song *song, t_midi_track *trck) {
+	t_midi_evt *evt = &(trck->evt);
+	evt->status = need_event;
+	readSongEvent(song, trck);
+	return evt->status == has_event && evt->event == 0xF7;
+}
 
+/**
+ * sends the next piece of the sysex in progress.
+ * When the data of the file event are complete and the sysex is not
+ * terminated, the next event of the track is read: if it is no
+ * continuation (F7 event), the missing F7 is added. Otherwise the
+ * sysex stays in progress until the continuation is due.
+ */
+static void streamSysex(t_midi_song *song, int64_t now, t_player_out out, void *ctx) {
+	t_midi_track *trck = song->sysex_trck;
+	t_midi_evt *evt = &(trck->evt);
+	char *buf = song->sysex_buf;
+	int n = song->sysex_fill;
+	int len = midi_song_read_sysex(song, trck, &buf[n], SYSEX_CHUNK);
+	n += len;
+	int64_t due = 0; // of a continuation
+
+	if ( evt->sysex_len == 0) {
+		// all data of the event sent
+		int last = len > 0 ? (unsigned char) buf[n-1] : 0;
+		if ( trck->sysex_open && last == 0xF7) {
+			trck->sysex_open = false;
+		}
+		evt->status = need_event;
+		if ( trck->sysex_open) {
+			if ( !midi_song_sysex_continues(song, trck)) {
+				buf[n++] = 0xF7;
+				trck->sysex_open = false;
 			}
-			globalSongData->song_ticks += globalSongData->timer_ticks;
-#ifdef WITH_PRINING_MIDIFILES
 		}
-#endif
-	} else {
-		ESP_LOGI(TAG,
-				"%6ld: end of song %s",
-				globalSongData->song_ticks, globalSongData->filepath);
-
+		if ( trck->sysex_open) {
+			due = songTicksToTime(song, evt->evt_ticks);
+			song->song_ticks = evt->evt_ticks;
+		} else {
+			song->sysex_trck = NULL;
+		}
 	}
 
-	return activeTracks;
+	if ( n > 0) {
+		t_midi_evt piece;
+		memset(&piece, 0, sizeof(piece));
+		piece.evt_ticks = song->song_ticks;
+		piece.event = 0xF0;
+		piece.status = has_event;
+		piece.data = buf;
+		piece.datalen = n;
+		out(song, &piece, ctx);
+	}
+	song->sysex_fill = 0;
+	// the next piece when this one is on the wire
+	song->sysex_due = MAX(due, now + n * MIDI_BYTE_US);
 }
 
-static void periodic_midi_timer_callback(void* arg) {
-
-	int n =parse_midifile(false);
-
-	if (n <= 0) {
-		// Schluss, Timer stoppen
-		esp_timer_stop(periodic_midi_timer);
-		int64_t time = esp_timer_get_time();
-		ESP_LOGI(TAG, "Periodic midi timer stopped, duration %lld ms", (time - globalSongData->starttime)/1000 );
-		initSongData();
+/**
+ * time of the next event of the song as hal_time_us time,
+ * returns -1 at the end of the song
+ */
+int player_next_due(t_midi_song *song, int64_t *due) {
+	if ( song->sysex_trck) {
+		*due = song->sysex_due;
+		return 0;
 	}
+	t_midi_track *trck = peekSongEvent(song);
+	if ( !trck) {
+		return -1;
+	}
+	*due = songTicksToTime(song, trck->evt.evt_ticks);
+	return 0;
 }
 
-int handle_play_midifile(const char *filename , int with_delay) {
-	int rc = -1;
-	do {
-		if (periodic_midi_timer) {
-			esp_timer_stop(periodic_midi_timer);
-		}
-
-		// initialize song-data
-		initSongData();
-
-#ifdef WITH_PRINING_MIDIFILES
-		globalSongData->printonly = false;
-#endif
-
-		if (open_midifile(filename)) break;
+static void tempoEvent(t_midi_song *song, t_midi_track *trck) {
+	t_midi_evt *evt = &(trck->evt);
+	long tempo =0;
+	for ( int i=0; i< evt->datalen; i++){
+		tempo = tempo << 8 | (unsigned char) evt->data[i];
+	}
+	if ( tempo == 0 ){
+		ESP_LOGE(TAG, "track %d: could not calculate tempo at fpos %ld", trck->trackno, trck->fpos);
+	} else {
+		setTempo(song, evt->evt_ticks, tempo);
+	}
+}
 
-		midi_reset();
+/**
+ * skips the events before 'start_us' (time since the start of the song),
+ * program and controller changes are collected in 'chase'.
+ * returns the number of skipped events
+ */
+long player_seek(t_midi_song *song, int64_t start_us, t_chase *chase) {
+	long n = 0;
+	t_midi_track *trck;
 
-		if (periodic_midi_timer == NULL) {
-			// timer muss erzeugt werden
-			const esp_timer_create_args_t periodic_timer_args = {
-					.callback =	&periodic_midi_timer_callback,
-					// name is optional, but may help identify the timer when debugging
-					.name = "periodic_midi"
-			};
+	while ( (trck = peekSongEvent(song))) {
+		t_midi_evt *evt = &(trck->evt);
 
-			ESP_ERROR_CHECK(esp_timer_create(&periodic_timer_args, &periodic_midi_timer));
-		} else {
-			// Timer stoppen, wenn er läuft
-			esp_timer_stop(periodic_midi_timer);
+		if ( songTicksToUs(song, evt->evt_ticks) >= start_us) {
+			break;
 		}
-		globalSongData->starttime = esp_timer_get_time();
+		song->song_ticks = evt->evt_ticks;
 
-		uint64_t period = globalSongData->timermillies;
-		if ( with_delay) {
-			period = DELAY_MILLIES;
-			globalSongData->song_ticks = -1;
+		if ( evt->event == 0xFF && evt->metaevent == 0x51) {
+			tempoEvent(song, trck);
+		} else if ( (evt->event & 0xF0) != 0xF0 ) {
+			chase_event(chase, evt);
 		}
+		// sysex data are skipped with the next read
 
- 		ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_midi_timer, period*1000));
-		ESP_LOGI(TAG, "playing midifile started %s", (with_delay ? "with_delay" :""));
-
-		rc = 0;
-	} while(0);
+		evt->status = need_event;
+		n++;
+	}
+	return n;
+}
 
-	return rc;
+/**
+ * delivers the events of all tracks sorted by time like midi_song_next_event,
+ * with their time in µs since the start of the song. Tempo changes are
+ * applied, the playback rate is not.
+ * returns NULL at the end of the song
+ */
+t_midi_track *midi_song_next_timed(t_midi_song *song, int64_t *us) {
+	t_midi_track *trck = midi_song_next_event(song);
+	if ( trck) {
+		t_midi_evt *evt = &(trck->evt);
+		*us = songTicksToUs(song, evt->evt_ticks);
+		song->song_ticks = evt->evt_ticks;
+		if ( evt->event == 0xFF && evt->metaevent == 0x51) {
+			tempoEvent(song, trck);
+		}
+	}
+	return trck;
 }
 
-#ifdef WITH_PRINING_MIDIFILES
-#endif
+/**
+ * plays all events of the song which are due at 'now',
+ * out() gets every event to be sent.
+ * returns the number of processed events
+ */
+int player_process(t_midi_song *song, int64_t now, t_player_out out, void *ctx) {
+	int n = 0;
+	t_midi_track *trck;
+
+	for (;;) {
+		if ( song->sysex_trck) {
+			// the wire belongs to the sysex
+			if ( song->sysex_due > now) {
+				break;
+			}
+			streamSysex(song, now, out, ctx);
+			continue;
+		}
+		if ( !(trck = peekSongEvent(song))) {
+			break;
+		}
+		t_midi_evt *evt = &(trck->evt);
 
-int handle_stop_midifile() {
-	if (periodic_midi_timer) {
-		esp_timer_stop(periodic_midi_timer);
-	}
+		int64_t due = songTicksToTime(song, evt->evt_ticks);
+		if ( due > now) {
+			break; // have to wait
+		}
+		song->song_ticks = evt->evt_ticks;
+
+		if ( evt->event == 0xF0 || evt->event == 0xF7) {
+			// *** sysex, sent in pieces by streamSysex
+			song->sysex_trck = trck;
+			song->sysex_due = due;
+			song->sysex_fill = 0;
+			if ( evt->event == 0xF0) {
+				// F0 is not part of the data in the file
+				song->sysex_buf[song->sysex_fill++] = 0xF0;
+				trck->sysex_open = true;
+			}
+			n++;
+			continue;
+		}
 
-	// initialize song-data
-	initSongData();
+		if ( evt->event == 0xFF && evt->metaevent == 0x51) {
+			// *** new tempo
+			tempoEvent(song, trck);
+		} else if ( (evt->event & 0xF0) != 0xF0 ) {
+			// *** event to play
+			out(song, evt, ctx);
+		}
 
-	midi_reset();
-	return 0;
+		// consumed
+		evt->status = need_event;
+		n++;
+	}
 
+	return n;
 }
 
-int handle_play_random_midifile(const char *dirpath, int with_delay) {
+/**
+ * the number of songs in the directory, only songs whose name starts
+ * with 'prefix' if not empty. -1 if the directory can't be read
+ */
+int count_midifiles(const char *dirpath, const char *prefix) {
 
 	char entrypath[256+1];
 
@@ -681,7 +880,7 @@ int handle_play_random_midifile(const char *dirpath, int with_delay) {
     int max =0;
     DIR *dir = opendir(dirpath);
     if (!dir) {
-        ESP_LOGE(TAG, "handle_play_random_midifile; Failed to stat dir : %s", dirpath);
+        ESP_LOGE(TAG, "count_midifiles; Failed to stat dir : %s", dirpath);
         return -1;
     }
 
@@ -690,50 +889,82 @@ int handle_play_random_midifile(const char *dirpath, int with_delay) {
     		continue;
         snprintf(entrypath, sizeof(entrypath),"%s/%s", dirpath, entry->d_name);
         if (stat(entrypath, &entry_stat) == -1) {
-            ESP_LOGE(TAG, "handle_play_random_midifile: %s: Failed to stat %s", entrypath, entry->d_name);
+            ESP_LOGE(TAG, "count_midifiles: %s: Failed to stat %s", entrypath, entry->d_name);
             continue;
         }
-        if (! IS_FILE_EXT(entrypath, ".mid")) {
-    		ESP_LOGI(TAG, "handle_play_random_midifile: %s is not a midifile", entrypath);
+        if (! IS_SONG_FILE(entrypath)) {
+    		TRACE(trc_random_entry, max, false);
     		continue;
         }
-		ESP_LOGI(TAG, "handle_play_random_midifile[%d]: %s is a midifile", ++max, entrypath);
+        if (prefix && strncmp(entry->d_name, prefix, strlen(prefix))) {
+    		continue;
+        }
+		TRACE(trc_random_entry, ++max, true);
 
     }
     closedir(dir);
+    return max;
+}
+
+/**
+ * picks a random song of the directory, only songs whose name starts
+ * with 'prefix' if not empty. Returns 0 if found
+ */
+int pick_random_midifile(const char *dirpath, const char *prefix, char *entrypath, size_t len) {
+
+    struct dirent *entry;
+    struct stat entry_stat;
+
+    int max = count_midifiles(dirpath, prefix);
+    if (max < 1) {
+        ESP_LOGE(TAG, "pick_random_midifile: no midifiles in %s", dirpath);
+        return -1;
+    }
 
-    int r = 1 + esp_random() % (max - 1); // is not really an random value
+    int r = 1 + esp_random() % max;
 
-    ESP_LOGI(TAG, "handle_play_random_midifile: random number is %d/%d", r, max);
+    TRACE(trc_random_pick, r, max);
 
-    dir = opendir(dirpath);
+    DIR *dir = opendir(dirpath);
     if (!dir) {
-        ESP_LOGE(TAG, "handle_play_random_midifile: Failed to stat dir : %s", dirpath);
+        ESP_LOGE(TAG, "pick_random_midifile: Failed to stat dir : %s", dirpath);
         return -1;
     }
     while ((entry = readdir(dir)) != NULL) {
     	if (entry->d_type == DT_DIR)
     		continue;
-        snprintf(entrypath, sizeof(entrypath),"%s/%s", dirpath, entry->d_name);
+        snprintf(entrypath, len,"%s/%s", dirpath, entry->d_name);
         if (stat(entrypath, &entry_stat) == -1) {
-            ESP_LOGE(TAG, "handle_play_random_midifile: %s: Failed to stat %s", entrypath, entry->d_name);
+            ESP_LOGE(TAG, "pick_random_midifile: %s: Failed to stat %s", entrypath, entry->d_name);
             continue;
         }
-        if (! IS_FILE_EXT(entrypath, ".mid")) {
-    		ESP_LOGI(TAG, "handle_play_random_midifile: %s is not a midifile", entrypath);
+        if (! IS_SONG_FILE(entrypath)) {
+    		continue;
+        }
+        if (prefix && strncmp(entry->d_name, prefix, strlen(prefix))) {
     		continue;
         }
         r--;
-		ESP_LOGI(TAG, "handle_play_random_midifile[%d]: %s is a midifile", r, entrypath);
 		if ( r > 0 ){
 			continue;
 		}
-		ESP_LOGI(TAG, "handle_play_random_midifile: play %s", entrypath);
-		handle_play_midifile(entrypath, with_delay);
+		ESP_LOGI(TAG, "pick_random_midifile: %s", entrypath);
 		break;
     }
     closedir(dir);
 
+    return r > 0 ? -1 : 0;
+}
 
-    return 0;
+/**
+ * play a random song of the directory on the given player,
+ * only songs whose name starts with 'prefix' if not empty
+ */
+int handle_play_random_midifile(const char *dirpath, const char *prefix, int player, int with_delay) {
+	char entrypath[256+1];
+
+	if ( pick_random_midifile(dirpath, prefix, entrypath, sizeof(entrypath))) {
+		return -1;
+	}
+	return mixer_play(player, entrypath, with_delay, 0);
 }
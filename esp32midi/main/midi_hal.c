@@ -0,0 +1,389 @@
+/*
+ * midi_hal.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * clock, timers and MIDI output of the player on the ESP32.
+ * The player only uses these functions, host/host_port.c has them
+ * on a virtual clock which jumps to the next deadline.
+ *
+ * Playback timers (hal_timer_create_play) don't use the esp_timer task,
+ * which runs on core 0 next to Wi-Fi. Their callbacks run in the play task
+ * on CONFIG_MIDI_PLAY_CORE, woken by the alarm of a hardware timer whose
+ * interrupt is on the same core.
+ */
+
+#include "local.h"
+#include "driver/timer.h"
+#include "soc/timer_group_struct.h"
+
+#define MIDI_TXD  (GPIO_NUM_17)
+#define MIDI_RXD  (GPIO_NUM_16)
+#define MIDI_RTS  (UART_PIN_NO_CHANGE)
+#define MIDI_CTS  (UART_PIN_NO_CHANGE)
+
+#define BUF_SIZE (1024)
+
+#define PLAY_TIMERS 4
+#define PLAY_TIMER_GROUP TIMER_GROUP_0
+#define PLAY_TIMER_IDX TIMER_1
+#define PLAY_TIMER_DIVIDER 80 // 1 µs per count at 80 MHz APB clock
+#define PLAY_TIMER_MIN_US 20 // served at once, not worth an alarm
+
+static const char *TAG = "midi_hal";
+
+struct hal_timer {
+	esp_timer_handle_t handle;
+	// play timers only
+	t_hal_timer_cb callback;
+	void *arg;
+	int64_t due; // 0 if not armed
+	int64_t period;
+};
+
+static struct hal_timer play_timers[PLAY_TIMERS];
+static int nplay_timers = 0;
+static portMUX_TYPE play_mux = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE hal_mux = portMUX_INITIALIZER_UNLOCKED; // hal_critical_enter
+static TaskHandle_t play_task_handle = NULL;
+
+int64_t IRAM_ATTR hal_time_us() {
+	return esp_timer_get_time();
+}
+
+int64_t hal_stopwatch_us() {
+	return esp_timer_get_time();
+}
+
+/**
+ * the wall clock set by SNTP, µs since the epoch
+ */
+int64_t hal_wall_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int IRAM_ATTR hal_core_id() {
+	return xPortGetCoreID();
+}
+
+/**
+ * a short critical section against tasks and ISRs on both cores,
+ * the ESP32 port takes the spinlock from an ISR as well
+ */
+void IRAM_ATTR hal_critical_enter() {
+	portENTER_CRITICAL(&hal_mux);
+}
+
+void IRAM_ATTR hal_critical_exit() {
+	portEXIT_CRITICAL(&hal_mux);
+}
+
+t_hal_timer hal_timer_create(t_hal_timer_cb callback, void *arg, const char *name) {
+	t_hal_timer timer = calloc(1, sizeof(struct hal_timer));
+	if ( !timer) {
+		ESP_LOGE(TAG, "%s: no memory for the timer", name);
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	const esp_timer_create_args_t timer_args = {
+			.callback =	callback,
+			.arg = arg,
+			// name is optional, but may help identify the timer when debugging
+			.name = name
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer->handle));
+	return timer;
+}
+
+/**
+ * a timer whose callback runs in the play task, see above.
+ * Without CONFIG_MIDI_PLAY_HW_TIMER it's a normal timer
+ */
+t_hal_timer hal_timer_create_play(t_hal_timer_cb callback, void *arg, const char *name) {
+#ifdef CONFIG_MIDI_PLAY_HW_TIMER
+	t_hal_timer timer = NULL;
+	portENTER_CRITICAL(&play_mux);
+	if ( nplay_timers < PLAY_TIMERS) {
+		timer = &play_timers[nplay_timers++];
+		timer->callback = callback;
+		timer->arg = arg;
+	}
+	portEXIT_CRITICAL(&play_mux);
+	if ( !timer) {
+		ESP_LOGE(TAG, "%s: more than %d play timers", name, PLAY_TIMERS);
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	return timer;
+#else
+	return hal_timer_create(callback, arg, name);
+#endif
+}
+
+static int is_play_timer(t_hal_timer timer) {
+	return timer >= &play_timers[0] && timer < &play_timers[PLAY_TIMERS];
+}
+
+static void play_timer_start(t_hal_timer timer, int64_t timeout_us, int64_t period_us) {
+	portENTER_CRITICAL(&play_mux);
+	timer->due = esp_timer_get_time() + MAX(timeout_us, 1);
+	timer->period = period_us;
+	portEXIT_CRITICAL(&play_mux);
+	// the play task sets the alarm for the earliest timer
+	xTaskNotifyGive(play_task_handle);
+}
+
+void hal_timer_once(t_hal_timer timer, int64_t timeout_us) {
+	if ( is_play_timer(timer)) {
+		play_timer_start(timer, timeout_us, 0);
+		return;
+	}
+	ESP_ERROR_CHECK(esp_timer_start_once(timer->handle, timeout_us));
+}
+
+void hal_timer_periodic(t_hal_timer timer, int64_t period_us) {
+	if ( is_play_timer(timer)) {
+		play_timer_start(timer, period_us, period_us);
+		return;
+	}
+	ESP_ERROR_CHECK(esp_timer_start_periodic(timer->handle, period_us));
+}
+
+/**
+ * starts a periodic timer, from an ISR too, returns the error of
+ * esp_timer_start_periodic instead of aborting, ESP_ERR_INVALID_STATE
+ * if it is already running
+ */
+esp_err_t hal_timer_start_periodic(t_hal_timer timer, int64_t period_us) {
+	if ( is_play_timer(timer)) {
+		play_timer_start(timer, period_us, period_us);
+		return ESP_OK;
+	}
+	return esp_timer_start_periodic(timer->handle, period_us);
+}
+
+void hal_timer_stop(t_hal_timer timer) {
+	if ( is_play_timer(timer)) {
+		portENTER_CRITICAL(&play_mux);
+		timer->due = 0;
+		portEXIT_CRITICAL(&play_mux);
+		return;
+	}
+	// fails if not running, that's ok
+	esp_timer_stop(timer->handle);
+}
+
+/**
+ * (re)arms a one shot timer from any task without locking, several
+ * tasks may race, the last one wins. The timer may run already
+ */
+void hal_timer_wake(t_hal_timer timer, int64_t timeout_us) {
+	if ( is_play_timer(timer)) {
+		play_timer_start(timer, timeout_us, 0);
+		return;
+	}
+	// both fail if another task got in between, that's ok
+	esp_timer_stop(timer->handle);
+	esp_timer_start_once(timer->handle, timeout_us);
+}
+
+#ifdef CONFIG_MIDI_PLAY_HW_TIMER
+static void IRAM_ATTR play_timer_isr(void *arg) {
+	BaseType_t woken = pdFALSE;
+	TIMERG0.int_clr_timers.t1 = 1; // the alarm is disabled by the hardware
+	vTaskNotifyGiveFromISR(play_task_handle, &woken);
+	if ( woken) {
+		portYIELD_FROM_ISR();
+	}
+}
+
+/**
+ * runs the callbacks of the due play timers,
+ * returns the time of the next one or 0 if none is armed
+ */
+static int64_t play_timers_run() {
+	for (;;) {
+		int64_t now = esp_timer_get_time();
+		int64_t next = 0;
+		t_hal_timer due = NULL;
+		portENTER_CRITICAL(&play_mux);
+		for ( int i = 0; i < nplay_timers; i++) {
+			t_hal_timer t = &play_timers[i];
+			if ( !t->due) {
+				continue;
+			}
+			if ( t->due <= now + PLAY_TIMER_MIN_US) {
+				due = t;
+				t->due = t->period ? t->due + t->period : 0;
+				break;
+			}
+			if ( !next || t->due < next) {
+				next = t->due;
+			}
+		}
+		portEXIT_CRITICAL(&play_mux);
+		if ( !due) {
+			return next;
+		}
+		due->callback(due->arg);
+	}
+}
+
+/**
+ * serves the play timers, the interrupt of the hardware timer
+ * is allocated on the core of this task
+ */
+static void play_task(void *arg) {
+	timer_config_t config = {
+		.divider = PLAY_TIMER_DIVIDER,
+		.counter_dir = TIMER_COUNT_UP,
+		.counter_en = TIMER_PAUSE,
+		.alarm_en = TIMER_ALARM_DIS,
+		.intr_type = TIMER_INTR_LEVEL,
+		.auto_reload = TIMER_AUTORELOAD_DIS
+	};
+	ESP_ERROR_CHECK(timer_init(PLAY_TIMER_GROUP, PLAY_TIMER_IDX, &config));
+	timer_set_counter_value(PLAY_TIMER_GROUP, PLAY_TIMER_IDX, 0);
+	timer_enable_intr(PLAY_TIMER_GROUP, PLAY_TIMER_IDX);
+	ESP_ERROR_CHECK(timer_isr_register(PLAY_TIMER_GROUP, PLAY_TIMER_IDX, play_timer_isr, NULL, ESP_INTR_FLAG_IRAM, NULL));
+	int64_t base = esp_timer_get_time(); // time of count 0
+	timer_start(PLAY_TIMER_GROUP, PLAY_TIMER_IDX);
+	ESP_LOGI(TAG, "play task on core %d, priority %d", xPortGetCoreID(), uxTaskPriorityGet(NULL));
+
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		int64_t next;
+		while ( (next = play_timers_run())) {
+			timer_set_alarm_value(PLAY_TIMER_GROUP, PLAY_TIMER_IDX, next - base);
+			timer_set_alarm(PLAY_TIMER_GROUP, PLAY_TIMER_IDX, TIMER_ALARM_EN);
+			// an alarm in the past would never fire
+			if ( esp_timer_get_time() + PLAY_TIMER_MIN_US < next) {
+				break;
+			}
+		}
+	}
+}
+#endif
+
+void hal_midi_init() {
+    /* Configure parameters of an UART driver,
+     * communication pins and install the driver */
+    uart_config_t uart_config = {
+        .baud_rate = 31250,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
+    };
+    uart_param_config(UART_NUM_2, &uart_config);
+    uart_set_pin(UART_NUM_2, MIDI_TXD, MIDI_RXD, MIDI_RTS, MIDI_CTS);
+    uart_driver_install(UART_NUM_2, BUF_SIZE * 2, 0, 0, NULL, 0);
+#ifdef CONFIG_MIDI_PLAY_HW_TIMER
+    if (xTaskCreatePinnedToCore(play_task, "midi_play", 4096, NULL,
+            CONFIG_MIDI_PLAY_PRIORITY, &play_task_handle, CONFIG_MIDI_PLAY_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "play task not started");
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+#endif
+
+    // received bytes are passed on at once, not after 120 bytes or 10 byte times,
+    // for the time stamps of midi_in.c
+    uart_intr_config_t uart_intr = {
+        .intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M | UART_RXFIFO_TOUT_INT_ENA_M
+                | UART_FRM_ERR_INT_ENA_M | UART_RXFIFO_OVF_INT_ENA_M | UART_BRK_DET_INT_ENA_M
+                | UART_PARITY_ERR_INT_ENA_M,
+        .rxfifo_full_thresh = 1,
+        .rx_timeout_thresh = 1,
+        .txfifo_empty_intr_thresh = 10
+    };
+    uart_intr_config(UART_NUM_2, &uart_intr);
+    ESP_LOGI(TAG, "MIDI out on UART2");
+}
+
+void hal_midi_write(const char *data, int len) {
+    uart_write_bytes(UART_NUM_2, data, len);
+}
+
+/**
+ * waits up to timeout_ms for received bytes, returns the bytes there
+ * without waiting for more
+ */
+int hal_midi_read(unsigned char *buf, int len, int timeout_ms) {
+	int n = uart_read_bytes(UART_NUM_2, buf, 1, timeout_ms / portTICK_PERIOD_MS);
+	if ( n <= 0) {
+		return 0;
+	}
+	size_t more = 0;
+	uart_get_buffered_data_len(UART_NUM_2, &more);
+	if ( more > 0) {
+		n += uart_read_bytes(UART_NUM_2, buf + 1, MIN(more, len - 1), 0);
+	}
+	return n;
+}
+
+/**
+ * buttons on 'pins' to ground with the internal pull up,
+ * 'isr' is called with the pin as argument on the falling edge
+ */
+void hal_gpio_input(const int *pins, int npins, void (*isr)(void *arg)) {
+	gpio_config_t io_conf = {
+			.intr_type = GPIO_INTR_NEGEDGE,
+			.mode = GPIO_MODE_INPUT,
+			.pull_up_en = GPIO_PULLUP_ENABLE,
+			.pull_down_en = GPIO_PULLDOWN_DISABLE,
+	};
+	for ( int i = 0; i < npins; i++) {
+		io_conf.pin_bit_mask |= 1ULL << pins[i];
+	}
+	gpio_config(&io_conf);
+
+	gpio_install_isr_service(0);
+	for ( int i = 0; i < npins; i++) {
+		gpio_isr_handler_add(pins[i], isr, (void*) pins[i]);
+	}
+}
+
+int IRAM_ATTR hal_gpio_level(int pin) {
+	return gpio_get_level(pin);
+}
+
+t_hal_queue hal_queue_create(int len, int size) {
+	QueueHandle_t queue = xQueueCreate(len, size);
+	if ( !queue) {
+		ESP_LOGE(TAG, "no memory for a queue of %d items", len);
+		ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+	}
+	return (t_hal_queue) queue;
+}
+
+/**
+ * from tasks and timer callbacks, returns -1 if the queue is full
+ */
+int hal_queue_send(t_hal_queue queue, const void *item) {
+	return xQueueSend((QueueHandle_t) queue, item, 0) == pdTRUE ? 0 : -1;
+}
+
+/**
+ * waits up to timeout_ms for an item, for ever if timeout_ms < 0.
+ * Returns true if one was received
+ */
+int hal_queue_receive(t_hal_queue queue, void *item, int timeout_ms) {
+	TickType_t ticks = timeout_ms < 0 ? portMAX_DELAY : timeout_ms / portTICK_PERIOD_MS;
+	return xQueueReceive((QueueHandle_t) queue, item, ticks) == pdTRUE;
+}
+
+/**
+ * the number of items waiting, from tasks and timer callbacks
+ */
+int hal_queue_pending(t_hal_queue queue) {
+	return uxQueueMessagesWaiting((QueueHandle_t) queue);
+}
+
+/**
+ * starts a task on the given core, any core if core < 0
+ */
+int hal_task_start(void (*task)(void *arg), const char *name, int stack, int priority, int core, void *arg) {
+	return xTaskCreatePinnedToCore(task, name, stack, arg, priority, NULL,
+			core < 0 ? tskNO_AFFINITY : core) == pdPASS ? 0 : -1;
+}
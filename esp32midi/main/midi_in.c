@@ -0,0 +1,422 @@
+/*
+ * midi_in.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * MIDI in on UART2 (MIDI_RXD), MIDI thru and recording to a SMF.
+ *
+ * A task reads the UART and parses the bytes, running status and
+ * realtime messages (F8..FF) between the bytes of a message included.
+ * It waits most of the time, its priority is high for MIDI thru.
+ * Channel messages get the time of their first byte in µs and are put
+ * into a preallocated ring. The same task writes the ring to the SMF
+ * when it is idle or the ring is filling up, so slow flash writes don't
+ * delay the time stamps.
+ *
+ * The SMF has one track with 500000 µs per quarter and MIDI_IN_TPQ
+ * ticks per quarter, a tick is 100 µs. The recording starts with the
+ * first event.
+ *
+ * MIDI thru: complete channel messages are sent on at once (system and
+ * realtime messages are not). They go into the lock-free queue of the
+ * mixer, which merges them with the songs, see midi_mixer.c. A message
+ * arriving while a song streams a sysex has to wait for its end (a
+ * conflict). The latency is from the last byte received to the first
+ * byte sent. Network MIDI (rtp_midi.c) takes the same way.
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_in";
+
+#define MIDI_IN_RING 256 // events, power of 2
+#define MIDI_IN_FLUSH 64 // events in the ring to write them without waiting for idle
+#define MIDI_IN_IDLE_MS 100
+#define MIDI_IN_TPQ 5000
+#define MIDI_IN_TICK_US 100 // 500000 / MIDI_IN_TPQ
+#define MIDI_IN_TRACK_LEN_POS 18 // position of the track length in the file
+#define MIDI_THRU_LATE_US 1000
+
+static t_midi_in_evt ring[MIDI_IN_RING];
+static uint32_t ring_head = 0; // written by the parser
+static uint32_t ring_tail = 0; // written by the SMF writer
+
+// parser
+static unsigned char running_status = 0;
+static unsigned char msg_status = 0; // of the message being read, 0 if none
+static unsigned char msg_data[2];
+static int msg_len = 0;
+static int64_t msg_time = 0;
+static int in_sysex = false;
+
+// the reader writes in_stat, the mixer thru_stat, read without locking
+static t_midi_in_stat in_stat;
+static uint32_t stat_seq = 0;
+static int rec_clear = false; // of the recording counts, requested by midi_in_record
+static t_midi_in_stat thru_stat;
+static uint32_t thru_seq = 0;
+
+static volatile int thru = MIDI_THRU_DEFAULT;
+
+// recording
+// set by the HTTP task, the reader writes
+static FILE * volatile rec_fd = NULL;
+static volatile int rec_stop = false;
+static int64_t rec_start = -1; // time of the first event
+static long rec_ticks = 0; // of the last written event
+static unsigned char rec_status = 0; // running status in the file
+static long rec_len = 0; // track length
+
+/**
+ * number of data bytes of a message
+ */
+static int data_len(unsigned char status) {
+	switch (status & 0xF0) {
+	case 0xC0:
+	case 0xD0:
+		return 1;
+	case 0xF0:
+		switch (status) {
+		case 0xF1: // MTC quarter frame
+		case 0xF3: // song select
+			return 1;
+		case 0xF2: // song position
+			return 2;
+		default:
+			return 0;
+		}
+	default:
+		return 2;
+	}
+}
+
+/**
+ * starts a change of in_stat by the reader, a clear requested is done first
+ */
+static void stat_begin() {
+	seq_write_begin(&stat_seq);
+	if ( __atomic_load_n(&rec_clear, __ATOMIC_ACQUIRE)) {
+		in_stat.recorded = 0;
+		in_stat.dropped = 0;
+		__atomic_store_n(&rec_clear, false, __ATOMIC_RELEASE);
+	}
+}
+
+static void put_event(unsigned char status, const unsigned char *data, int64_t time) {
+	uint32_t head = ring_head;
+	if ( head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= MIDI_IN_RING) {
+		in_stat.dropped++;
+		return;
+	}
+	t_midi_in_evt *evt = &ring[head & (MIDI_IN_RING - 1)];
+	evt->time = time;
+	evt->status = status;
+	evt->data[0] = data[0];
+	evt->data[1] = data[1];
+	__atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void thru_message(unsigned char status, const unsigned char *data, int64_t received) {
+	unsigned char msg[3] = { status, data[0], data[1] };
+	if ( mixer_send(msg, 1 + data_len(status), received)) {
+		in_stat.thru_dropped++;
+	}
+}
+
+/**
+ * sends a channel message of network MIDI on the wire, not counted as
+ * MIDI thru. Returns -1 if the wire queue is full
+ */
+int midi_in_send(unsigned char status, const unsigned char *data) {
+	unsigned char msg[3] = { status, data[0], data[1] };
+	return mixer_send(msg, 1 + data_len(status), -1);
+}
+
+/**
+ * a message was sent at 'start', 'held' if it waited for a sysex.
+ * Called by the mixer
+ */
+void midi_in_thru_sent(int64_t received, int64_t start, int held) {
+	long latency = start - received;
+	seq_write_begin(&thru_seq);
+	thru_stat.thru++;
+	thru_stat.thru_sum_us += latency;
+	thru_stat.thru_max_us = MAX(thru_stat.thru_max_us, latency);
+	if ( latency > MIDI_THRU_LATE_US) {
+		thru_stat.thru_late++;
+	}
+	if ( held) {
+		thru_stat.conflicts++;
+	}
+	seq_write_end(&thru_seq);
+}
+
+void midi_in_thru(int on) {
+	thru = on;
+}
+
+int midi_in_thru_on() {
+	return thru;
+}
+
+static void message_complete(int64_t last_byte) {
+	in_stat.events++;
+	if ( msg_status < 0xF0) {
+		if ( thru) {
+			thru_message(msg_status, msg_data, last_byte);
+		}
+		if ( rec_fd && !rec_stop) {
+			put_event(msg_status, msg_data, msg_time);
+		}
+	}
+	msg_status = 0;
+	msg_len = 0;
+}
+
+/**
+ * parses received bytes, 'time' is the time of the last one. The bytes
+ * before it were on the wire MIDI_BYTE_US earlier each
+ */
+void midi_in_input(const unsigned char *data, int len, int64_t time) {
+	stat_begin();
+	for ( int i = 0; i < len; i++) {
+		unsigned char c = data[i];
+		int64_t t = time - (int64_t) (len - 1 - i) * MIDI_BYTE_US;
+		in_stat.bytes++;
+
+		if ( c >= 0xF8) {
+			// realtime: clock, start, stop, active sensing, reset, may come anywhere
+			in_stat.realtime++;
+			continue;
+		}
+		if ( c & 0x80) {
+			if ( in_sysex) {
+				// F7 or any other status ends a sysex
+				in_sysex = false;
+				if ( c == 0xF7) {
+					continue;
+				}
+			}
+			if ( msg_status && msg_len > 0) {
+				in_stat.incomplete++;
+			}
+			msg_status = 0;
+			msg_len = 0;
+			if ( c == 0xF0) {
+				in_sysex = true;
+				running_status = 0;
+				in_stat.sysex++;
+				continue;
+			}
+			if ( c >= 0xF0) {
+				// system common cancels running status
+				running_status = 0;
+			} else {
+				running_status = c;
+			}
+			msg_status = c;
+			msg_time = t;
+			if ( data_len(c) == 0) {
+				message_complete(t);
+			}
+			continue;
+		}
+
+		// data byte
+		if ( in_sysex) {
+			continue;
+		}
+		if ( !msg_status) {
+			if ( !running_status) {
+				in_stat.stray++;
+				continue;
+			}
+			msg_status = running_status;
+			msg_time = t;
+		}
+		msg_data[msg_len++] = c;
+		if ( msg_len == data_len(msg_status)) {
+			if ( msg_len == 1) {
+				msg_data[1] = 0;
+			}
+			message_complete(t);
+		}
+	}
+	seq_write_end(&stat_seq);
+}
+
+static void write_long(FILE *fd, unsigned long val, int n) {
+	for ( int i = n - 1; i >= 0; i--) {
+		fputc((val >> (8 * i)) & 0xFF, fd);
+	}
+}
+
+/**
+ * writes a variable length quantity, returns its length
+ */
+static int write_vlq(FILE *fd, unsigned long val) {
+	unsigned char buf[5];
+	int n = 0;
+	do {
+		buf[n++] = val & 0x7F;
+		val >>= 7;
+	} while ( val);
+	for ( int i = n - 1; i >= 0; i--) {
+		fputc(buf[i] | (i ? 0x80 : 0), fd);
+	}
+	return n;
+}
+
+static void write_event(t_midi_in_evt *evt) {
+	if ( rec_start < 0) {
+		rec_start = evt->time;
+	}
+	long ticks = (evt->time - rec_start + MIDI_IN_TICK_US / 2) / MIDI_IN_TICK_US;
+	if ( ticks < rec_ticks) {
+		// the time stamps of a read are estimated
+		ticks = rec_ticks;
+	}
+	rec_len += write_vlq(rec_fd, ticks - rec_ticks);
+	rec_ticks = ticks;
+	if ( evt->status != rec_status) {
+		fputc(evt->status, rec_fd);
+		rec_len++;
+		rec_status = evt->status;
+	}
+	int n = data_len(evt->status);
+	fwrite(evt->data, 1, n, rec_fd);
+	rec_len += n;
+	stat_begin();
+	in_stat.recorded++;
+	seq_write_end(&stat_seq);
+}
+
+static void record_finish() {
+	// end of track
+	fwrite("\x00\xFF\x2F\x00", 1, 4, rec_fd);
+	rec_len += 4;
+	fseek(rec_fd, MIDI_IN_TRACK_LEN_POS, SEEK_SET);
+	write_long(rec_fd, rec_len, 4);
+	fclose(rec_fd);
+	rec_fd = NULL;
+	ESP_LOGI(TAG, "recording stopped, %ld events, %ld ms, %ld dropped",
+			in_stat.recorded, rec_ticks * MIDI_IN_TICK_US / 1000, in_stat.dropped);
+}
+
+/**
+ * writes the received events to the file and finishes a stopped
+ * recording. Without 'idle' only if there are many events
+ */
+void midi_in_service(int idle) {
+	if ( !rec_fd) {
+		return;
+	}
+	uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	if ( !idle && !rec_stop && head - ring_tail < MIDI_IN_FLUSH) {
+		return;
+	}
+	while ( ring_tail != head) {
+		write_event(&ring[ring_tail & (MIDI_IN_RING - 1)]);
+		__atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+	}
+	if ( rec_stop) {
+		record_finish();
+	}
+}
+
+/**
+ * starts recording into a new SMF
+ */
+int midi_in_record(const char *filepath) {
+	if ( rec_fd) {
+		ESP_LOGE(TAG, "already recording");
+		return -1;
+	}
+	FILE *fd = fopen(filepath, "w");
+	if ( !fd) {
+		ESP_LOGE(TAG, "Failed to create file : %s", filepath);
+		return -1;
+	}
+	// header: format 0, one track
+	fwrite("MThd", 1, 4, fd);
+	write_long(fd, 6, 4);
+	write_long(fd, 0, 2);
+	write_long(fd, 1, 2);
+	write_long(fd, MIDI_IN_TPQ, 2);
+	fwrite("MTrk", 1, 4, fd);
+	write_long(fd, 0, 4); // length, written at the end
+	// tempo 500000 µs per quarter
+	fwrite("\x00\xFF\x51\x03\x07\xA1\x20", 1, 7, fd);
+
+	rec_len = 7;
+	rec_start = -1;
+	rec_ticks = 0;
+	rec_status = 0;
+	__atomic_store_n(&rec_clear, true, __ATOMIC_RELEASE);
+	// events received before are not recorded
+	ring_tail = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	rec_stop = false;
+	rec_fd = fd;
+	ESP_LOGI(TAG, "recording to %s", filepath);
+	return 0;
+}
+
+/**
+ * stops the recording, the file is complete after the next midi_in_service
+ */
+int midi_in_stop() {
+	if ( !rec_fd) {
+		return -1;
+	}
+	rec_stop = true;
+	return 0;
+}
+
+int midi_in_recording() {
+	return rec_fd != NULL;
+}
+
+/**
+ * the statistics of MIDI in and thru, without locking
+ */
+void midi_in_get_stat(t_midi_in_stat *s) {
+	t_midi_in_stat t;
+	if ( seq_read(&stat_seq, s, &in_stat, sizeof(*s))) {
+		// changing all the time
+		memset(s, 0, sizeof(*s));
+	}
+	if ( __atomic_load_n(&rec_clear, __ATOMIC_ACQUIRE)) {
+		// a recording started, nothing received since
+		s->recorded = 0;
+		s->dropped = 0;
+	}
+	if ( seq_read(&thru_seq, &t, &thru_stat, sizeof(t))) {
+		memset(&t, 0, sizeof(t));
+	}
+	s->thru = t.thru;
+	s->thru_sum_us = t.thru_sum_us;
+	s->thru_max_us = t.thru_max_us;
+	s->thru_late = t.thru_late;
+	s->conflicts = t.conflicts;
+}
+
+static void midi_in_task(void *arg) {
+	unsigned char buf[64];
+	for (;;) {
+		int n = hal_midi_read(buf, sizeof(buf), MIDI_IN_IDLE_MS);
+		if ( n > 0) {
+			midi_in_input(buf, n, hal_time_us());
+		}
+		midi_in_service(n <= 0);
+	}
+}
+
+/**
+ * starts the reader, after midi_init
+ */
+void midi_in_init() {
+	if ( hal_task_start(midi_in_task, "midi_in", 4096, MIDI_IN_PRIORITY, CONFIG_MIDI_PLAY_CORE, NULL)) {
+		ESP_LOGE(TAG, "no reader task");
+	}
+}
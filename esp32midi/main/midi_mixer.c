@@ -0,0 +1,1067 @@
+/*
+ * midi_mixer.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * plays up to MIX_PLAYERS songs simultaneously.
+ *
+ * Every player knows the time of its next event. The players with
+ * something to play are kept in a heap sorted by this time, a single
+ * one shot timer is armed for the earliest one. So the costs depend on
+ * the number of events, not on the number of players.
+ *
+ * Channels of a player are mapped to output channels on first use,
+ * a channel used by another player is moved to a free one.
+ * All players share the bandwidth of the midi wire, note on events
+ * exceeding it are dropped.
+ *
+ * Songs with transform rules get lookup tables for notes, velocities
+ * and channels, see midi_xform.c.
+ *
+ * A sysex may not be interrupted by other messages, while a player
+ * streams one the other players have to wait.
+ *
+ * The mixer is the only writer of the wire. MIDI thru, network MIDI
+ * (midi_in.c) and the jingles put their messages into a lock-free
+ * queue and wake the mixer, which sends them at the start of its tick.
+ * Thru bytes are charged to the budget, so on a saturated wire songs
+ * lose notes, not the input.
+ *
+ * mixer_play_at starts a song at a wall clock time, e.g. for a chime on
+ * the minute. The song is opened and its first event decoded ahead, the
+ * wall time is converted to the timer's time base then. The player is
+ * woken MIX_ALIGN_US before the first event and converts again, so drift
+ * of the wall clock (SNTP adjusting it) meanwhile is corrected.
+ *
+ * Playing, stopping, the rate and new transform tables are commands
+ * for the mixer: HTTP handlers, buttons and chimes open and seek the
+ * song themselves, then put the command into a lock-free queue and wake
+ * the mixer timer. The mixer applies the commands at the start of its
+ * next tick, so the callers never wait for playback and the players are
+ * changed only by the mixer. Its statistics are read through sequence
+ * numbers, nobody waits for the mixer and it waits for nobody.
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_mixer";
+
+#define MIX_SLACK_US 500 // events due within this time are played together
+#define MIX_MIN_WAIT_US 100 // shortest timer period
+#define MIX_BUDGET_MAX 128 // max. burst in bytes
+#define MIX_BLINK_US 500000
+#define MIX_DRUM_CHANNEL 9 // channel 10 is never moved
+#define MIX_NO_CHANNEL 0xFF
+#define MIX_ALIGN_US 10000 // wake up before an aligned start to correct it
+#define MIX_CMD_QUEUE 16 // commands not yet applied, a power of 2
+#define MIX_WIRE_QUEUE 64 // messages of MIDI thru not yet sent, a power of 2
+#define MIX_ANY_PLAYER -1 // a free player for play, all players for stop
+
+enum MIX_CMD { mix_cmd_play, mix_cmd_stop, mix_cmd_rate, mix_cmd_xform, mix_cmd_reset };
+
+typedef struct {
+	int cmd;
+	int player;
+	t_midi_song *song; // play: opened and sought
+	t_chase *chase; // play: state of the skipped part, NULL from the start
+	t_xform *xf; // play, xform: tables for the song
+	char file[32]; // xform: the song it was compiled for
+	long start_ms;
+	int with_delay;
+	int64_t wall_us; // play: start at this wall clock time, 0 at once
+	long rate;
+	int reset; // stop: reset the synth
+} t_mix_cmd;
+
+// a channel message for the wire
+typedef struct {
+	int64_t received; // time of its last byte, for the thru latency, -1 if not thru
+	unsigned char msg[3];
+	unsigned char len;
+} t_mix_msg;
+
+// lock-free, multiple producers and the mixer as the only consumer.
+// Item i is free for the queue position pos with seq[i] = pos rounded
+// down to 'size', filled with seq + 1. So it's all zero at the start
+typedef struct {
+	uint32_t *seq;
+	void *items;
+	size_t itemsize;
+	uint32_t size; // a power of 2
+	uint32_t head; // next to fill
+	uint32_t tail; // next to take
+} t_mix_queue;
+
+typedef struct {
+	t_midi_song *song;
+	int64_t due; // time of next event
+	unsigned char chmap[16]; // song channel -> output channel
+	t_xform *xf; // transform tables, NULL if none
+	int64_t wall_start; // wall clock time of the first event, 0 when started
+	int aligning; // woken MIX_ALIGN_US before the first event
+	int first_out; // no event played yet, traced for the latency
+	uint32_t sounding[16][128 / 32]; // notes on by output channel, switched off at the end
+} t_mix_player;
+
+static t_mix_player players[MIX_PLAYERS];
+
+// players with something to play, sorted by due time
+static int heap[MIX_PLAYERS];
+static int heappos[MIX_PLAYERS];
+static int nheap = 0;
+
+static unsigned char channel_owner[16]; // player+1, 0 if free
+
+static int sysex_player = -1; // player streaming a sysex
+
+static long mix_rate = RATE_ONE; // playback rate of all songs
+
+static t_hal_timer mixer_timer = NULL;
+
+static uint32_t cmd_seq[MIX_CMD_QUEUE];
+static t_mix_cmd cmd_items[MIX_CMD_QUEUE];
+static t_mix_queue cmd_queue = { cmd_seq, cmd_items, sizeof(t_mix_cmd), MIX_CMD_QUEUE, 0, 0 };
+static long mix_rate_set = RATE_ONE; // the last rate requested
+
+static uint32_t wire_seq[MIX_WIRE_QUEUE];
+static t_mix_msg wire_items[MIX_WIRE_QUEUE];
+static t_mix_queue wire_queue = { wire_seq, wire_items, sizeof(t_mix_msg), MIX_WIRE_QUEUE, 0, 0 };
+static uint32_t wire_held = 0; // queue position up to which messages waited for a sysex
+
+// output budget
+static long budget = MIX_BUDGET_MAX;
+static int64_t budget_time = 0;
+
+static char outbuf[256];
+static int outlen = 0;
+static int64_t wire_free = 0; // when the bytes written so far have left the UART
+
+// system reset, program 0 on all channels
+static const char reset_seq[MIDI_RESET_LEN] = { 0xFF,
+		0xC0, 0, 0xC1, 0, 0xC2, 0, 0xC3, 0, 0xC4, 0, 0xC5, 0, 0xC6, 0, 0xC7, 0,
+		0xC8, 0, 0xC9, 0, 0xCA, 0, 0xCB, 0, 0xCC, 0, 0xCD, 0, 0xCE, 0, 0xCF, 0 };
+
+static int64_t blink_time = 0;
+static int led_on = false;
+
+// statistics
+static long mix_events = 0;
+static long mix_dropped = 0;
+static long mix_collisions = 0;
+static t_mixer_timing timing;
+static uint32_t timing_seq = 0;
+static int timing_clear = false; // requested by mixer_get_timing, done by the mixer
+static const long late_limits[MIX_LATE_BUCKETS - 1] = { 100, 250, 500, 1000, 2000 };
+
+// song names and start times for the status, readers check the sequence number
+static uint32_t status_seq = 0;
+static t_mixer_status status;
+
+static void heap_swap(int i, int j) {
+	int tmp = heap[i];
+	heap[i] = heap[j];
+	heap[j] = tmp;
+	heappos[heap[i]] = i;
+	heappos[heap[j]] = j;
+}
+
+static void heap_up(int i) {
+	while ( i > 0) {
+		int parent = (i - 1) / 2;
+		if ( players[heap[parent]].due <= players[heap[i]].due)
+			break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(int i) {
+	for (;;) {
+		int smallest = i;
+		int l = 2*i + 1;
+		int r = l + 1;
+		if ( l < nheap && players[heap[l]].due < players[heap[smallest]].due)
+			smallest = l;
+		if ( r < nheap && players[heap[r]].due < players[heap[smallest]].due)
+			smallest = r;
+		if ( smallest == i)
+			break;
+		heap_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void heap_push(int p) {
+	heap[nheap] = p;
+	heappos[p] = nheap;
+	nheap++;
+	heap_up(nheap - 1);
+}
+
+static void heap_remove(int p) {
+	int i = heappos[p];
+	if ( i < 0) {
+		return;
+	}
+	heappos[p] = -1;
+	if ( --nheap == i) {
+		return;
+	}
+	heap[i] = heap[nheap];
+	heappos[heap[i]] = i;
+	heap_up(i);
+	heap_down(heappos[heap[i]]);
+}
+
+/**
+ * puts an item into a queue, from any task.
+ * Returns -1 if the queue is full
+ */
+static int queue_push(t_mix_queue *q, const void *item) {
+	uint32_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	uint32_t *seq;
+	for (;;) {
+		seq = &q->seq[pos & (q->size - 1)];
+		int32_t dif = __atomic_load_n(seq, __ATOMIC_ACQUIRE) - (pos & ~(q->size - 1));
+		if ( dif == 0) {
+			// claim it, on failure pos is the new head
+			if ( __atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if ( dif < 0) {
+			return -1; // not yet taken since the last lap
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	memcpy((char *) q->items + (pos & (q->size - 1)) * q->itemsize, item, q->itemsize);
+	__atomic_store_n(seq, (pos & ~(q->size - 1)) + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * the next item for the mixer, -1 if there is none
+ */
+static int queue_pop(t_mix_queue *q, void *item) {
+	uint32_t *seq = &q->seq[q->tail & (q->size - 1)];
+	uint32_t lap = q->tail & ~(q->size - 1);
+	if ( __atomic_load_n(seq, __ATOMIC_ACQUIRE) != lap + 1) {
+		return -1;
+	}
+	memcpy(item, (char *) q->items + (q->tail & (q->size - 1)) * q->itemsize, q->itemsize);
+	// free for the next lap
+	__atomic_store_n(seq, lap + q->size, __ATOMIC_RELEASE);
+	q->tail++;
+	return 0;
+}
+
+static int queue_pending(t_mix_queue *q) {
+	uint32_t *seq = &q->seq[q->tail & (q->size - 1)];
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE) == (q->tail & ~(q->size - 1)) + 1;
+}
+
+static void flush_out() {
+	if ( outlen > 0) {
+		wire_free = MAX(wire_free, hal_time_us()) + (int64_t) outlen * MIDI_BYTE_US;
+		hal_midi_write(outbuf, outlen);
+		outlen = 0;
+	}
+}
+
+static void put_out(const char *data, int len) {
+	if ( outlen + len > sizeof(outbuf)) {
+		flush_out();
+	}
+	memcpy(&outbuf[outlen], data, len);
+	outlen += len;
+}
+
+/**
+ * output channel of a song channel, allocated on first use
+ */
+static unsigned char map_channel(int p, unsigned char ch) {
+	t_mix_player *pl = &players[p];
+
+	if ( pl->chmap[ch] != MIX_NO_CHANNEL) {
+		return pl->chmap[ch];
+	}
+
+	unsigned char out = ch;
+	if ( ch != MIX_DRUM_CHANNEL && channel_owner[ch] && channel_owner[ch] != p+1) {
+		// used by another player, look for a free one
+		for ( int i = 0; i < 16; i++) {
+			if ( i != MIX_DRUM_CHANNEL && !channel_owner[i]) {
+				out = i;
+				break;
+			}
+		}
+		if ( out == ch) {
+			// nothing free, both have to share it
+			mix_collisions++;
+			TRACE(trc_channel_shared, p, ch);
+		}
+	}
+	if ( !channel_owner[out]) {
+		channel_owner[out] = p+1;
+	}
+	pl->chmap[ch] = out;
+	return out;
+}
+
+/**
+ * counts the notes of a message for the synth, false if it's not sent
+ */
+static int voice_limit(unsigned char *msg) {
+	unsigned char ch = msg[0] & 0x0F;
+	unsigned char off[3];
+
+	switch ( msg[0] & 0xF0) {
+	case 0x90:
+		if ( msg[2] > 0) {
+			int rc = voice_note_on(ch, msg[1] & 0x7F, msg[2], off);
+			if ( rc == VOICE_STEAL) {
+				budget -= sizeof(off);
+				put_out((char *) off, sizeof(off));
+			}
+			return rc != VOICE_DROP;
+		}
+		// fall through, note off
+	case 0x80:
+		return voice_note_off(ch, msg[1] & 0x7F);
+	case 0xB0:
+		if ( msg[1] == 0x78 || msg[1] == 0x7B) {
+			// all sound off, all notes off
+			voice_channel_off(ch);
+		}
+		break;
+	}
+	return true;
+}
+
+/**
+ * remembers the notes of a player sounding, as sent
+ */
+static void note_track(t_mix_player *pl, const unsigned char *msg) {
+	uint32_t *bits = pl->sounding[msg[0] & 0x0F];
+	unsigned char note = msg[1] & 0x7F;
+	switch ( msg[0] & 0xF0) {
+	case 0x90:
+		if ( msg[2] > 0) {
+			bits[note / 32] |= 1U << (note % 32);
+			break;
+		}
+		// fall through, note off
+	case 0x80:
+		bits[note / 32] &= ~(1U << (note % 32));
+		break;
+	case 0xB0:
+		if ( msg[1] == 0x78 || msg[1] == 0x7B) {
+			memset(bits, 0, sizeof(pl->sounding[0]));
+		}
+		break;
+	}
+}
+
+/**
+ * switches the notes of a player off, only its own ones, channels may
+ * be shared with other players
+ */
+static void notes_off(t_mix_player *pl) {
+	for ( int ch = 0; ch < 16; ch++) {
+		for ( int w = 0; w < 128 / 32; w++) {
+			for ( uint32_t bits = pl->sounding[ch][w]; bits; bits &= bits - 1) {
+				int note = w * 32 + __builtin_ctz(bits);
+				char msg[3] = { 0x80 | ch, note, 0x40 };
+				put_out(msg, sizeof(msg));
+				voice_note_off(ch, note);
+			}
+		}
+	}
+	memset(pl->sounding, 0, sizeof(pl->sounding));
+}
+
+/**
+ * receives the events of a player, transforms them, remaps the channel
+ * and checks the output budget
+ */
+static void mixer_out(t_midi_song *song, t_midi_evt *evt, void *ctx) {
+	int p = (t_mix_player *) ctx - players;
+	unsigned char msg[3]; // unsigned, a table value XFORM_DROP compares as 0xFF
+	int len = 1 + evt->datalen;
+
+	if ( evt->event == 0xF0) {
+		// piece of a sysex, as it is
+		budget -= evt->datalen;
+		put_out(evt->data, evt->datalen);
+		mix_events++;
+		return;
+	}
+	if ( len > sizeof(msg)) {
+		return; // not a channel event
+	}
+
+	unsigned char status = evt->event & 0xF0;
+	unsigned char ch = evt->event & 0x0F;
+	memcpy(&msg[1], evt->data, evt->datalen);
+
+	t_xform *xf = players[p].xf;
+	if ( xf) {
+		if ( status <= 0xA0) {
+			// note off, note on, poly pressure
+			if ( (msg[1] = xf->note[ch][msg[1] & 0x7F]) == XFORM_DROP) {
+				return;
+			}
+			if ( status == 0x90) {
+				msg[2] = xf->velocity[ch][msg[2] & 0x7F];
+			}
+		}
+		if ( (ch = xf->channel[ch]) == XFORM_DROP) {
+			return;
+		}
+	}
+
+	if ( budget < len && status == 0x90 && evt->datalen > 1 && msg[2] > 0) {
+		// wire is saturated, note off and controllers are never dropped
+		mix_dropped++;
+		return;
+	}
+
+	msg[0] = status | map_channel(p, ch);
+	if ( !voice_limit(msg)) {
+		return;
+	}
+	note_track(&players[p], msg);
+	budget -= len;
+	put_out((char *) msg, len);
+	mix_events++;
+}
+
+/**
+ * sends the messages of MIDI thru and the jingles, before the songs,
+ * they are due already. Their notes are counted for the synth too.
+ * Not while a song streams a sysex, they wait for its end (a
+ * conflict), mixer_arm wakes the mixer again then
+ */
+static void drain_wire(int64_t now) {
+	t_mix_msg m;
+	if ( sysex_player >= 0) {
+		if ( queue_pending(&wire_queue)) {
+			wire_held = __atomic_load_n(&wire_queue.head, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	for (;;) {
+		int held = (int32_t) (wire_held - wire_queue.tail) > 0;
+		if ( queue_pop(&wire_queue, &m)) {
+			break;
+		}
+		if ( !voice_limit(m.msg)) {
+			continue; // gives way to the notes sounding
+		}
+		// after a note off for a stolen voice
+		int64_t start = MAX(wire_free, now) + (int64_t) outlen * MIDI_BYTE_US;
+		budget -= m.len;
+		put_out((char *) m.msg, m.len);
+		if ( m.received >= 0) {
+			midi_in_thru_sent(m.received, start, held);
+		}
+	}
+}
+
+static void refill_budget(int64_t now) {
+	long n = (now - budget_time) / MIDI_BYTE_US;
+	budget_time += n * MIDI_BYTE_US;
+	budget += n;
+	if ( budget >= MIX_BUDGET_MAX) {
+		budget = MIX_BUDGET_MAX;
+		budget_time = now;
+	}
+}
+
+static void status_set(int p, const t_midi_song *song) {
+	seq_write_begin(&status_seq);
+	if ( song) {
+		const char *name = strrchr(song->filepath, '/');
+		snprintf(status.player[p].file, sizeof(status.player[p].file), "%s", name ? name + 1 : song->filepath);
+		status.player[p].start = song->starttime;
+	} else {
+		status.player[p].file[0] = '\0';
+		status.player[p].start = 0;
+	}
+	seq_write_end(&status_seq);
+}
+
+/**
+ * the synth forgets everything, the voices too
+ */
+static void reset_synth() {
+	put_out(reset_seq, sizeof(reset_seq));
+	voice_reset();
+}
+
+/**
+ * stops a player and releases its channels
+ */
+static void release_player(int p) {
+	t_mix_player *pl = &players[p];
+
+	heap_remove(p);
+
+	if ( sysex_player == p) {
+		// terminate the interrupted sysex
+		char eox = 0xF7;
+		put_out(&eox, 1);
+		sysex_player = -1;
+	}
+
+	notes_off(pl);
+	for ( int i = 0; i < 16; i++) {
+		if ( channel_owner[i] == p+1) {
+			channel_owner[i] = 0;
+		}
+	}
+	memset(pl->chmap, MIX_NO_CHANNEL, sizeof(pl->chmap));
+	free(pl->xf);
+	pl->xf = NULL;
+	pl->wall_start = 0;
+	pl->aligning = false;
+	pl->first_out = false;
+
+	if ( pl->song) {
+		status_set(p, NULL);
+		TRACE(trc_player_end, p, (hal_time_us() - pl->song->starttime) / 1000);
+		midi_song_close(pl->song);
+		pl->song = NULL;
+	}
+}
+
+/**
+ * the player to be served next, -1 if nobody plays
+ */
+static int next_player() {
+	if ( sysex_player >= 0) {
+		return sysex_player;
+	}
+	return nheap > 0 ? heap[0] : -1;
+}
+
+static void mixer_arm() {
+	int p = next_player();
+	if ( p < 0) {
+		hal_timer_stop(mixer_timer);
+	} else {
+		int64_t wait = players[p].due - hal_time_us();
+		if ( wait < MIX_MIN_WAIT_US) {
+			wait = MIX_MIN_WAIT_US;
+		}
+		hal_timer_wake(mixer_timer, wait);
+	}
+	// queued meanwhile, the wake-up may be overwritten
+	if ( queue_pending(&cmd_queue) || (sysex_player < 0 && queue_pending(&wire_queue))) {
+		hal_timer_wake(mixer_timer, 0);
+	}
+}
+
+static void blink(int64_t now) {
+	if ( nheap == 0) {
+		led_on = false;
+		blue_off();
+	} else if ( now - blink_time >= MIX_BLINK_US) {
+		blink_time = now;
+		led_on = !led_on;
+		if ( led_on) {
+			blue_on();
+		} else {
+			blue_off();
+		}
+	}
+}
+
+static void timing_add(long late) {
+	int b = 0;
+	late = MAX(late, 0); // the slack allows waking a bit early
+	seq_write_begin(&timing_seq);
+	if ( __atomic_load_n(&timing_clear, __ATOMIC_ACQUIRE)) {
+		memset(&timing, 0, sizeof(timing));
+		__atomic_store_n(&timing_clear, false, __ATOMIC_RELEASE);
+	}
+	while ( b < MIX_LATE_BUCKETS - 1 && late >= late_limits[b]) {
+		b++;
+	}
+	timing.late[b]++;
+	timing.wakeups++;
+	timing.late_sum_us += late;
+	timing.late_max_us = MAX(timing.late_max_us, late);
+	seq_write_end(&timing_seq);
+}
+
+/**
+ * converts a wall clock time (µs since the epoch) into the timer's time
+ */
+static int64_t wall_to_time_us(int64_t wall_us) {
+	int64_t t0 = hal_time_us();
+	int64_t wall = hal_wall_us();
+	return wall_us - wall + (t0 + hal_time_us()) / 2;
+}
+
+/**
+ * corrects the time of the first event of a player started with
+ * mixer_play_at, returns true if it's not yet due now
+ */
+static int align_start(int p, int64_t now) {
+	t_mix_player *pl = &players[p];
+	if ( pl->aligning) {
+		int64_t due = wall_to_time_us(pl->wall_start);
+		int64_t shift = due - (pl->due + MIX_ALIGN_US);
+		pl->aligning = false;
+		pl->song->starttime += shift;
+		pl->due = due;
+		TRACE(trc_player_shift, p, shift);
+		if ( due > now + MIX_SLACK_US) {
+			heap_down(heappos[p]);
+			return true;
+		}
+		heap_up(heappos[p]);
+	}
+	pl->wall_start = 0;
+	TRACE(trc_player_align, p, now - pl->due);
+	return false;
+}
+
+/**
+ * starts a song opened by start_player on its player
+ */
+static void begin_player(t_mix_cmd *cmd) {
+	int p = cmd->player;
+	if ( p == MIX_ANY_PLAYER) {
+		for ( p = MIX_PLAYERS - 1; p >= 0 && players[p].song; p--) {
+		}
+		if ( p < 0) {
+			ESP_LOGE(TAG, "no free player for %s", cmd->song->filepath);
+			midi_song_close(cmd->song);
+			free(cmd->chase);
+			free(cmd->xf);
+			return;
+		}
+	}
+
+	release_player(p);
+	flush_out();
+
+	t_mix_player *pl = &players[p];
+	pl->song = cmd->song;
+	pl->xf = cmd->xf;
+
+	int reset = nheap == 0;
+	if ( reset) {
+		// nobody else is playing
+		reset_synth();
+		budget = MIX_BUDGET_MAX;
+		budget_time = hal_time_us();
+	}
+
+	pl->song->starttime = hal_time_us();
+	pl->song->rate = mix_rate;
+	if ( cmd->with_delay) {
+		pl->song->starttime += DELAY_MILLIES * 1000;
+	}
+
+	if ( cmd->chase) {
+		// without reset the output channels may have any state
+		pl->song->starttime -= ((int64_t) cmd->start_ms * 1000 << RATE_SHIFT) / mix_rate;
+		int bytes = chase_send(cmd->chase, !reset, pl->song, mixer_out, pl);
+		TRACE(trc_player_chase, p, bytes);
+		free(cmd->chase);
+	}
+
+	if ( player_next_due(pl->song, &pl->due)) {
+		ESP_LOGE(TAG, "player %d: nothing to play in %s", p, pl->song->filepath);
+		release_player(p);
+		return;
+	}
+	if ( cmd->wall_us) {
+		// corrected when it's due, see align_start
+		int64_t shift = wall_to_time_us(cmd->wall_us) - pl->due;
+		pl->song->starttime += shift;
+		pl->due += shift - MIX_ALIGN_US;
+		pl->wall_start = cmd->wall_us;
+		pl->aligning = true;
+	}
+	heap_push(p);
+	status_set(p, pl->song);
+	pl->first_out = true;
+	TRACE(trc_player_start, p, cmd->start_ms);
+}
+
+static void apply_stop(t_mix_cmd *cmd) {
+	for ( int p = 0; p < MIX_PLAYERS; p++) {
+		if ( cmd->player == MIX_ANY_PLAYER || cmd->player == p) {
+			release_player(p);
+		}
+	}
+	if ( cmd->reset) {
+		reset_synth();
+	}
+	flush_out();
+	blink(hal_time_us());
+}
+
+/**
+ * the running songs go on from where they are. Songs waiting for a
+ * wall clock start keep their time
+ */
+static void apply_rate(t_mix_cmd *cmd) {
+	int64_t now = hal_time_us();
+	mix_rate = cmd->rate;
+	for ( int i = 0; i < nheap; i++) {
+		t_mix_player *pl = &players[heap[i]];
+		if ( pl->wall_start) {
+			continue;
+		}
+		player_set_rate(pl->song, mix_rate, now);
+		player_next_due(pl->song, &pl->due);
+	}
+	// the order stays the same unless a sysex is streamed
+	for ( int i = nheap / 2 - 1; i >= 0; i--) {
+		heap_down(i);
+	}
+	TRACE(trc_mixer_rate, mix_rate * 100 >> RATE_SHIFT, nheap);
+}
+
+/**
+ * swaps the transform tables if the player still plays the song they
+ * were compiled for, the notes sounding are switched off
+ */
+static void apply_xform(t_mix_cmd *cmd) {
+	t_mix_player *pl = &players[cmd->player];
+	t_xform *old = cmd->xf;
+
+	if ( pl->song && (cmd->xf || pl->xf)) {
+		const char *name = strrchr(pl->song->filepath, '/');
+		if ( !strcmp(name ? name + 1 : pl->song->filepath, cmd->file)) {
+			old = pl->xf;
+			pl->xf = cmd->xf;
+			notes_off(pl);
+			flush_out();
+		}
+	}
+	free(old);
+}
+
+/**
+ * applies the commands queued since the last tick
+ */
+static void apply_commands() {
+	t_mix_cmd cmd;
+	while ( queue_pop(&cmd_queue, &cmd) == 0) {
+		switch ( cmd.cmd) {
+		case mix_cmd_play:
+			begin_player(&cmd);
+			break;
+		case mix_cmd_stop:
+			apply_stop(&cmd);
+			break;
+		case mix_cmd_rate:
+			apply_rate(&cmd);
+			break;
+		case mix_cmd_xform:
+			apply_xform(&cmd);
+			break;
+		case mix_cmd_reset:
+			reset_synth();
+			flush_out();
+			break;
+		}
+	}
+}
+
+static void mixer_timer_callback(void* arg) {
+	apply_commands();
+	int playing = nheap > 0;
+	int64_t now = hal_time_us();
+
+	refill_budget(now);
+	drain_wire(now);
+
+	int p;
+	uint32_t firsts = 0;
+	if ( (p = next_player()) >= 0 && players[p].due <= now + MIX_SLACK_US) {
+		// not when woken for a command
+		TRACE(trc_mixer_tick, nheap, now - players[p].due);
+		timing_add(now - players[p].due);
+	}
+	while ( (p = next_player()) >= 0 && players[p].due <= now + MIX_SLACK_US) {
+		t_mix_player *pl = &players[p];
+		if ( pl->wall_start && align_start(p, now)) {
+			continue;
+		}
+
+		player_process(pl->song, now + MIX_SLACK_US, mixer_out, pl);
+		sysex_player = pl->song->sysex_trck ? p : -1;
+		if ( pl->first_out) {
+			pl->first_out = false;
+			firsts |= 1 << p;
+		}
+
+		if ( player_next_due(pl->song, &pl->due)) {
+			TRACE(trc_song_decoded, pl->song->nevents, pl->song->read_us);
+			release_player(p);
+		} else {
+			heap_down(heappos[p]);
+		}
+	}
+	int len = outlen;
+	flush_out();
+	for ( p = 0; firsts; p++, firsts >>= 1) {
+		if ( firsts & 1) {
+			TRACE(trc_player_first_out, p, len);
+		}
+	}
+
+	blink(now);
+	if ( playing && nheap == 0) {
+		TRACE(trc_mixer_idle, mix_events, mix_dropped);
+	}
+
+	mixer_arm();
+}
+
+/**
+ * queues a channel message for the wire and wakes the mixer, from any
+ * task. 'received' is the time of its last byte for MIDI thru, -1 for
+ * the others. Returns -1 if the queue is full
+ */
+int mixer_send(const unsigned char *msg, int len, int64_t received) {
+	t_mix_msg m = { .received = received, .len = len };
+	memcpy(m.msg, msg, len);
+	if ( queue_push(&wire_queue, &m)) {
+		return -1;
+	}
+	hal_timer_wake(mixer_timer, 0);
+	return 0;
+}
+
+/**
+ * copies the status without locking, the counters are single words.
+ * Returns -1 if the mixer kept changing it
+ */
+int mixer_get_status(t_mixer_status *st) {
+	if ( seq_read(&status_seq, st->player, status.player, sizeof(st->player))) {
+		return -1;
+	}
+	st->events = mix_events;
+	st->dropped = mix_dropped;
+	st->queued = nheap;
+	return 0;
+}
+
+/**
+ * the wake-up lateness since the last clear
+ */
+void mixer_get_timing(t_mixer_timing *t, int clear) {
+	if ( __atomic_load_n(&timing_clear, __ATOMIC_ACQUIRE)
+			|| seq_read(&timing_seq, t, &timing, sizeof(timing))) {
+		// cleared and not woken since, or changing all the time
+		memset(t, 0, sizeof(*t));
+	}
+	if ( clear) {
+		__atomic_store_n(&timing_clear, true, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * once at startup by midi_init, before anything plays
+ */
+void mixer_init() {
+	for ( int p = 0; p < MIX_PLAYERS; p++) {
+		heappos[p] = -1;
+		memset(players[p].chmap, MIX_NO_CHANNEL, sizeof(players[p].chmap));
+	}
+	mixer_timer = hal_timer_create_play(&mixer_timer_callback, NULL, "midi_mixer");
+}
+
+/**
+ * skips the beginning of a song, the program and controller changes
+ * of the skipped part are collected. Returns NULL if failed
+ */
+static t_chase *mixer_seek(t_midi_song *song, long start_ms) {
+	t_chase *chase = calloc(1, sizeof(t_chase));
+	if ( !chase) {
+		ESP_LOGE(TAG, "%s: no memory for chase", song->filepath);
+		return NULL;
+	}
+	chase_init(chase);
+	long skipped = player_seek(song, (int64_t) start_ms * 1000, chase);
+	ESP_LOGI(TAG, "%s: start at %ld ms, %ld events skipped", song->filepath, start_ms, skipped);
+	return chase;
+}
+
+/**
+ * puts a command into the queue and wakes the mixer,
+ * returns -1 if the queue is full
+ */
+static int cmd_send(const t_mix_cmd *cmd) {
+	if ( queue_push(&cmd_queue, cmd)) {
+		ESP_LOGE(TAG, "too many commands, command %d for player %d dropped", cmd->cmd, cmd->player);
+		return -1;
+	}
+	hal_timer_wake(mixer_timer, 0);
+	return 0;
+}
+
+/**
+ * start a song on a player at start_ms, a song running there is stopped.
+ * With 'wall_us' the first event is played at this wall clock time.
+ * Songs on other players are not affected. The song is opened here,
+ * the others are playing meanwhile, the mixer starts it with its next tick
+ */
+static int start_player(int p, const char *filename, int with_delay, long start_ms, int64_t wall_us) {
+	if ( p != MIX_ANY_PLAYER && (p < 0 || p >= MIX_PLAYERS)) {
+		ESP_LOGE(TAG, "no player %d", p);
+		return -1;
+	}
+	t_midi_song *song = midi_song_open(filename);
+	if ( !song) {
+		return -1;
+	}
+	t_mix_cmd cmd = { .cmd = mix_cmd_play, .player = p, .song = song,
+			.start_ms = start_ms, .with_delay = with_delay, .wall_us = wall_us };
+	int64_t due;
+	do {
+		if ( start_ms > 0 && !(cmd.chase = mixer_seek(song, start_ms))) {
+			break;
+		}
+		if ( player_next_due(song, &due)) {
+			ESP_LOGE(TAG, "player %d: nothing to play in %s", p, filename);
+			break;
+		}
+		cmd.xf = xform_compile(filename);
+		if ( cmd_send(&cmd)) {
+			break;
+		}
+		ESP_LOGI(TAG, "player %d: starting %s %s", p, filename, (with_delay ? "with_delay" : ""));
+		return 0;
+	} while(0);
+
+	midi_song_close(song);
+	free(cmd.chase);
+	free(cmd.xf);
+	return -1;
+}
+
+int mixer_play(int p, const char *filename, int with_delay, long start_ms) {
+	if ( p == MIX_ANY_PLAYER) {
+		return -1;
+	}
+	return start_player(p, filename, with_delay, start_ms, 0);
+}
+
+/**
+ * start a song on a player, its first event at the wall clock time 'wall_us'
+ * (µs since the epoch). Open and decode take a while, call it ahead of time
+ */
+int mixer_play_at(int p, const char *filename, int64_t wall_us) {
+	if ( wall_us <= 0 || p == MIX_ANY_PLAYER) {
+		return -1;
+	}
+	return start_player(p, filename, false, 0, wall_us);
+}
+
+int mixer_stop(int p) {
+	if ( p < 0 || p >= MIX_PLAYERS) {
+		return -1;
+	}
+	t_mix_cmd cmd = { .cmd = mix_cmd_stop, .player = p };
+	return cmd_send(&cmd);
+}
+
+/**
+ * compiles the transform rules again for the running songs, the mixer
+ * swaps the tables and switches the notes sounding off
+ */
+void mixer_xform_update() {
+	t_mixer_status st;
+	if ( mixer_get_status(&st)) {
+		return;
+	}
+	for ( int p = 0; p < MIX_PLAYERS; p++) {
+		if ( !st.player[p].file[0]) {
+			continue;
+		}
+		// the song may end meanwhile, the mixer checks it
+		t_mix_cmd cmd = { .cmd = mix_cmd_xform, .player = p, .xf = xform_compile(st.player[p].file) };
+		snprintf(cmd.file, sizeof(cmd.file), "%s", st.player[p].file);
+		if ( cmd_send(&cmd)) {
+			free(cmd.xf);
+		}
+	}
+}
+
+/**
+ * sets the playback rate of all songs, the running ones go on from
+ * where they are. Songs waiting for a wall clock start keep theirs.
+ * Returns -1 if the rate is out of range
+ */
+int mixer_set_rate(long rate) {
+	if ( rate < RATE_MIN || rate > RATE_MAX) {
+		ESP_LOGE(TAG, "rate %ld out of range", rate);
+		return -1;
+	}
+	t_mix_cmd cmd = { .cmd = mix_cmd_rate, .rate = rate };
+	if ( cmd_send(&cmd)) {
+		return -1;
+	}
+	__atomic_store_n(&mix_rate_set, rate, __ATOMIC_RELAXED);
+	ESP_LOGI(TAG, "rate %ld.%02ld", rate >> RATE_SHIFT, (rate & (RATE_ONE - 1)) * 100 >> RATE_SHIFT);
+	return 0;
+}
+
+/**
+ * the rate set last, the mixer may not have applied it yet
+ */
+long mixer_get_rate() {
+	return __atomic_load_n(&mix_rate_set, __ATOMIC_RELAXED);
+}
+
+/**
+ * play a song on the main player
+ */
+int handle_play_midifile(const char *filename , int with_delay, long start_ms) {
+	return mixer_play(MIX_MAIN_PLAYER, filename, with_delay, start_ms);
+}
+
+/**
+ * play a song additionally to the running ones, the mixer takes
+ * a free player when it starts the song
+ */
+int handle_mix_midifile(const char *filename , int with_delay, long start_ms) {
+	t_mixer_status st;
+	int p = MIX_PLAYERS - 1;
+	if ( mixer_get_status(&st) == 0) {
+		for ( ; p >= 0 && st.player[p].file[0]; p--) {
+		}
+	}
+	if ( p < 0) {
+		ESP_LOGE(TAG, "no free player for %s", filename);
+		return -1;
+	}
+	return start_player(MIX_ANY_PLAYER, filename, with_delay, start_ms, 0);
+}
+
+/**
+ * resets the synth, after the songs of the next tick
+ */
+void midi_reset() {
+	t_mix_cmd cmd = { .cmd = mix_cmd_reset };
+	cmd_send(&cmd);
+}
+
+/**
+ * stops all players and resets the synth
+ */
+int handle_stop_midifile() {
+	t_mix_cmd cmd = { .cmd = mix_cmd_stop, .player = MIX_ANY_PLAYER, .reset = true };
+	return cmd_send(&cmd);
+}
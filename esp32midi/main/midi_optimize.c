@@ -0,0 +1,393 @@
+/*
+ * midi_optimize.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * optimizer for midi files, the result is a smaller midi file (format 0)
+ * playing the same:
+ *  - all tracks are merged into one, meta events except tempo are removed
+ *  - state changes without effect are dropped: a program change, controller,
+ *    pitch bend or channel pressure repeating the value sent before on the
+ *    channel. A program change after a bank select is always kept
+ *  - dense curves of continuous controllers, pitch bend and channel pressure
+ *    are thinned: a value is dropped if it's within the tolerance of the
+ *    value sent before (pitch bend in steps of 128). Rest values (0, 127,
+ *    pitch bend center) are always sent, so a curve ends where it should
+ *  - events are written with minimal delta times and running status, a
+ *    note off with the default velocity 64 becomes a note on with velocity 0
+ *
+ * Times don't change, the song ends with the last event of the original.
+ * After a sysex or a reset all controllers the state is unknown again.
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_optimize";
+
+#define OPT_UNKNOWN -1
+
+typedef struct {
+	FILE *fd;
+	long len; // track data written
+	unsigned char running;
+	// last values sent per channel, OPT_UNKNOWN if not known
+	short program[16];
+	unsigned char bank_sent[16]; // bank select since the last program change
+	short cc[16][128];
+	long bend[16];
+	short pressure[16];
+	long tempo;
+	// statistics
+	long events;
+	long metas;
+	long redundant;
+	long thinned;
+	long wire;
+} t_optimizer;
+
+static void opt_forget(t_optimizer *opt) {
+	for ( int ch = 0; ch < 16; ch++) {
+		opt->program[ch] = OPT_UNKNOWN;
+		opt->bank_sent[ch] = false;
+		opt->bend[ch] = OPT_UNKNOWN;
+		opt->pressure[ch] = OPT_UNKNOWN;
+		for ( int c = 0; c < 128; c++) {
+			opt->cc[ch][c] = OPT_UNKNOWN;
+		}
+	}
+}
+
+static void opt_put(t_optimizer *opt, unsigned char c) {
+	fputc(c, opt->fd);
+	opt->len++;
+}
+
+static void opt_put_vlq(t_optimizer *opt, unsigned long val) {
+	unsigned char tmp[5];
+	int n = 0;
+	do {
+		tmp[n++] = val & 0x7F;
+		val >>= 7;
+	} while ( val);
+	while ( n > 1) {
+		opt_put(opt, tmp[--n] | 0x80);
+	}
+	opt_put(opt, tmp[0]);
+}
+
+static void write_long(FILE *fd, unsigned long val, int n) {
+	while ( n-- > 0) {
+		fputc((val >> (8*n)) & 0xFF, fd);
+	}
+}
+
+/**
+ * controllers with a value to hold, others act when they're sent
+ * (data entry, RPN, channel mode messages)
+ */
+static int is_state_cc(int c) {
+	return c < 96 && c != 6 && c != 38;
+}
+
+/**
+ * controllers moved continuously, switches and bank select are not thinned
+ */
+static int is_continuous_cc(int c) {
+	return (c < 64 && is_state_cc(c) && c != 0 && c != 32) || (c >= 70 && c < 96);
+}
+
+/**
+ * true if the value is new or, for continuous values, further away than
+ * the tolerance from the last value sent
+ */
+static int opt_value_changed(t_optimizer *opt, long last, long value, long tolerance, long max, long rest) {
+	if ( value == last) {
+		opt->redundant++;
+		return false;
+	}
+	if ( tolerance > 0 && last != OPT_UNKNOWN && labs(value - last) <= tolerance
+			&& value != 0 && value != max && value != rest) {
+		opt->thinned++;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * decides on a channel event, false if it's dropped
+ */
+static int opt_keep(t_optimizer *opt, const t_midi_evt *evt, int tolerance) {
+	int ch = evt->event & 0x0F;
+	int d0 = evt->data[0] & 0x7F;
+	int d1 = evt->datalen > 1 ? evt->data[1] & 0x7F : 0;
+
+	switch ( evt->event & 0xF0) {
+	case 0xB0:
+		if ( !is_state_cc(d0)) {
+			if ( d0 == 121) {
+				// reset all controllers
+				for ( int c = 0; c < 128; c++) {
+					opt->cc[ch][c] = OPT_UNKNOWN;
+				}
+				opt->bend[ch] = OPT_UNKNOWN;
+				opt->pressure[ch] = OPT_UNKNOWN;
+			}
+			return true;
+		}
+		if ( !opt_value_changed(opt, opt->cc[ch][d0], d1,
+				is_continuous_cc(d0) ? tolerance : 0, 127, OPT_UNKNOWN)) {
+			return false;
+		}
+		opt->cc[ch][d0] = d1;
+		if ( d0 < 32) {
+			// the synth may reset the fine value
+			opt->cc[ch][d0 + 32] = OPT_UNKNOWN;
+		}
+		if ( d0 == 0 || d0 == 32) {
+			opt->bank_sent[ch] = true;
+		}
+		return true;
+	case 0xC0:
+		if ( opt->program[ch] == d0 && !opt->bank_sent[ch]) {
+			opt->redundant++;
+			return false;
+		}
+		opt->program[ch] = d0;
+		opt->bank_sent[ch] = false;
+		return true;
+	case 0xD0:
+		if ( !opt_value_changed(opt, opt->pressure[ch], d0, tolerance, 127, OPT_UNKNOWN)) {
+			return false;
+		}
+		opt->pressure[ch] = d0;
+		return true;
+	case 0xE0: {
+		long bend = d0 | (d1 << 7);
+		if ( !opt_value_changed(opt, opt->bend[ch], bend, (long) tolerance << 7, 0x3FFF, 0x2000)) {
+			return false;
+		}
+		opt->bend[ch] = bend;
+		return true;
+	}
+	}
+	return true; // notes, poly pressure
+}
+
+/**
+ * writes a channel event with running status
+ */
+static void opt_put_channel_event(t_optimizer *opt, const t_midi_evt *evt) {
+	unsigned char event = evt->event;
+	unsigned char vel = evt->datalen > 1 ? evt->data[1] : 0;
+
+	if ( (event & 0xF0) == 0x80 && vel == 0x40 && opt->running == (0x90 | (event & 0x0F))) {
+		// same as note on with velocity 0
+		event = opt->running;
+		vel = 0;
+	}
+	if ( event != opt->running) {
+		opt_put(opt, event);
+		opt->running = event;
+	}
+	opt_put(opt, evt->data[0]);
+	if ( evt->datalen > 1) {
+		opt_put(opt, vel);
+	}
+}
+
+/**
+ * reads all events of a song, returns the number of events and the
+ * bytes sent to the wire
+ */
+static long count_events(const char *filepath, long *wire) {
+	t_midi_song *song = midi_song_open(filepath);
+	t_midi_track *trck;
+	if ( !song) {
+		return -1;
+	}
+	long n = 0;
+	*wire = 0;
+	while ( (trck = midi_song_next_event(song))) {
+		t_midi_evt *evt = &(trck->evt);
+		if ( evt->event == 0xF0) {
+			*wire += 1 + evt->sysex_len;
+		} else if ( evt->event == 0xF7) {
+			*wire += evt->sysex_len;
+		} else if ( evt->event != 0xFF) {
+			*wire += 1 + evt->datalen;
+		}
+		n++;
+	}
+	midi_song_close(song);
+	return n;
+}
+
+/**
+ * converts a midi file into an optimized one, tolerance for thinning
+ * controller curves, 0 drops only repeated values
+ */
+int optimize_midifile(const char *srcpath, const char *dstpath, int tolerance, char *report, size_t reportlen) {
+	struct stat file_stat;
+	t_midi_song *song = NULL;
+	t_optimizer *opt = NULL;
+	FILE *fd = NULL;
+	int rc = -1;
+
+	snprintf(report, reportlen, "optimizing %s failed", srcpath);
+
+	do {
+		if ( stat(srcpath, &file_stat) == -1) {
+			ESP_LOGE(TAG, "Failed to stat file : %s", srcpath);
+			break;
+		}
+		if ( !(song = midi_song_open(srcpath))) {
+			break;
+		}
+		if ( song->compact || song->format == 2) {
+			ESP_LOGE(TAG, "%s: format not supported for optimizing", srcpath);
+			snprintf(report, reportlen, "%s: format not supported", srcpath);
+			break;
+		}
+		if ( !(opt = calloc(1, sizeof(t_optimizer)))) {
+			ESP_LOGE(TAG, "no memory for optimizer");
+			break;
+		}
+		opt_forget(opt);
+		opt->tempo = OPT_UNKNOWN;
+		if ( !(fd = fopen(dstpath, "w"))) {
+			ESP_LOGE(TAG, "Failed to create file : %s", dstpath);
+			break;
+		}
+		opt->fd = fd;
+
+		// header, the track length is written when it's known
+		fwrite("MThd", 1, 4, fd);
+		write_long(fd, 6, 4);
+		write_long(fd, 0, 2);
+		write_long(fd, 1, 2);
+		write_long(fd, song->tpq, 2);
+		fwrite("MTrk", 1, 4, fd);
+		write_long(fd, 0, 4);
+
+		long last_ticks = 0;
+		long end_ticks = 0;
+		t_midi_track *trck;
+		while ( (trck = midi_song_next_event(song))) {
+			t_midi_evt *evt = &(trck->evt);
+			long ticks = evt->evt_ticks / TICKFACTOR;
+			end_ticks = ticks;
+
+			if ( evt->event == 0xFF) {
+				long tempo = evt->datalen == 3 ? ((evt->data[0] & 0xFF) << 16)
+						| ((evt->data[1] & 0xFF) << 8) | (evt->data[2] & 0xFF) : OPT_UNKNOWN;
+				if ( evt->metaevent != 0x51 || tempo == OPT_UNKNOWN) {
+					opt->metas++; // text, end of track etc.
+					continue;
+				}
+				if ( tempo == opt->tempo) {
+					opt->redundant++;
+					continue;
+				}
+				opt->tempo = tempo;
+				opt_put_vlq(opt, ticks - last_ticks);
+				opt_put(opt, 0xFF);
+				opt_put(opt, 0x51);
+				opt_put_vlq(opt, 3);
+				for ( int i = 0; i < 3; i++) {
+					opt_put(opt, evt->data[i]);
+				}
+				opt->running = 0;
+			} else if ( (evt->event & 0xF0) == 0xF0) {
+				// sysex, data as in file. Continuation events are taken
+				// from the same track, the merged track has no gaps in between
+				int open = evt->event == 0xF0;
+				opt_put_vlq(opt, ticks - last_ticks);
+				opt->wire += open;
+				for (;;) {
+					opt_put(opt, evt->event);
+					opt_put_vlq(opt, evt->sysex_len);
+					opt->wire += evt->sysex_len;
+					opt->events++;
+					char chunk[SYSEX_CHUNK];
+					int n, last = 0;
+					while ( (n = midi_song_read_sysex(song, trck, chunk, sizeof(chunk))) > 0) {
+						for ( int i = 0; i < n; i++) {
+							opt_put(opt, chunk[i]);
+						}
+						last = (unsigned char) chunk[n-1];
+					}
+					if ( !open || last == 0xF7 || !midi_song_sysex_continues(song, trck)) {
+						break;
+					}
+					// consumed here
+					evt->status = need_event;
+					opt_put_vlq(opt, 0);
+				}
+				// a reset may be part of it
+				opt_forget(opt);
+				opt->running = 0;
+				last_ticks = ticks;
+				continue; // evt may hold the next event of the track
+			} else if ( evt->datalen > 0 && opt_keep(opt, evt, tolerance)) {
+				opt_put_vlq(opt, ticks - last_ticks);
+				opt_put_channel_event(opt, evt);
+				opt->wire += 1 + evt->datalen;
+			} else {
+				continue;
+			}
+			last_ticks = ticks;
+			opt->events++;
+		}
+
+		// end of track, the song is as long as before
+		opt_put_vlq(opt, end_ticks - last_ticks);
+		opt_put(opt, 0xFF);
+		opt_put(opt, 0x2F);
+		opt_put(opt, 0x00);
+
+		fseek(fd, 18, SEEK_SET);
+		write_long(fd, opt->len, 4);
+
+		if ( ferror(fd)) {
+			ESP_LOGE(TAG, "File write failed : %s", dstpath);
+			break;
+		}
+		fclose(fd);
+		fd = NULL;
+
+		// read both back, the wire bytes of the original are counted there
+		long src_wire = 0, dst_wire = 0;
+		long src_events = count_events(srcpath, &src_wire);
+		long dst_events = count_events(dstpath, &dst_wire);
+		if ( dst_events != opt->events || dst_wire != opt->wire) {
+			ESP_LOGE(TAG, "%s: verify failed, %ld events expected, got %ld", dstpath, opt->events, dst_events);
+			break;
+		}
+
+		long outlen = 22 + opt->len;
+		snprintf(report, reportlen,
+				"%s: %ld -> %ld bytes (%ld%%), %ld -> %ld events, wire %ld -> %ld bytes (%ld%%); "
+				"removed %ld meta, %ld redundant, %ld thinned (tolerance %d)",
+				dstpath, (long) file_stat.st_size, outlen,
+				file_stat.st_size > 0 ? 100 - outlen * 100 / (long) file_stat.st_size : 0,
+				src_events, dst_events, src_wire, dst_wire,
+				src_wire > 0 ? 100 - dst_wire * 100 / src_wire : 0,
+				opt->metas, opt->redundant, opt->thinned, tolerance);
+		ESP_LOGI(TAG, "%s", report);
+		rc = 0;
+	} while (0);
+
+	if ( fd) {
+		fclose(fd);
+	}
+	if ( rc) {
+		unlink(dstpath);
+	}
+	if ( opt) {
+		free(opt);
+	}
+	midi_song_close(song);
+
+	return rc;
+}
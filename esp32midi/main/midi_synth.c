@@ -0,0 +1,465 @@
+/*
+ * midi_synth.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * small wavetable synthesizer, a replacement of the SAM2695 for
+ * previews and regression tests. It reads the same bytes as the
+ * midi wire and renders 16 bit mono PCM.
+ *
+ * Only integer arithmetic: 32 bit phase accumulators, tables with
+ * linear interpolation, envelopes updated once per block of
+ * SYNTH_BLOCK samples. The inner loop has no branches, so the
+ * compiler may vectorize it.
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_synth";
+
+#define TBL_BITS 8
+#define TBL_LEN (1 << TBL_BITS)
+#define ENV_MAX (1 << 30)
+#define ENV_OFF (1 << 18) // about -72 dB
+#define SYNTH_HEADROOM 2 // sum of voices is divided by 4
+
+enum WAVE { wave_sine, wave_soft, wave_saw, wave_square, wave_noise, wave_count };
+
+enum ENV_STATE { env_idle, env_attack, env_decay, env_release };
+
+// sound of a GM instrument family
+typedef struct {
+	unsigned char wave;
+	unsigned char attack; // blocks to full level
+	unsigned char decay_shift; // level decreases by level >> decay_shift per block
+	unsigned char release_shift;
+	int sustain; // level where the decay stops, 0: decays to silence
+} t_synth_sound;
+
+typedef struct {
+	int state;
+	unsigned char chan;
+	unsigned char note;
+	unsigned char sustained; // note off received while the pedal is down
+	const int16_t *table;
+	const t_synth_sound *sound;
+	uint32_t phase;
+	uint32_t basestep; // phase step without pitch bend
+	uint32_t step;
+	int32_t env;
+	int32_t gain; // velocity, Q7
+	int32_t amp; // amplitude at the end of the last block, Q15
+	unsigned long age;
+} t_synth_voice;
+
+typedef struct {
+	unsigned char program;
+	unsigned char volume;
+	unsigned char expression;
+	unsigned char sustain;
+	int bend; // -8192..8191
+	uint32_t bend_ratio; // Q16
+} t_synth_channel;
+
+static int16_t tables[wave_count][TBL_LEN + 1]; // last entry repeats the first one
+static uint32_t octave_step[12]; // phase steps of notes 120..131
+static t_synth_voice voices[SYNTH_VOICES];
+static t_synth_channel channels[16];
+static int32_t acc[SYNTH_BLOCK];
+static unsigned long voice_age = 0;
+static int synth_rate = 0;
+
+// parser
+static unsigned char running = 0;
+static unsigned char msg[2];
+static int msglen = 0;
+
+// frequencies of notes 120..131 in 1/100 Hz, lower notes are shifted by octaves
+static const uint32_t top_octave_centihz[12] = {
+		837202, 886984, 939727, 995606, 1054808, 1117530,
+		1183982, 1254385, 1328975, 1408000, 1491724, 1580427
+};
+
+// pitch bend ratios, -2..+2 semitones in 32 steps, Q16
+static const uint32_t bend_table[33] = {
+		58386, 58809, 59235, 59664, 60097, 60532, 60971, 61413,
+		61858, 62306, 62757, 63212, 63670, 64132, 64596, 65065,
+		65536, 66011, 66489, 66971, 67456, 67945, 68438, 68933,
+		69433, 69936, 70443, 70953, 71468, 71985, 72507, 73032,
+		73562
+};
+
+// sounds of the 16 GM families, program / 8
+static const t_synth_sound family_sounds[16] = {
+		{ wave_soft,   1, 10, 6, 0 },              // piano
+		{ wave_sine,   1,  9, 6, 0 },              // chromatic percussion
+		{ wave_square, 2, 0,  5, ENV_MAX },        // organ
+		{ wave_saw,    1, 10, 6, 0 },              // guitar
+		{ wave_soft,   1, 11, 5, 0 },              // bass
+		{ wave_saw,    8, 0,  7, ENV_MAX },        // strings
+		{ wave_saw,    8, 0,  7, ENV_MAX },        // ensemble
+		{ wave_saw,    4, 12, 6, ENV_MAX / 4 * 3 },// brass
+		{ wave_square, 4, 12, 6, ENV_MAX / 4 * 3 },// reed
+		{ wave_sine,   4, 0,  6, ENV_MAX },        // pipe
+		{ wave_square, 1, 12, 5, ENV_MAX / 2 },    // synth lead
+		{ wave_soft,  16, 0,  8, ENV_MAX },        // synth pad
+		{ wave_soft,   8, 12, 8, ENV_MAX / 2 },    // synth effects
+		{ wave_saw,    1, 10, 6, 0 },              // ethnic
+		{ wave_sine,   1,  8, 5, 0 },              // percussive
+		{ wave_noise,  1, 10, 6, 0 }               // sound effects
+};
+
+// channel 10
+static const t_synth_sound drum_sound = { wave_noise, 1, 7, 5, 0 };
+
+/**
+ * sine by Bhaskara's approximation, no floating point needed
+ */
+static int16_t sine_value(int i) {
+	int half = i & (TBL_LEN/2 - 1);
+	int32_t p = half * (TBL_LEN/2 - half); // max. 4096
+	int32_t v = 32767 * 16 * p / (5 * (TBL_LEN/2) * (TBL_LEN/2) - 4 * p);
+	return i < TBL_LEN/2 ? v : -v;
+}
+
+static void init_tables() {
+	uint32_t rnd = 0x12345678;
+	for ( int i = 0; i < TBL_LEN; i++) {
+		tables[wave_sine][i] = sine_value(i);
+		// triangle
+		int t = i < TBL_LEN/2 ? i : TBL_LEN - i;
+		tables[wave_soft][i] = (t - TBL_LEN/4) * 32767 / (TBL_LEN/4);
+		tables[wave_saw][i] = (i - TBL_LEN/2) * 32767 / (TBL_LEN/2);
+		tables[wave_square][i] = i < TBL_LEN/2 ? 16000 : -16000;
+		rnd = rnd * 1103515245 + 12345;
+		tables[wave_noise][i] = (int16_t) (rnd >> 16);
+	}
+	for ( int w = 0; w < wave_count; w++) {
+		tables[w][TBL_LEN] = tables[w][0];
+	}
+}
+
+static uint32_t note_step(int note) {
+	return octave_step[note % 12] >> (10 - note / 12);
+}
+
+static uint32_t bend_ratio(int bend) {
+	int b = bend + 8192;
+	int i = b >> 9;
+	int frac = b & 511;
+	return bend_table[i] + (((int32_t) (bend_table[i+1] - bend_table[i]) * frac) >> 9);
+}
+
+static void reset_channel(t_synth_channel *ch) {
+	ch->volume = 100;
+	ch->expression = 127;
+	ch->sustain = false;
+	ch->bend = 0;
+	ch->bend_ratio = 1 << 16;
+}
+
+void synth_reset() {
+	memset(voices, 0, sizeof(voices));
+	for ( int c = 0; c < 16; c++) {
+		channels[c].program = 0;
+		reset_channel(&channels[c]);
+	}
+	running = 0;
+	msglen = 0;
+}
+
+void synth_init(int rate) {
+	synth_rate = rate;
+	init_tables();
+	for ( int i = 0; i < 12; i++) {
+		octave_step[i] = (((uint64_t) top_octave_centihz[i]) << 32) / ((uint64_t) rate * 100);
+	}
+	synth_reset();
+	ESP_LOGI(TAG, "synthesizer initialized, %d Hz, %d voices", rate, SYNTH_VOICES);
+}
+
+/**
+ * a free voice, else the oldest released one, else the oldest one
+ */
+static t_synth_voice *alloc_voice() {
+	t_synth_voice *oldest = NULL;
+	t_synth_voice *released = NULL;
+	for ( int i = 0; i < SYNTH_VOICES; i++) {
+		t_synth_voice *v = &voices[i];
+		if ( v->state == env_idle) {
+			return v;
+		}
+		if ( v->state == env_release && (!released || v->age < released->age)) {
+			released = v;
+		}
+		if ( !oldest || v->age < oldest->age) {
+			oldest = v;
+		}
+	}
+	return released ? released : oldest;
+}
+
+static void release_voice(t_synth_voice *v) {
+	if ( v->state != env_idle) {
+		v->state = env_release;
+	}
+	v->sustained = false;
+}
+
+static void note_on(int chan, int note, int velocity) {
+	t_synth_channel *ch = &channels[chan];
+	t_synth_voice *v = alloc_voice();
+
+	v->state = env_attack;
+	v->chan = chan;
+	v->note = note;
+	v->sustained = false;
+	v->sound = chan == 9 ? &drum_sound : &family_sounds[ch->program >> 3];
+	v->table = tables[v->sound->wave];
+	v->phase = 0;
+	v->basestep = note_step(note);
+	v->step = ((uint64_t) v->basestep * ch->bend_ratio) >> 16;
+	v->env = 0;
+	v->gain = velocity;
+	v->amp = 0;
+	v->age = ++voice_age;
+}
+
+static void note_off(int chan, int note) {
+	if ( chan == 9) {
+		return; // drums decay by themselves
+	}
+	for ( int i = 0; i < SYNTH_VOICES; i++) {
+		t_synth_voice *v = &voices[i];
+		if ( v->chan == chan && v->note == note && (v->state == env_attack || v->state == env_decay) && !v->sustained) {
+			if ( channels[chan].sustain) {
+				v->sustained = true;
+			} else {
+				release_voice(v);
+			}
+			return;
+		}
+	}
+}
+
+static void channel_voices(int chan, int kill) {
+	for ( int i = 0; i < SYNTH_VOICES; i++) {
+		t_synth_voice *v = &voices[i];
+		if ( v->chan != chan || v->state == env_idle) {
+			continue;
+		}
+		if ( kill) {
+			v->state = env_idle;
+		} else {
+			release_voice(v);
+		}
+	}
+}
+
+static void control_change(int chan, int ctrl, int value) {
+	t_synth_channel *ch = &channels[chan];
+	switch (ctrl) {
+	case 7:
+		ch->volume = value;
+		break;
+	case 11:
+		ch->expression = value;
+		break;
+	case 64:
+		ch->sustain = value >= 64;
+		if ( !ch->sustain) {
+			// release the notes held by the pedal
+			for ( int i = 0; i < SYNTH_VOICES; i++) {
+				if ( voices[i].chan == chan && voices[i].sustained) {
+					release_voice(&voices[i]);
+				}
+			}
+		}
+		break;
+	case 120: // all sound off
+		channel_voices(chan, true);
+		break;
+	case 121: // reset all controllers
+		reset_channel(ch);
+		break;
+	case 123: // all notes off
+		channel_voices(chan, false);
+		break;
+	default:
+		break;
+	}
+}
+
+static void pitch_bend(int chan, int bend) {
+	t_synth_channel *ch = &channels[chan];
+	ch->bend = bend;
+	ch->bend_ratio = bend_ratio(bend);
+	for ( int i = 0; i < SYNTH_VOICES; i++) {
+		t_synth_voice *v = &voices[i];
+		if ( v->chan == chan && v->state != env_idle) {
+			v->step = ((uint64_t) v->basestep * ch->bend_ratio) >> 16;
+		}
+	}
+}
+
+static void channel_message(unsigned char status, unsigned char d1, unsigned char d2) {
+	int chan = status & 0x0F;
+	switch (status & 0xF0) {
+	case 0x80:
+		note_off(chan, d1);
+		break;
+	case 0x90:
+		if ( d2 == 0) {
+			note_off(chan, d1);
+		} else {
+			note_on(chan, d1, d2);
+		}
+		break;
+	case 0xB0:
+		control_change(chan, d1, d2);
+		break;
+	case 0xC0:
+		channels[chan].program = d1;
+		break;
+	case 0xE0:
+		pitch_bend(chan, ((d2 << 7) | d1) - 8192);
+		break;
+	default:
+		// aftertouch is ignored
+		break;
+	}
+}
+
+/**
+ * feed bytes from the midi wire, running status is supported
+ */
+void synth_midi_in(const unsigned char *data, int len) {
+	for ( int i = 0; i < len; i++) {
+		unsigned char b = data[i];
+		if ( b == 0xFF) {
+			// system reset
+			synth_reset();
+			continue;
+		}
+		if ( b >= 0xF8) {
+			continue; // other realtime messages
+		}
+		if ( b >= 0xF0) {
+			// sysex and system common: data bytes are skipped until the next status
+			running = 0;
+			continue;
+		}
+		if ( b & 0x80) {
+			running = b;
+			msglen = 0;
+			continue;
+		}
+		if ( !running) {
+			continue;
+		}
+		msg[msglen++] = b;
+		int needed = ((running & 0xE0) == 0xC0) ? 1 : 2; // C0 and D0 have one byte
+		if ( msglen == needed) {
+			channel_message(running, msg[0], msg[1]);
+			msglen = 0;
+		}
+	}
+}
+
+/**
+ * envelope of a voice for the next block, returns the amplitude in Q15
+ */
+static int32_t next_amp(t_synth_voice *v) {
+	const t_synth_sound *s = v->sound;
+	switch (v->state) {
+	case env_attack:
+		v->env += ENV_MAX / s->attack;
+		if ( v->env >= ENV_MAX) {
+			v->env = ENV_MAX;
+			v->state = env_decay;
+		}
+		break;
+	case env_decay:
+		if ( s->decay_shift && v->env > s->sustain) {
+			v->env -= v->env >> s->decay_shift;
+		}
+		if ( v->env < ENV_OFF) {
+			v->state = env_idle;
+		}
+		break;
+	case env_release:
+		v->env -= v->env >> s->release_shift;
+		if ( v->env < ENV_OFF) {
+			v->state = env_idle;
+		}
+		break;
+	default:
+		break;
+	}
+	if ( v->state == env_idle) {
+		return 0;
+	}
+	t_synth_channel *ch = &channels[v->chan];
+	int32_t gain = v->gain * ch->volume * ch->expression >> 6; // Q15
+	return (int32_t) (((int64_t) (v->env >> 15) * gain) >> 15);
+}
+
+/**
+ * the mixing kernel: adds n samples of a voice to the accumulator,
+ * the amplitude moves linearly from amp to amp + n * amp_step
+ */
+static void mix_voice(int32_t *restrict out, const int16_t *restrict table, uint32_t phase, uint32_t step,
+		int32_t amp, int32_t amp_step, int n) {
+	for ( int i = 0; i < n; i++) {
+		uint32_t idx = phase >> (32 - TBL_BITS);
+		int32_t frac = (phase >> (17 - TBL_BITS)) & 0x7FFF;
+		int32_t a = table[idx];
+		int32_t s = a + (((table[idx+1] - a) * frac) >> 15);
+		out[i] += (s * (amp + amp_step * i)) >> 15;
+		phase += step;
+	}
+}
+
+static void saturate(int16_t *out, const int32_t *in, int n) {
+	for ( int i = 0; i < n; i++) {
+		int32_t s = in[i] >> SYNTH_HEADROOM;
+		out[i] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+	}
+}
+
+/**
+ * render n samples of 16 bit mono PCM
+ */
+void synth_render(int16_t *out, int n) {
+	while ( n > 0) {
+		int len = n < SYNTH_BLOCK ? n : SYNTH_BLOCK;
+		memset(acc, 0, sizeof(acc));
+		for ( int i = 0; i < SYNTH_VOICES; i++) {
+			t_synth_voice *v = &voices[i];
+			if ( v->state == env_idle) {
+				continue;
+			}
+			int32_t amp = next_amp(v);
+			mix_voice(acc, v->table, v->phase, v->step, v->amp, (amp - v->amp) / len, len);
+			v->phase += v->step * len;
+			v->amp = amp;
+		}
+		saturate(out, acc, len);
+		out += len;
+		n -= len;
+	}
+}
+
+/**
+ * number of sounding voices
+ */
+int synth_active_voices() {
+	int n = 0;
+	for ( int i = 0; i < SYNTH_VOICES; i++) {
+		if ( voices[i].state != env_idle) {
+			n++;
+		}
+	}
+	return n;
+}
@@ -5,145 +5,259 @@
  *      Author: ankrysm
  */
 
-#include <stdio.h>
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "driver/uart.h"
-#include "driver/gpio.h"
-#include "esp_timer.h"
-#include "esp_log.h"
-//#include "esp_sleep.h"
 #include "local.h"
 
-#define MIDI_TXD  (GPIO_NUM_17)
-#define MIDI_RXD  (GPIO_NUM_16)
-#define MIDI_RTS  (UART_PIN_NO_CHANGE)
-#define MIDI_CTS  (UART_PIN_NO_CHANGE)
-
-// static const char* TAG = "midi";
-
-#define BUF_SIZE (1024)
-
-static esp_timer_handle_t periodic_timer = NULL;
-
-// predefined signals
-static t_midi_data okdata[]={
-		{2,{0xC0, 14}},
-		{3,{0x90, 72, 0x40}},
-		{3,{0x90,76,0x40}},
-		{3,{ 0x90, 79,0x40}},
-		{-1,{0}} // Ende
-};
-
-static t_midi_data errdata[]={
-		{2, {0xC0, 81}},
-		{3, {0x90, 81, 0x40}},
-		{3, {0x90, 76, 0x40}},
-		{3, {0x90, 81, 0x40}},
-		{3, {0x90, 76, 0x40}},
-		{3, {0x90, 81, 0x40}},
-		{0, {0}},
-		{0, {0}},
-		{6, {0x90, 76, 00, 0x90, 81 ,00}},
-		{-1,{0}} // Ende
-};
+static const char* TAG = "midi";
+
+/*
+ * play_strikes and play_jingle are called from any task, they queue the
+ * request and wake the timer. The state of the bell and the jingle
+ * playing belongs to their timer callbacks in the play task.
+ */
+#define PLAY_REQUESTS 4
+
+static t_hal_timer periodic_timer = NULL;
+static t_hal_queue strike_queue = NULL;
+
+// bell strikes, built by the timer
+#define MAX_STRIKES 12
+#define STRIKE_US 750000 // between the strikes
+static t_midi_data strikedata[1 + 2*MAX_STRIKES + 2];
+
+typedef struct {
+	int n;
+	int64_t start; // of the first entry, 0: STRIKE_US after the request
+} t_strike_req;
 
 static int pos=0;
-static t_midi_data *data = NULL;
+static t_midi_data *data = NULL; // NULL when done
+static int64_t next_time = 0; // of the entry at pos
+static int aligned = false; // the first entry is due at a given time
 
+// the jingle playing
+static t_hal_timer jingle_timer = NULL;
+static t_hal_queue jingle_queue = NULL;
+static const t_jingle *jingle = NULL;
+static int jingle_pos = 0;
+static int64_t jingle_start = 0;
 
+/**
+ * sends channel messages, each with its status byte. The mixer is the
+ * only writer of the wire, it gets them through its queue
+ */
 void midi_out( const char *data, int len) {
-    uart_write_bytes(UART_NUM_2, data, len);
+    for ( int i = 0; i < len; ) {
+        unsigned char status = data[i];
+        int n = 1 + ((status & 0xE0) == 0xC0 ? 1 : 2); // program change, channel pressure
+        if ( status < 0x80 || status >= 0xF0 || i + n > len) {
+            ESP_LOGE(TAG, "not a channel message: %02X", status);
+            return;
+        }
+        if ( mixer_send((const unsigned char *) &data[i], n, -1)) {
+            ESP_LOGE(TAG, "wire queue full, message %02X dropped", status);
+        }
+        i += n;
+    }
 }
 
 void midi_out_evt( const char evt, const char *data, int len) {
-    uart_write_bytes(UART_NUM_2, &evt, 1);
-    uart_write_bytes(UART_NUM_2, data, len);
-}
-
-void midi_reset() {
-    char *init_sequenz = calloc(40, sizeof(char));
-    int pos=0;
-    init_sequenz[pos++]=0xFF; //Midi-Reset
-    for ( int i=0xC0; i <= 0xCF; i++) {
-    	init_sequenz[pos++]=i;
-    	init_sequenz[pos++]=0x00;
+    char msg[3];
+    if ( len >= sizeof(msg)) {
+        return; // not a channel message
     }
-    ESP_ERROR_CHECK(pos >= 40);
-
-    midi_out(init_sequenz, pos );
-    free(init_sequenz);
+    msg[0] = evt;
+    memcpy(&msg[1], data, len);
+    midi_out(msg, len + 1);
+}
 
+/**
+ * data of one writer, read by other tasks without locking: the
+ * sequence number is odd while the writer changes them
+ */
+void seq_write_begin(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
-void midi_init() {
-    /* Configure parameters of an UART driver,
-     * communication pins and install the driver */
-    uart_config_t uart_config = {
-        .baud_rate = 31250,
-        .data_bits = UART_DATA_8_BITS,
-        .parity    = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
-    };
-    uart_param_config(UART_NUM_2, &uart_config);
-    uart_set_pin(UART_NUM_2, MIDI_TXD, MIDI_RXD, MIDI_RTS, MIDI_CTS);
-    uart_driver_install(UART_NUM_2, BUF_SIZE * 2, 0, 0, NULL, 0);
 
-    midi_reset();
+void seq_write_end(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
 }
 
+/**
+ * copies data written between seq_write_begin and seq_write_end,
+ * returns -1 if the writer kept changing them
+ */
+int seq_read(const uint32_t *seq, void *dst, const void *src, size_t len) {
+    for ( int tries = 0; tries < 10; tries++) {
+        uint32_t s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if ( s & 1) {
+            continue;
+        }
+        memcpy(dst, src, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(seq, __ATOMIC_RELAXED) == s) {
+            return 0;
+        }
+    }
+    return -1;
+}
 
+/**
+ * the entries of n strikes of a tubular bell
+ */
+static void build_strikes(int n) {
+	int i = 0;
+	n = MIN(n, MAX_STRIKES);
+	strikedata[i++] = (t_midi_data) {2, {0xC0, 14}};
+	for ( int k = 0; k < n; k++) {
+		strikedata[i++] = (t_midi_data) {6, {0x90, 76, 0x00, 0x90, 76, 0x60}};
+		strikedata[i++] = (t_midi_data) {0, {0}};
+	}
+	strikedata[i++] = (t_midi_data) {3, {0x90, 76, 0x00}};
+	strikedata[i++] = (t_midi_data) {-1, {0}}; // Ende
+}
 
+/**
+ * plays an entry every STRIKE_US, a new request replaces the strikes
+ */
 static void periodic_timer_callback(void* arg)
 {
-	//int64_t time_since_boot = esp_timer_get_time();
+	int64_t now = hal_time_us();
+	t_strike_req req;
 
-	t_midi_data *evt = &(data[pos]);
-	int l = evt->datalen;
+	while ( hal_queue_receive(strike_queue, &req, 0)) {
+		build_strikes(req.n);
+		data = strikedata;
+		pos = 0;
+		aligned = req.start > 0;
+		next_time = aligned ? req.start : now + STRIKE_US;
+	}
+	if ( data && next_time <= now) {
+		t_midi_data *evt = &(data[pos]);
+		int l = evt->datalen;
 
-	//ESP_LOGI(TAG, "Periodic timer called, time since boot: %lld us, pos=%d l=%d", time_since_boot, pos, l);
-	if (l < 0) {
-		// Schluss, Timer stoppen
-		ESP_ERROR_CHECK(esp_timer_stop(periodic_timer));
-		//ESP_LOGI(TAG, "Periodic timer stopped");
-		return;
-	} else if (l > 0) {
-		midi_out(evt->data, l);
+		if ( aligned) {
+			aligned = false;
+			ESP_LOGI(TAG, "strikes started, alignment error %lld us", now - next_time);
+		}
+		if (l < 0) {
+			// Schluss
+			data = NULL;
+		} else {
+			if (l > 0) {
+				midi_out(evt->data, l);
+			}
+			pos++;
+			next_time += STRIKE_US;
+		}
+	}
+	if ( data) {
+		hal_timer_wake(periodic_timer, MAX(next_time - now, 0));
 	} else {
-		//ESP_LOGI(TAG, "Pause");
+		hal_timer_stop(periodic_timer);
+	}
+	// queued meanwhile, the wake-up may be overwritten
+	if ( hal_queue_pending(strike_queue)) {
+		hal_timer_wake(periodic_timer, 0);
 	}
-	pos++;
-
 }
 
-void play_arr(int ticks, t_midi_data arr[]) {
-
-	if (periodic_timer == NULL) {
-		// timer muss erzeugt werden
-		const esp_timer_create_args_t periodic_timer_args = {
-				.callback =	&periodic_timer_callback,
-				// name is optional, but may help identify the timer when debugging
-				.name = "periodic"
-		};
+/**
+ * plays the events due of the jingle, then waits for the next.
+ * A new jingle replaces the one playing
+ */
+static void jingle_timer_callback(void* arg)
+{
+	const t_jingle *j;
+	while ( hal_queue_receive(jingle_queue, &j, 0)) {
+		jingle = j;
+		jingle_pos = 0;
+		jingle_start = hal_time_us();
+	}
+	if ( !jingle) {
+		return;
+	}
 
-		ESP_ERROR_CHECK(esp_timer_create(&periodic_timer_args, &periodic_timer));
+	int64_t t = hal_time_us() - jingle_start;
+	while ( jingle_pos < jingle->nevents && jingle->evts[jingle_pos].time_us <= t) {
+		const t_jingle_evt *evt = &jingle->evts[jingle_pos++];
+		midi_out((const char *) evt->data, evt->len);
+	}
+	if ( jingle_pos < jingle->nevents) {
+		hal_timer_wake(jingle_timer, jingle->evts[jingle_pos].time_us - t);
 	} else {
-		// Timer stoppen, wenn er läuft
-		esp_timer_stop(periodic_timer);
+		jingle = NULL;
+		hal_timer_stop(jingle_timer);
+	}
+	// queued meanwhile, the wake-up may be overwritten
+	if ( hal_queue_pending(jingle_queue)) {
+		hal_timer_wake(jingle_timer, 0);
 	}
-	pos=0;
-	data=&arr[0]; //arr;
+}
+
+/**
+ * once at startup, before the buttons and the network can play
+ */
+void midi_init() {
+    hal_midi_init();
+    mixer_init();
+    periodic_timer = hal_timer_create_play(&periodic_timer_callback, NULL, "periodic");
+    strike_queue = hal_queue_create(PLAY_REQUESTS, sizeof(t_strike_req));
+    jingle_timer = hal_timer_create_play(&jingle_timer_callback, NULL, "jingle");
+    jingle_queue = hal_queue_create(PLAY_REQUESTS, sizeof(const t_jingle *));
+    midi_reset();
+}
 
-    ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_timer, ticks*1000));
+const t_jingle *find_jingle(const char *name) {
+	for ( const t_jingle *j = jingles; j->name; j++) {
+		if ( !strcmp(j->name, name)) {
+			return j;
+		}
+	}
+	return NULL;
+}
 
+/**
+ * plays a jingle from flash, no file system needed. A jingle playing
+ * is stopped. Returns -1 if there's none with this name
+ */
+int play_jingle(const char *name) {
+	const t_jingle *j = find_jingle(name);
+	if ( !j) {
+		ESP_LOGE(TAG, "no jingle %s", name);
+		return -1;
+	}
+	if ( hal_queue_send(jingle_queue, &j)) {
+		ESP_LOGE(TAG, "jingle %s dropped", name);
+		return -1;
+	}
+	hal_timer_wake(jingle_timer, 0);
+	return 0;
 }
 
 void play_ok() {
-	play_arr(250, okdata);
+	play_jingle("ok");
 }
 
 void play_err() {
-	play_arr(100, errdata);
+	play_jingle("err");
+}
+
+/**
+ * strikes a tubular bell n times, with 'wall_us' > 0 the first strike
+ * at this wall clock time (µs since the epoch), at least STRIKE_US ahead
+ */
+void play_strikes(int n, int64_t wall_us) {
+	t_strike_req req = { n, 0 };
+	if ( wall_us > 0) {
+		// the program change before the first strike
+		req.start = MAX(wall_us - hal_wall_us() + hal_time_us() - STRIKE_US, 1);
+	}
+	if ( hal_queue_send(strike_queue, &req)) {
+		ESP_LOGE(TAG, "strikes dropped");
+		return;
+	}
+	hal_timer_wake(periodic_timer, 0);
 }
 
 
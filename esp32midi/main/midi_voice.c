@@ -0,0 +1,184 @@
+/*
+ * midi_voice.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * voice limiter of the wire: counts the notes sounding on the
+ * synth and keeps them below its polyphony (CONFIG_MIDI_SYNTH_POLYPHONY),
+ * so the SAM2695 never has to steal voices on its own.
+ *
+ * When all voices are busy, the note with the lowest priority gives way:
+ * by channel (drums first, then the lower channels), velocity and age,
+ * the oldest goes first. A sounding note is shortened with a note off,
+ * a new note is dropped together with its note off. The choice only
+ * depends on the song, not on the timing.
+ *
+ * Notes held by the sustain pedal and the release of a note are not
+ * counted, the synth has some spare voices for them.
+ *
+ * Only the mixer calls it, the statistics are read through a sequence
+ * number and cleared by the mixer on request.
+ */
+
+#include "local.h"
+
+#define VOICE_NONE 0xFF
+#define VOICE_DRUM_CHANNEL 9
+
+typedef struct {
+	unsigned char ch;
+	unsigned char note;
+	unsigned char velocity;
+	uint32_t age; // sequence number of the note on
+} t_voice;
+
+static t_voice voices[CONFIG_MIDI_SYNTH_POLYPHONY];
+static int nvoices = 0;
+static unsigned char voice_of[16][128]; // index in voices, VOICE_NONE if off
+static uint32_t dropped_notes[16][128 / 32]; // note offs to swallow
+static uint32_t age = 0;
+static t_voice_stat voice_stat;
+static uint32_t stat_seq = 0;
+static int stat_clear = false; // requested by voice_get_stat
+
+/**
+ * forgets all notes, after a reset of the synth
+ */
+void voice_reset() {
+	memset(voice_of, VOICE_NONE, sizeof(voice_of));
+	memset(dropped_notes, 0, sizeof(dropped_notes));
+	nvoices = 0;
+}
+
+static int channel_priority(int ch) {
+	return ch == VOICE_DRUM_CHANNEL ? 16 : 15 - ch;
+}
+
+/**
+ * true if voice a gives way to b
+ */
+static int lower_priority(const t_voice *a, const t_voice *b) {
+	int pa = channel_priority(a->ch), pb = channel_priority(b->ch);
+	if ( pa != pb) {
+		return pa < pb;
+	}
+	if ( a->velocity != b->velocity) {
+		return a->velocity < b->velocity;
+	}
+	return a->age < b->age;
+}
+
+/**
+ * starts a change of the statistics, a clear requested is done first
+ */
+static void stat_begin() {
+	seq_write_begin(&stat_seq);
+	if ( __atomic_load_n(&stat_clear, __ATOMIC_ACQUIRE)) {
+		memset(&voice_stat, 0, sizeof(voice_stat));
+		voice_stat.peak = nvoices;
+		__atomic_store_n(&stat_clear, false, __ATOMIC_RELEASE);
+	}
+}
+
+static void free_voice(int v) {
+	t_voice *last = &voices[--nvoices];
+	voice_of[voices[v].ch][voices[v].note] = VOICE_NONE;
+	if ( v != nvoices) {
+		voices[v] = *last;
+		voice_of[last->ch][last->note] = v;
+	}
+}
+
+/**
+ * a note on for the synth. Returns VOICE_PLAY to send it, VOICE_DROP if
+ * it gives way, VOICE_STEAL if the note 'off' has to be switched off first
+ */
+int voice_note_on(int ch, int note, int velocity, unsigned char off[3]) {
+	t_voice nv = { ch, note, velocity, age++ };
+	int v = voice_of[ch][note];
+
+	dropped_notes[ch][note / 32] &= ~(1U << (note % 32));
+	if ( v != VOICE_NONE) {
+		// played again, the synth restarts the voice
+		voices[v] = nv;
+		return VOICE_PLAY;
+	}
+	int rc = VOICE_PLAY;
+	if ( nvoices >= CONFIG_MIDI_SYNTH_POLYPHONY) {
+		int victim = 0;
+		for ( int i = 1; i < nvoices; i++) {
+			if ( lower_priority(&voices[i], &voices[victim])) {
+				victim = i;
+			}
+		}
+		if ( !lower_priority(&voices[victim], &nv)) {
+			dropped_notes[ch][note / 32] |= 1U << (note % 32);
+			stat_begin();
+			voice_stat.dropped++;
+			seq_write_end(&stat_seq);
+			return VOICE_DROP;
+		}
+		off[0] = 0x80 | voices[victim].ch;
+		off[1] = voices[victim].note;
+		off[2] = 0x40;
+		free_voice(victim);
+		rc = VOICE_STEAL;
+	}
+	voice_of[ch][note] = nvoices;
+	voices[nvoices++] = nv;
+	stat_begin();
+	voice_stat.peak = MAX(voice_stat.peak, nvoices);
+	if ( rc == VOICE_STEAL) {
+		voice_stat.stolen++;
+	}
+	seq_write_end(&stat_seq);
+	return rc;
+}
+
+/**
+ * a note off for the synth, returns false if the note was dropped and
+ * the note off is not sent
+ */
+int voice_note_off(int ch, int note) {
+	int v = voice_of[ch][note];
+	if ( v != VOICE_NONE) {
+		free_voice(v);
+		return true;
+	}
+	if ( dropped_notes[ch][note / 32] & (1U << (note % 32))) {
+		dropped_notes[ch][note / 32] &= ~(1U << (note % 32));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * all notes of a channel off
+ */
+void voice_channel_off(int ch) {
+	for ( int v = nvoices - 1; v >= 0; v--) {
+		if ( voices[v].ch == ch) {
+			free_voice(v);
+		}
+	}
+	memset(dropped_notes[ch], 0, sizeof(dropped_notes[ch]));
+}
+
+/**
+ * the statistics since the last clear, without locking
+ */
+void voice_get_stat(t_voice_stat *st, int clear) {
+	int active = nvoices; // a single word
+	if ( __atomic_load_n(&stat_clear, __ATOMIC_ACQUIRE)
+			|| seq_read(&stat_seq, st, &voice_stat, sizeof(voice_stat))) {
+		// cleared and no note since, or changing all the time
+		memset(st, 0, sizeof(*st));
+		st->peak = active;
+	}
+	st->limit = CONFIG_MIDI_SYNTH_POLYPHONY;
+	st->active = active;
+	if ( clear) {
+		__atomic_store_n(&stat_clear, true, __ATOMIC_RELEASE);
+	}
+}
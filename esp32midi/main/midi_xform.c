@@ -0,0 +1,310 @@
+/*
+ * midi_xform.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * transforms the channel events of songs: transpose, velocity curves,
+ * channel map and mute.
+ *
+ * The rules matching a song are compiled into lookup tables when the
+ * song is started, per song channel a note map, a velocity map and the
+ * output channel. The mixer only looks up the bytes of an event, a song
+ * without rules has no tables and costs nothing. New rules are compiled
+ * for the running songs and swapped in by the mixer, see
+ * mixer_xform_update.
+ *
+ * Rules as text, one per line, applied one after the other to the tables:
+ *   transpose <channels> <semitones> [song]  notes out of range are left out
+ *   curve <channels> <-100..100> [song]      >0 soft notes louder, <0 softer
+ *   velocity <channels> <min>-<max> [song]   scales velocity 1..127 to min..max
+ *   channel <channels> <1..16> [song]        moves the channels to another one
+ *   mute <channels> [song]                   leaves the channels out
+ * channels: 1..16, lists like 1-8,10 or * for all,
+ * song: beginning of the song file names, without song for all songs
+ */
+
+#include "local.h"
+
+static const char *TAG = "midi_xform";
+
+#define XFORM_NVS_NAMESPACE "xform"
+#define XFORM_NVS_KEY "rules"
+
+typedef struct {
+	int n;
+	t_xform_rule rule[XFORM_MAX_RULES];
+} t_xform_rules;
+
+// xform_set_rules fills the set not in use and swaps the pointer, the
+// songs started meanwhile compile with one or the other. The HTTP task
+// sets the rules one request after the other, a compile takes microseconds
+static t_xform_rules rule_sets[2];
+static t_xform_rules *rules = &rule_sets[0];
+
+static const char *kind_names[] = { "", "transpose", "curve", "velocity", "channel", "mute" };
+
+static int song_matches(const t_xform_rule *r, const char *filepath) {
+	const char *name = strrchr(filepath, '/');
+	name = name ? name + 1 : filepath;
+	return strncmp(name, r->song, strlen(r->song)) == 0;
+}
+
+static void apply_rule(t_xform *xf, const t_xform_rule *r) {
+	for ( int ch = 0; ch < 16; ch++) {
+		if ( !(r->channels & (1 << ch))) {
+			continue;
+		}
+		unsigned char *note = xf->note[ch];
+		unsigned char *vel = xf->velocity[ch];
+		switch (r->kind) {
+		case xform_transpose:
+			for ( int i = 0; i < 128; i++) {
+				int n = note[i] + r->a;
+				note[i] = note[i] == XFORM_DROP || n < 0 || n > 127 ? XFORM_DROP : n;
+			}
+			break;
+		case xform_curve:
+			for ( int i = 1; i < 128; i++) {
+				int v = vel[i] + r->a * vel[i] * (127 - vel[i]) / 12700;
+				vel[i] = MAX(1, MIN(127, v)); // velocity 0 would be a note off
+			}
+			break;
+		case xform_velocity:
+			for ( int i = 1; i < 128; i++) {
+				vel[i] = r->a + (vel[i] - 1) * (r->b - r->a) / 126;
+			}
+			break;
+		case xform_channel:
+			if ( xf->channel[ch] != XFORM_DROP) {
+				xf->channel[ch] = r->a;
+			}
+			break;
+		case xform_mute:
+			xf->channel[ch] = XFORM_DROP;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * the tables for a song, NULL if no rule matches (or no memory)
+ */
+t_xform *xform_compile(const char *filepath) {
+	const t_xform_rules *set = __atomic_load_n(&rules, __ATOMIC_ACQUIRE);
+	t_xform *xf = NULL;
+
+	for ( int i = 0; i < set->n; i++) {
+		if ( !song_matches(&set->rule[i], filepath)) {
+			continue;
+		}
+		if ( !xf) {
+			if ( !(xf = malloc(sizeof(t_xform)))) {
+				ESP_LOGE(TAG, "%s: no memory for transform", filepath);
+				return NULL;
+			}
+			for ( int ch = 0; ch < 16; ch++) {
+				for ( int n = 0; n < 128; n++) {
+					xf->note[ch][n] = n;
+					xf->velocity[ch][n] = n;
+				}
+				xf->channel[ch] = ch;
+			}
+		}
+		apply_rule(xf, &set->rule[i]);
+	}
+	if ( xf) {
+		ESP_LOGI(TAG, "%s: transformed", filepath);
+	}
+	return xf;
+}
+
+static void load_rules() {
+	size_t size = nvs_load_blob(XFORM_NVS_NAMESPACE, XFORM_NVS_KEY, rules->rule, sizeof(rules->rule));
+	rules->n = size / sizeof(t_xform_rule);
+	ESP_LOGI(TAG, "%d rules loaded", rules->n);
+}
+
+void xform_init() {
+	load_rules();
+}
+
+/*
+ * text format
+ */
+
+static const char *parse_channels(const char *s, uint16_t *channels) {
+	*channels = 0;
+	if ( *s == '*') {
+		*channels = 0xFFFF;
+		return s + 1;
+	}
+	while ( *s && !isspace((uchar) *s)) {
+		char *end;
+		long from = strtol(s, &end, 10);
+		long to = from;
+		if ( end == s) {
+			return NULL;
+		}
+		s = end;
+		if ( *s == '-') {
+			to = strtol(s + 1, &end, 10);
+			if ( end == s + 1) {
+				return NULL;
+			}
+			s = end;
+		}
+		if ( from < 1 || to > 16 || from > to) {
+			return NULL;
+		}
+		for ( long ch = from; ch <= to; ch++) {
+			*channels |= 1 << (ch - 1);
+		}
+		if ( *s == ',') {
+			s++;
+		}
+	}
+	return s;
+}
+
+static int format_channels(char *buf, size_t len, uint16_t channels) {
+	if ( channels == 0xFFFF) {
+		return snprintf(buf, len, "*");
+	}
+	int n = 0;
+	for ( int ch = 0; ch < 16; ch++) {
+		if ( !(channels & (1 << ch))) {
+			continue;
+		}
+		int to = ch;
+		while ( to < 15 && (channels & (1 << (to + 1)))) {
+			to++;
+		}
+		if ( to > ch) {
+			n += snprintf(&buf[n], len - MIN(n, len), "%s%d-%d", n ? "," : "", ch + 1, to + 1);
+		} else {
+			n += snprintf(&buf[n], len - MIN(n, len), "%s%d", n ? "," : "", ch + 1);
+		}
+		ch = to;
+	}
+	return n;
+}
+
+/**
+ * parses a rule, see above. returns 0 if ok
+ */
+static int parse_rule(const char *line, void *rule) {
+	t_xform_rule *r = rule;
+	char kind[12];
+	char channels[48];
+	char song[XFORM_SONG_LEN + 1];
+	int a, b, n;
+
+	memset(r, 0, sizeof(t_xform_rule));
+	memset(song, 0, sizeof(song));
+	if ( sscanf(line, "%11s %47s %n", kind, channels, &n) != 2) {
+		return -1;
+	}
+	const char *end = parse_channels(channels, &r->channels);
+	if ( !end || *end || !r->channels) {
+		return -1;
+	}
+	const char *args = line + n;
+
+	if ( !strcmp(kind, "transpose")) {
+		if ( sscanf(args, "%d %16s", &a, song) < 1 || a < -127 || a > 127) {
+			return -1;
+		}
+		r->kind = xform_transpose;
+		r->a = a;
+	} else if ( !strcmp(kind, "curve")) {
+		if ( sscanf(args, "%d %16s", &a, song) < 1 || a < -100 || a > 100) {
+			return -1;
+		}
+		r->kind = xform_curve;
+		r->a = a;
+	} else if ( !strcmp(kind, "velocity")) {
+		if ( sscanf(args, "%d-%d %16s", &a, &b, song) < 2 || a < 1 || b > 127 || a > b) {
+			return -1;
+		}
+		r->kind = xform_velocity;
+		r->a = a;
+		r->b = b;
+	} else if ( !strcmp(kind, "channel")) {
+		if ( sscanf(args, "%d %16s", &a, song) < 1 || a < 1 || a > 16) {
+			return -1;
+		}
+		r->kind = xform_channel;
+		r->a = a - 1;
+	} else if ( !strcmp(kind, "mute")) {
+		sscanf(args, "%16s", song);
+		r->kind = xform_mute;
+	} else {
+		return -1;
+	}
+	if ( strlen(song) >= XFORM_SONG_LEN) {
+		return -1;
+	}
+	strcpy(r->song, song);
+	return 0;
+}
+
+/**
+ * replaces all rules by the rules in 'text', one per line, and applies
+ * them to the running songs. Empty lines and lines starting with # are ignored.
+ * returns 0 if ok, otherwise the rules are unchanged and err tells why
+ */
+int xform_set_rules(const char *text, char *err, size_t errlen) {
+	t_xform_rules *set = rules == &rule_sets[0] ? &rule_sets[1] : &rule_sets[0];
+	int n = parse_rule_lines(text, parse_rule, set->rule, sizeof(t_xform_rule), XFORM_MAX_RULES, err, errlen);
+	if ( n < 0) {
+		ESP_LOGE(TAG, "%s", err);
+		return -1;
+	}
+	set->n = n;
+	__atomic_store_n(&rules, set, __ATOMIC_RELEASE);
+	if ( nvs_save_blob(XFORM_NVS_NAMESPACE, XFORM_NVS_KEY, set->rule, n * sizeof(t_xform_rule))) {
+		snprintf(err, errlen, "rules not stored");
+	}
+	ESP_LOGI(TAG, "%d rules set", n);
+	mixer_xform_update();
+	return 0;
+}
+
+/**
+ * the rules as text, returns the length
+ */
+int xform_get_rules(char *buf, size_t len) {
+	const t_xform_rules *set = __atomic_load_n(&rules, __ATOMIC_ACQUIRE);
+	int n = 0;
+	buf[0] = '\0';
+	for ( int i = 0; i < set->n && n < len; i++) {
+		const t_xform_rule *r = &set->rule[i];
+		char channels[48];
+		format_channels(channels, sizeof(channels), r->channels);
+		n += snprintf(&buf[n], len - n, "%s %s", kind_names[r->kind], channels);
+		if ( n >= len) {
+			break;
+		}
+		switch (r->kind) {
+		case xform_transpose:
+		case xform_curve:
+			n += snprintf(&buf[n], len - n, " %d", r->a);
+			break;
+		case xform_velocity:
+			n += snprintf(&buf[n], len - n, " %d-%d", r->a, r->b);
+			break;
+		case xform_channel:
+			n += snprintf(&buf[n], len - n, " %d", r->a + 1);
+			break;
+		default:
+			break;
+		}
+		if ( n < len) {
+			n += snprintf(&buf[n], len - n, "%s%s\n", r->song[0] ? " " : "", r->song);
+		}
+	}
+	return MIN(n, len);
+}
@@ -0,0 +1,550 @@
+/*
+ * rtp_midi.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * network MIDI: one RTP-MIDI session (RFC 6295) with the AppleMIDI
+ * session protocol, as used by macOS, rtpMIDI on Windows and rtpmidid.
+ * The DAW invites, the doorbell accepts on the control port
+ * RTP_MIDI_PORT and the data port RTP_MIDI_PORT + 1.
+ *
+ * Clock sync: the peer sends CK0, gets CK1 with our time and sends CK2,
+ * from the three time stamps follows the offset of its clock. The drift
+ * between the syncs is measured from the first one. The RTP
+ * time stamps of the MIDI commands are converted to our clock with it
+ * and played RTP_JITTER_US later, so the network jitter is taken out.
+ * Commands are never held longer than RTP_MAX_DELAY_US, late ones are
+ * played at once. The task puts the commands into an inbox (a lock-free
+ * ring) and wakes the timer. The jitter buffer is a queue sorted by
+ * time, filled from the inbox by the timer, which is armed for the
+ * first one, so only the timer uses it.
+ *
+ * Channel messages go on the wire like MIDI thru (midi_in_send) but are
+ * counted here, system and realtime messages and the recovery journal
+ * are skipped.
+ *
+ * rtp_midi_packet is the whole protocol, the time comes as parameter.
+ * The task only reads the sockets, so the session can be simulated,
+ * see ../host.
+ */
+
+#include "local.h"
+
+static const char *TAG = "rtp_midi";
+
+#define RTP_JITTER_US 3000 // playout delay
+#define RTP_MAX_DELAY_US 20000 // no command is held longer
+#define RTP_LATE_US 1000
+#define RTP_SLACK_US 200 // commands due within this time are sent together
+#define RTP_QUEUE 128 // commands, power of 2
+#define RTP_TIMEOUT_US (60 * 1000000LL) // a silent session may be replaced
+#define RTP_FEEDBACK_US 1000000 // receiver feedback, the peer may trim its journal
+#define RTP_CLOCK_US 100 // time stamp unit of AppleMIDI
+#define RTP_DRIFT_BASE_US (5 * 1000000LL) // shortest time for measuring the drift
+#define RTP_CLOCK_JUMP_US 1000000 // the peer's clock was set, start again
+#define RTP_NAME "esp32midi"
+#define RTP_PACKET_MAX 512
+
+#define APPLEMIDI_CMD(a, b) (((a) << 8) | (b))
+
+typedef struct {
+	int64_t due;
+	unsigned char msg[3];
+} t_rtp_evt;
+
+// session
+static int session = 0; // 0 none, 1 control port accepted, 2 data port too
+static uint32_t my_ssrc = 0;
+static uint32_t peer_ssrc = 0;
+static int64_t last_heard = 0;
+static uint16_t last_seq = 0;
+static int have_seq = false;
+static int64_t feedback_time = 0;
+
+// clock
+static int clock_synced = false; // offset from CK, otherwise from the first packet
+static int have_offset = false;
+static int64_t offset_us = 0; // peer clock - our clock at sync_time
+static int64_t sync_time = 0;
+static int64_t anchor_time = 0; // first sync, for the drift
+static int64_t anchor_offset = 0;
+static long drift_ppb = 0; // the peer clock is faster by this
+
+// written by the task, read by the timer
+static t_rtp_evt inbox[RTP_QUEUE];
+static uint32_t inbox_head = 0;
+static uint32_t inbox_tail = 0;
+
+// jitter buffer, sorted by due time
+static t_rtp_evt queue[RTP_QUEUE];
+static uint32_t queue_head = 0;
+static uint32_t queue_tail = 0;
+static t_hal_timer rtp_timer = NULL;
+
+static t_rtp_send rtp_send = NULL;
+static void *rtp_send_ctx = NULL;
+
+static t_rtp_stat rtp_stat;
+
+static uint32_t get_be(const unsigned char *p, int len) {
+	uint32_t v = 0;
+	for ( int i = 0; i < len; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static void put_be(unsigned char *p, uint64_t v, int len) {
+	for ( int i = len - 1; i >= 0; i--) {
+		p[i] = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+static void send_packet(int data_port, const unsigned char *pkt, int len) {
+	if ( rtp_send) {
+		rtp_send(data_port, pkt, len, rtp_send_ctx);
+	}
+}
+
+/*
+ * jitter buffer
+ */
+
+/**
+ * puts a command into the inbox, by the task
+ */
+static void inbox_put(int64_t due, const unsigned char *msg) {
+	uint32_t head = inbox_head;
+	if ( head - __atomic_load_n(&inbox_tail, __ATOMIC_ACQUIRE) >= RTP_QUEUE) {
+		__atomic_add_fetch(&rtp_stat.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	t_rtp_evt *evt = &inbox[head & (RTP_QUEUE - 1)];
+	evt->due = due;
+	memcpy(evt->msg, msg, sizeof(evt->msg));
+	__atomic_store_n(&inbox_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int inbox_pending() {
+	return __atomic_load_n(&inbox_head, __ATOMIC_ACQUIRE) != inbox_tail;
+}
+
+/**
+ * puts a command into the queue, by the timer
+ */
+static void queue_put(const t_rtp_evt *in) {
+	if ( queue_head - queue_tail >= RTP_QUEUE) {
+		__atomic_add_fetch(&rtp_stat.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	// mostly the last one, otherwise move the later ones
+	uint32_t i = queue_head++;
+	while ( i != queue_tail && queue[(i - 1) & (RTP_QUEUE - 1)].due > in->due) {
+		queue[i & (RTP_QUEUE - 1)] = queue[(i - 1) & (RTP_QUEUE - 1)];
+		i--;
+	}
+	queue[i & (RTP_QUEUE - 1)] = *in;
+	rtp_stat.events++;
+}
+
+static void rtp_arm() {
+	if ( queue_head != queue_tail) {
+		int64_t wait = queue[queue_tail & (RTP_QUEUE - 1)].due - hal_time_us();
+		hal_timer_wake(rtp_timer, MAX(wait, 0));
+	} else {
+		hal_timer_stop(rtp_timer);
+	}
+	// put meanwhile, the wake-up may be overwritten
+	if ( inbox_pending()) {
+		hal_timer_wake(rtp_timer, 0);
+	}
+}
+
+static void rtp_timer_callback(void *arg) {
+	uint32_t head = __atomic_load_n(&inbox_head, __ATOMIC_ACQUIRE);
+	while ( inbox_tail != head) {
+		queue_put(&inbox[inbox_tail & (RTP_QUEUE - 1)]);
+		__atomic_store_n(&inbox_tail, inbox_tail + 1, __ATOMIC_RELEASE);
+	}
+	int64_t now = hal_time_us();
+	while ( queue_head != queue_tail) {
+		t_rtp_evt *evt = &queue[queue_tail & (RTP_QUEUE - 1)];
+		if ( evt->due > now + RTP_SLACK_US) {
+			break;
+		}
+		if ( midi_in_send(evt->msg[0], &evt->msg[1])) {
+			__atomic_add_fetch(&rtp_stat.dropped, 1, __ATOMIC_RELAXED);
+		}
+		queue_tail++;
+	}
+	rtp_arm();
+}
+
+/*
+ * session protocol, packets start with FF FF and a two letter command
+ */
+
+static void send_session(int data_port, int cmd, uint32_t token) {
+	unsigned char pkt[16 + sizeof(RTP_NAME)];
+	int len = 16;
+	put_be(pkt, 0xFFFF, 2);
+	put_be(pkt + 2, cmd, 2);
+	put_be(pkt + 4, 2, 4); // protocol version
+	put_be(pkt + 8, token, 4);
+	put_be(pkt + 12, my_ssrc, 4);
+	if ( cmd == APPLEMIDI_CMD('O', 'K')) {
+		memcpy(pkt + 16, RTP_NAME, sizeof(RTP_NAME));
+		len += sizeof(RTP_NAME);
+	}
+	send_packet(data_port, pkt, len);
+}
+
+/**
+ * peer clock - our clock at 'now'
+ */
+static int64_t offset_at(int64_t now) {
+	return offset_us + (now - sync_time) * drift_ppb / 1000000000LL;
+}
+
+static void end_session() {
+	if ( session) {
+		ESP_LOGI(TAG, "session with %s ended", rtp_stat.peer);
+	}
+	session = 0;
+	have_seq = false;
+	have_offset = false;
+	clock_synced = false;
+	drift_ppb = 0;
+	rtp_stat.active = false;
+}
+
+static void invitation(int data_port, const unsigned char *pkt, int len, int64_t now) {
+	uint32_t token = get_be(pkt + 8, 4);
+	uint32_t ssrc = get_be(pkt + 12, 4);
+
+	if ( session && ssrc != peer_ssrc && now - last_heard < RTP_TIMEOUT_US) {
+		ESP_LOGW(TAG, "invitation rejected, session with %s", rtp_stat.peer);
+		send_session(data_port, APPLEMIDI_CMD('N', 'O'), token);
+		return;
+	}
+	if ( !data_port) {
+		if ( session && ssrc != peer_ssrc) {
+			end_session();
+		}
+		peer_ssrc = ssrc;
+		session = 1;
+		snprintf(rtp_stat.peer, sizeof(rtp_stat.peer), "%.*s", len - 16, (const char *) pkt + 16);
+	} else if ( session && ssrc == peer_ssrc) {
+		if ( session == 1) {
+			rtp_stat.sessions++;
+			rtp_stat.active = true;
+			ESP_LOGI(TAG, "session with %s", rtp_stat.peer);
+		}
+		session = 2;
+	} else {
+		send_session(data_port, APPLEMIDI_CMD('N', 'O'), token);
+		return;
+	}
+	last_heard = now;
+	send_session(data_port, APPLEMIDI_CMD('O', 'K'), token);
+}
+
+/**
+ * clock sync, the peer initiates. Time stamps in 100 µs
+ */
+static void clock_sync(int data_port, const unsigned char *pkt, int64_t now) {
+	unsigned char reply[36];
+	int count = pkt[8];
+
+	if ( count == 0) {
+		memcpy(reply, pkt, sizeof(reply));
+		put_be(reply + 4, my_ssrc, 4);
+		reply[8] = 1;
+		put_be(reply + 20, now / RTP_CLOCK_US, 8);
+		send_packet(data_port, reply, sizeof(reply));
+	} else if ( count == 2) {
+		int64_t ts1 = get_be(pkt + 12, 4) * (int64_t) 0x100000000LL + get_be(pkt + 16, 4);
+		int64_t ts2 = get_be(pkt + 20, 4) * (int64_t) 0x100000000LL + get_be(pkt + 24, 4);
+		int64_t ts3 = get_be(pkt + 28, 4) * (int64_t) 0x100000000LL + get_be(pkt + 32, 4);
+		int64_t rtt = (ts3 - ts1) * RTP_CLOCK_US;
+		int64_t offset = (ts1 + ts3) * RTP_CLOCK_US / 2 - ts2 * RTP_CLOCK_US;
+		int64_t t = ts2 * RTP_CLOCK_US;
+		if ( rtt < 0 || (clock_synced && rtt > 4 * rtp_stat.rtt_us + RTP_LATE_US)) {
+			return; // delayed on the way, the offset isn't better than the one we have
+		}
+		if ( clock_synced && llabs(offset - offset_at(t)) > RTP_CLOCK_JUMP_US) {
+			ESP_LOGW(TAG, "clock of %s jumped", rtp_stat.peer);
+			clock_synced = false;
+		}
+		if ( clock_synced) {
+			// a half step, the network delay differs between the syncs
+			int64_t predicted = offset_at(t);
+			offset_us = predicted + (offset - predicted) / 2;
+			if ( t - anchor_time >= RTP_DRIFT_BASE_US) {
+				drift_ppb = (offset - anchor_offset) * 1000000000LL / (t - anchor_time);
+			}
+		} else {
+			offset_us = offset;
+			anchor_time = t;
+			anchor_offset = offset;
+			drift_ppb = 0;
+		}
+		sync_time = t;
+		clock_synced = true;
+		have_offset = true;
+		rtp_stat.rtt_us = rtt;
+		rtp_stat.drift_ppb = drift_ppb;
+		rtp_stat.syncs++;
+	}
+}
+
+static void session_packet(int data_port, const unsigned char *pkt, int len, int64_t now) {
+	int cmd = get_be(pkt + 2, 2);
+
+	if ( cmd == APPLEMIDI_CMD('I', 'N') && len >= 16) {
+		invitation(data_port, pkt, len, now);
+	} else if ( cmd == APPLEMIDI_CMD('B', 'Y') && len >= 16) {
+		if ( session && get_be(pkt + 12, 4) == peer_ssrc) {
+			end_session();
+		}
+	} else if ( cmd == APPLEMIDI_CMD('C', 'K') && len >= 36) {
+		if ( session == 2 && get_be(pkt + 4, 4) == peer_ssrc) {
+			last_heard = now;
+			clock_sync(data_port, pkt, now);
+		}
+	}
+}
+
+/*
+ * RTP packets with a MIDI command list
+ */
+
+static void feedback(int64_t now) {
+	unsigned char pkt[12];
+	if ( now - feedback_time < RTP_FEEDBACK_US) {
+		return;
+	}
+	feedback_time = now;
+	put_be(pkt, 0xFFFF, 2);
+	put_be(pkt + 2, APPLEMIDI_CMD('R', 'S'), 2);
+	put_be(pkt + 4, my_ssrc, 4);
+	put_be(pkt + 8, (uint32_t) last_seq << 16, 4);
+	send_packet(false, pkt, sizeof(pkt));
+}
+
+/**
+ * our time of a command, played RTP_JITTER_US later than sent
+ * but never later than RTP_MAX_DELAY_US from now
+ */
+static int64_t due_time(int64_t peer_ticks, int64_t now) {
+	int64_t due = peer_ticks * RTP_CLOCK_US - offset_at(now) + RTP_JITTER_US;
+	if ( due < now) {
+		// longer on the way than the jitter buffer
+		long late = now - due;
+		if ( late > RTP_LATE_US) {
+			rtp_stat.late++;
+		}
+		rtp_stat.max_late_us = MAX(rtp_stat.max_late_us, late);
+		return now;
+	}
+	if ( due > now + RTP_MAX_DELAY_US) {
+		rtp_stat.clamped++;
+		return now + RTP_MAX_DELAY_US;
+	}
+	return due;
+}
+
+static void data_packet(const unsigned char *pkt, int len, int64_t now) {
+	if ( session != 2 || get_be(pkt + 8, 4) != peer_ssrc) {
+		return;
+	}
+	last_heard = now;
+	rtp_stat.packets++;
+
+	uint16_t seq = get_be(pkt + 2, 2);
+	if ( have_seq) {
+		uint16_t d = seq - last_seq;
+		if ( d == 0) {
+			return; // duplicate
+		}
+		if ( d < 0x8000) {
+			rtp_stat.lost += d - 1;
+			last_seq = seq;
+		} else {
+			rtp_stat.reordered++;
+		}
+	} else {
+		have_seq = true;
+		last_seq = seq;
+	}
+
+	// 32 bit time stamp of the peer, extended by our estimate of its clock
+	uint32_t ts = get_be(pkt + 4, 4);
+	if ( !have_offset) {
+		offset_us = (int64_t) ts * RTP_CLOCK_US - now;
+		sync_time = now;
+		have_offset = true;
+	}
+	int64_t peer_now = (now + offset_at(now)) / RTP_CLOCK_US;
+	int64_t ticks = peer_now + (int32_t) (ts - (uint32_t) peer_now);
+
+	// command section header: B J Z P LEN
+	int p = 12;
+	int flags = pkt[p];
+	int cmdlen = flags & 0x0F;
+	if ( flags & 0x80) {
+		cmdlen = (cmdlen << 8) | pkt[p + 1];
+		p++;
+	}
+	p++;
+	int end = MIN(len, p + cmdlen);
+	int first = true;
+	unsigned char running = 0;
+	unsigned char msg[3];
+	int put = false;
+
+	while ( p < end) {
+		if ( !first || (flags & 0x20)) {
+			// delta time, up to 4 bytes
+			uint32_t delta = 0;
+			int n = 0;
+			do {
+				delta = (delta << 7) | (pkt[p] & 0x7F);
+			} while ( (pkt[p++] & 0x80) && ++n < 4 && p < end);
+			ticks += delta;
+		}
+		first = false;
+		if ( p >= end) {
+			break;
+		}
+		unsigned char status = running;
+		if ( pkt[p] & 0x80) {
+			status = pkt[p++];
+		} else if ( !running) {
+			break; // data without status, the rest can't be parsed
+		}
+		if ( status == 0xF0 || status == 0xF7) {
+			// sysex or a segment of it, up to F7, F0 or F4
+			while ( p < end && pkt[p] != 0xF7 && pkt[p] != 0xF0 && pkt[p] != 0xF4) {
+				p++;
+			}
+			p++;
+			running = 0;
+			continue;
+		}
+		if ( status >= 0xF8) {
+			continue; // realtime
+		}
+		if ( status >= 0xF0) {
+			p += status == 0xF2 ? 2 : (status == 0xF1 || status == 0xF3) ? 1 : 0;
+			running = 0;
+			continue;
+		}
+		int n = (status & 0xE0) == 0xC0 ? 1 : 2; // program change, channel pressure
+		if ( p + n > end) {
+			break;
+		}
+		msg[0] = status;
+		msg[1] = pkt[p] & 0x7F;
+		msg[2] = n > 1 ? pkt[p + 1] & 0x7F : 0;
+		p += n;
+		running = status;
+		inbox_put(due_time(ticks, now), msg);
+		put = true;
+	}
+	if ( put) {
+		// the timer sorts them in
+		hal_timer_wake(rtp_timer, 0);
+	}
+
+	feedback(now);
+}
+
+/**
+ * processes a received packet, 'data_port' tells whether it came on the
+ * data port or on the control port. Replies go to rtp_send
+ */
+void rtp_midi_packet(int data_port, const unsigned char *pkt, int len, int64_t now) {
+	if ( len >= 4 && pkt[0] == 0xFF && pkt[1] == 0xFF) {
+		session_packet(data_port, pkt, len, now);
+	} else if ( data_port && len >= 13 && (pkt[0] & 0xC0) == 0x80) {
+		data_packet(pkt, len, now);
+	}
+}
+
+void rtp_midi_set_send(t_rtp_send send, void *ctx) {
+	rtp_send = send;
+	rtp_send_ctx = ctx;
+}
+
+void rtp_midi_get_stat(t_rtp_stat *s) {
+	*s = rtp_stat;
+	s->offset_us = have_offset ? offset_at(hal_time_us()) : 0;
+}
+
+/*
+ * sockets
+ */
+
+static int socks[2] = { -1, -1 };
+static struct sockaddr_in peers[2];
+
+static void socket_send(int data_port, const unsigned char *pkt, int len, void *ctx) {
+	sendto(socks[data_port], pkt, len, 0, (struct sockaddr *) &peers[data_port], sizeof(peers[0]));
+}
+
+static void rtp_task(void *arg) {
+	unsigned char buf[RTP_PACKET_MAX];
+
+	for ( int i = 0; i < 2; i++) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(RTP_MIDI_PORT + i);
+		socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if ( socks[i] < 0 || bind(socks[i], (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			ESP_LOGE(TAG, "no socket for port %d", RTP_MIDI_PORT + i);
+			vTaskDelete(NULL);
+			return;
+		}
+	}
+	rtp_midi_set_send(socket_send, NULL);
+	ESP_LOGI(TAG, "listening on port %d", RTP_MIDI_PORT);
+
+	while (1) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(socks[0], &fds);
+		FD_SET(socks[1], &fds);
+		if ( select(MAX(socks[0], socks[1]) + 1, &fds, NULL, NULL, NULL) <= 0) {
+			continue;
+		}
+		for ( int i = 0; i < 2; i++) {
+			if ( !FD_ISSET(socks[i], &fds)) {
+				continue;
+			}
+			struct sockaddr_in from;
+			socklen_t fromlen = sizeof(from);
+			int n = recvfrom(socks[i], buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+			if ( n > 0) {
+				// replies go to the sender, the peer uses the same ports all the time
+				peers[i] = from;
+				rtp_midi_packet(i, buf, n, hal_time_us());
+			}
+		}
+	}
+}
+
+void rtp_midi_init() {
+	if ( rtp_timer) {
+		return;
+	}
+	my_ssrc = esp_random();
+	rtp_timer = hal_timer_create_play(&rtp_timer_callback, NULL, "rtp_midi");
+	if ( hal_task_start(rtp_task, "rtp_midi", 4096, RTP_MIDI_PRIORITY, CONFIG_MIDI_NET_CORE, NULL)) {
+		ESP_LOGE(TAG, "task not started");
+	}
+}
@@ -21,9 +21,19 @@ void sntp_sync_time(struct timeval *tv)
 }
 #endif
 
+/**
+ * the local time of the chimes, valid before the time is set
+ */
+void init_timezone()
+{
+    setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+    tzset();
+}
+
 void time_sync_notification_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "Notification of a time synchronization event");
+    chime_reschedule();
 }
 
 void test_sntp()
@@ -43,10 +53,7 @@ void test_sntp()
 
     char strftime_buf[64];
 
-    // Set timezone to Eastern Standard Time and print local time
-
-    setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
-    tzset();
+    init_timezone();
     localtime_r(&now, &timeinfo);
     strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
     ESP_LOGI(TAG, "The current date/time in Berlin is: %s", strftime_buf);
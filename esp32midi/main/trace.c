@@ -0,0 +1,197 @@
+/*
+ * trace.c
+ *
+ *  Created on: 19 Oct 2026
+ *      Author: ankrysm
+ *
+ * binary trace of the hot paths instead of log text: a record is a
+ * time stamp, an event id and two numbers. Writers take a slot with an
+ * atomic increment and mark it complete with its sequence number, so
+ * tracing works from ISRs and both cores without locks. Old records are
+ * overwritten.
+ *
+ * The export is Chrome trace-event JSON, load it in chrome://tracing
+ * or https://ui.perfetto.dev
+ */
+
+#include "local.h"
+
+#define TRACE_SIZE 512 // records, power of 2
+#define TRACE_MASK (TRACE_SIZE - 1)
+
+typedef struct {
+	int64_t time;
+	uint32_t seq; // index + 1 when complete, 0 while written
+	uint16_t id;
+	uint16_t core;
+	int32_t a;
+	int32_t b;
+} t_trace_rec;
+
+// how the events are shown, ph: i instant, b/e begin/end with id 'a'
+typedef struct {
+	uint16_t id;
+	char ph;
+	const char *name;
+	const char *a;
+	const char *b;
+} t_trace_def;
+
+static const t_trace_def trace_defs[] = {
+	{ trc_button_isr, 'i', "button isr", "pin", NULL },
+	{ trc_button_press, 'i', "button press", "pin", "level_sum" },
+	{ trc_button_ignored, 'i', "button ignored", "pin", "level_sum" },
+	{ trc_button_queued, 'i', "button queued", "pin", "level_sum" },
+	{ trc_upload_begin, 'b', "upload", "id", "size" },
+	{ trc_upload_chunk, 'i', "upload chunk", "remaining", "received" },
+	{ trc_upload_end, 'e', "upload", "id", "rc" },
+	{ trc_http_play, 'i', "http play", "player", "start_ms" },
+	{ trc_random_entry, 'i', "random entry", "index", "is_song" },
+	{ trc_random_pick, 'i', "random pick", "r", "max" },
+	{ trc_song_open_begin, 'b', "song open", "id", "size" },
+	{ trc_track_chunk, 'i', "track chunk", "track", "len" },
+	{ trc_song_open_end, 'e', "song open", "id", "tracks" },
+	{ trc_track_end, 'i', "track end", "track", "ticks" },
+	{ trc_player_start, 'b', "playing", "player", "start_ms" },
+	{ trc_player_end, 'e', "playing", "player", "duration_ms" },
+	{ trc_mixer_tick, 'i', "mixer tick", "players", "late_us" },
+	{ trc_player_align, 'i', "aligned start", "player", "error_us" },
+	{ trc_player_first_out, 'i', "first output", "player", "bytes" },
+	{ trc_player_shift, 'i', "start corrected", "player", "shift_us" },
+	{ trc_player_chase, 'i', "chase", "player", "bytes" },
+	{ trc_channel_shared, 'i', "channel shared", "player", "channel" },
+	{ trc_mixer_rate, 'i', "rate", "percent", "players" },
+	{ trc_mixer_idle, 'i', "all players stopped", "events", "dropped" },
+	{ trc_song_decoded, 'i', "song decoded", "events", "read_us" },
+	{ trc_chime_fire, 'i', "chime", "rule", "quiet" },
+};
+
+static const char *subsys_names[TRACE_SUBSYSTEMS] = { "gpio", "http", "file", "mixer", "chime" };
+
+static DRAM_ATTR t_trace_rec ring[TRACE_SIZE];
+static uint32_t head = 0; // next index to write
+
+uint32_t trace_mask = TRACE_ALL;
+
+/**
+ * writes a record, callable from ISRs
+ */
+void IRAM_ATTR trace_put(uint16_t id, int32_t a, int32_t b) {
+	uint32_t idx = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	t_trace_rec *r = &ring[idx & TRACE_MASK];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->time = hal_time_us();
+	r->id = id;
+	r->core = hal_core_id();
+	r->a = a;
+	r->b = b;
+	__atomic_store_n(&r->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * enables the subsystems of 'mask' and forgets the old records
+ */
+void trace_set_mask(uint32_t mask) {
+	trace_mask = mask;
+	for ( int i = 0; i < TRACE_SIZE; i++) {
+		__atomic_store_n(&ring[i].seq, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * copies record 'idx', false if it was overwritten or is incomplete
+ */
+static int trace_get(uint32_t idx, t_trace_rec *rec) {
+	t_trace_rec *r = &ring[idx & TRACE_MASK];
+	if ( __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != idx + 1) {
+		return false;
+	}
+	*rec = *r;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	// a writer may have taken the slot while copying
+	return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == idx + 1;
+}
+
+/**
+ * index of the next record
+ */
+uint32_t trace_head() {
+	return __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * looks for a record 'id' from index '*idx' on, sets '*idx' behind it.
+ * Returns 0 and its time if found, -1 if not
+ */
+int trace_find(uint32_t *idx, uint16_t id, int64_t *time) {
+	t_trace_rec rec;
+	uint32_t end = trace_head();
+	uint32_t start = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+
+	for ( uint32_t i = *idx > start ? *idx : start; i != end; i++) {
+		if ( trace_get(i, &rec) && rec.id == id) {
+			*idx = i + 1;
+			*time = rec.time;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static const t_trace_def *trace_def(uint16_t id) {
+	for ( int i = 0; i < sizeof(trace_defs) / sizeof(trace_defs[0]); i++) {
+		if ( trace_defs[i].id == id) {
+			return &trace_defs[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * exports the records as Chrome trace-event JSON, 'put' gets the text
+ * piece by piece. Returns the number of records, -1 if 'put' failed
+ */
+int trace_export(t_trace_put put, void *ctx) {
+	char txt[256];
+	t_trace_rec rec;
+	int n = 0;
+
+	uint32_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	uint32_t start = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+
+	if ( put("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", ctx)) {
+		return -1;
+	}
+	for ( uint32_t idx = start; idx != end; idx++) {
+		if ( !trace_get(idx, &rec)) {
+			continue;
+		}
+		const t_trace_def *def = trace_def(rec.id);
+		int subsys = rec.id >> 8;
+		if ( !def || subsys >= TRACE_SUBSYSTEMS) {
+			continue;
+		}
+		int len = snprintf(txt, sizeof(txt),
+				"%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%d",
+				n ? ",\n" : "\n", def->name, subsys_names[subsys], def->ph, (long long) rec.time, rec.core);
+		if ( def->ph == 'i') {
+			len += snprintf(txt + len, sizeof(txt) - len, ",\"s\":\"t\"");
+		} else {
+			len += snprintf(txt + len, sizeof(txt) - len, ",\"id\":%d", rec.a);
+		}
+		len += snprintf(txt + len, sizeof(txt) - len, ",\"args\":{\"%s\":%d", def->a, rec.a);
+		if ( def->b) {
+			len += snprintf(txt + len, sizeof(txt) - len, ",\"%s\":%d", def->b, rec.b);
+		}
+		snprintf(txt + len, sizeof(txt) - len, "}}");
+		if ( put(txt, ctx)) {
+			return -1;
+		}
+		n++;
+	}
+	if ( put("\n]}\n", ctx)) {
+		return -1;
+	}
+	return n;
+}
@@ -7,6 +7,9 @@
 
 #include "local.h"
 
+static const char *TAG = "util";
+
+#ifndef MIDI_HOST
 #define BLUE_GPIO 2
 void led_init() {
     gpio_pad_select_gpio(BLUE_GPIO);
@@ -21,7 +24,96 @@ void blue_on() {
 void blue_off() {
 	gpio_set_level(BLUE_GPIO, 0);
 }
+#endif
+
+/**
+ * loads a blob of at most 'size' bytes stored by nvs_save_blob,
+ * returns its length, 0 if none is stored
+ */
+size_t nvs_load_blob(const char *name, const char *key, void *data, size_t size) {
+	nvs_handle h;
+	if ( nvs_open(name, NVS_READONLY, &h) != ESP_OK) {
+		ESP_LOGI(TAG, "%s: nothing stored", name);
+		return 0;
+	}
+	if ( nvs_get_blob(h, key, data, &size) != ESP_OK) {
+		size = 0;
+	}
+	nvs_close(h);
+	return size;
+}
 
+/**
+ * stores a blob, removes it if 'size' is 0. Returns 0 if ok
+ */
+int nvs_save_blob(const char *name, const char *key, const void *data, size_t size) {
+	nvs_handle h;
+	int rc = -1;
+	if ( nvs_open(name, NVS_READWRITE, &h) != ESP_OK) {
+		ESP_LOGE(TAG, "%s: nvs_open failed", name);
+		return -1;
+	}
+	do {
+		esp_err_t err = size > 0 ? nvs_set_blob(h, key, data, size) : nvs_erase_key(h, key);
+		if ( err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+			ESP_LOGE(TAG, "%s: storing %s failed: %d", name, key, err);
+			break;
+		}
+		if ( nvs_commit(h) != ESP_OK) {
+			ESP_LOGE(TAG, "%s: nvs_commit failed", name);
+			break;
+		}
+		rc = 0;
+	} while(0);
+	nvs_close(h);
+	return rc;
+}
 
+/**
+ * parses rules as text, one per line, into 'rules' of 'size' bytes each.
+ * Empty lines and lines starting with # are ignored. Returns the number
+ * of rules, -1 if a line is invalid or there are more than 'max', err
+ * tells why then
+ */
+int parse_rule_lines(const char *text, t_parse_rule parse, void *rules, size_t size, int max,
+		char *err, size_t errlen) {
+	int n = 0;
+	int lineno = 0;
+	const char *s = text;
 
+	snprintf(err, errlen, "ok");
+	while ( *s) {
+		char line[80];
+		size_t len = strcspn(s, "\r\n");
+		lineno++;
+		if ( len >= sizeof(line)) {
+			snprintf(err, errlen, "line %d: longer than %d characters", lineno, (int) sizeof(line) - 1);
+			return -1;
+		}
+		memcpy(line, s, len);
+		line[len] = '\0';
+		s += len;
+		// one line end, \r\n or \n (or \r)
+		if ( *s == '\r') {
+			s++;
+		}
+		if ( *s == '\n') {
+			s++;
+		}
 
+		const char *p = line + strspn(line, " \t");
+		if ( !*p || *p == '#') {
+			continue;
+		}
+		if ( n >= max) {
+			snprintf(err, errlen, "more than %d rules", max);
+			return -1;
+		}
+		if ( parse(p, (char *) rules + n * size)) {
+			snprintf(err, errlen, "line %d: invalid rule '%s'", lineno, p);
+			return -1;
+		}
+		n++;
+	}
+	return n;
+}